@@ -0,0 +1,406 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <vector>
+#include <array>
+#include <algorithm>
+
+#include "render_type.hpp"
+#include "random_engine.hpp"
+#include "parallel_for.hpp"
+#include "tile_scheduler.hpp"
+
+/*
+積算値の型
+1 にすると float で積算し、8Kなどでメモリと帯域を半分にできる (タイル内の積算は double のまま)
+*/
+#define LC_ACCUMLATION_FLOAT 0
+
+namespace lc {
+#if LC_ACCUMLATION_FLOAT
+	typedef float AccumlationValue;
+#else
+	typedef double AccumlationValue;
+#endif
+
+	/*
+	積算バッファ (SoA)
+	  _color             : チャンネルごとのサンプルの合計
+	  _luminance_squared : サンプルごとの輝度の二乗和。分散の推定に使う (adaptive_sampling.hpp)
+	  _sample_count      : 画素ごとのサンプル数
+	_luminance_squared と _sample_count は省略できる
+	_sample_count がなければ、全画素のサンプル数はパスを終えるたびに増える _uniform_sample_count
+	締め切りで止めるstepや適応サンプリングでは画素ごとにサンプル数が違うので、_sample_count が必要 (require_sample_count)
+	乱数の状態は持たない。画素のサンプラーは (画素, サンプル数) からその場で作る (sampler)
+	特徴 (kFeaturePlane) は最初の衝突のアルベド・法線・距離の合計とID。デノイザーの手がかりに使う (to_feature_images)
+	*/
+	struct PixelFeatures {
+		Vec3 albedo;
+		Vec3 normal;
+		double depth = 0.0;
+		int object = -1;
+		int material = -1;
+	};
+
+	struct AccumlationBuffer {
+		enum Plane {
+			kSampleCountPlane = 1,
+			kLuminanceSquaredPlane = 2,
+			kAllPlanes = kSampleCountPlane | kLuminanceSquaredPlane,
+			kFeaturePlane = 4 /* kAllPlanes には含めない */
+		};
+
+		AccumlationBuffer() {}
+
+		// random_skip は乱数の種をずらすのに使う
+		AccumlationBuffer(int width, int height, int random_skip = 50, int planes = kAllPlanes) :_width(width), _height(height), _random_skip(random_skip) {
+			int count = width * height;
+			for (int i = 0; i < 3; ++i) {
+				_color[i].resize(count);
+			}
+			if (planes & kLuminanceSquaredPlane) {
+				_luminance_squared.resize(count);
+			}
+			if (planes & kSampleCountPlane) {
+				_sample_count.resize(count);
+			}
+			if (planes & kFeaturePlane) {
+				for (int i = 0; i < 3; ++i) {
+					_albedo[i].resize(count);
+					_normal[i].resize(count);
+				}
+				_depth.resize(count);
+				_object_id.assign(count, -1);
+				_material_id.assign(count, -1);
+			}
+		}
+
+		// サンプラーの種類を変える。描き始める前に呼ぶこと
+		void set_sampler(SamplerType type) {
+			_sampler_type = type;
+		}
+
+		// サンプル番号を offset からにする。複数のプロセスで同じ画素の別のサンプルを描くときに使う (render_split.hpp)
+		void set_sample_offset(uint32_t offset) {
+			_sample_offset = offset;
+		}
+
+		/*
+		画素のサンプラー
+		次のサンプル番号はその画素のここまでのサンプル数なので、同じ画素を何度描き直しても(どのスレッドで描いても)同じ値になる
+		*/
+		DefaultEngine sampler(int index) const {
+			DefaultEngine engine(hash_combine(index + 1, _random_skip));
+			engine.set_type(_sampler_type);
+			engine.set_pixel(index % _width, index / _width);
+			engine.set_mask_seed(_random_skip);
+			engine.set_next_sample(_sample_offset + sample_count(index));
+			return engine;
+		}
+
+		int pixel_count() const {
+			return _width * _height;
+		}
+
+		Vec3 color(int index) const {
+			return Vec3(_color[0][index], _color[1][index], _color[2][index]);
+		}
+		int sample_count(int index) const {
+			return _sample_count.empty() ? _uniform_sample_count : _sample_count[index];
+		}
+		double luminance_squared(int index) const {
+			return _luminance_squared.empty() ? 0.0 : _luminance_squared[index];
+		}
+		bool has_luminance_squared() const {
+			return _luminance_squared.empty() == false;
+		}
+		bool has_features() const {
+			return _depth.empty() == false;
+		}
+
+		// サンプル数で割った値
+		Vec3 normalized(int index) const {
+			int n = sample_count(index);
+			return 0 < n ? color(index) / (double)n : Vec3();
+		}
+
+		// n 個のサンプルの合計を足す
+		void add(int index, const Vec3 &color, double luminance_squared, int n) {
+			for (int i = 0; i < 3; ++i) {
+				_color[i][index] += static_cast<AccumlationValue>(color[i]);
+			}
+			if (_luminance_squared.empty() == false) {
+				_luminance_squared[index] += static_cast<AccumlationValue>(luminance_squared);
+			}
+			if (_sample_count.empty() == false) {
+				_sample_count[index] += n;
+			}
+		}
+
+		// n 個のサンプルの特徴の合計を足す (add と同じサンプル数で正規化される)
+		void add_features(int index, const PixelFeatures &features) {
+			if (has_features() == false) {
+				return;
+			}
+			for (int i = 0; i < 3; ++i) {
+				_albedo[i][index] += static_cast<AccumlationValue>(features.albedo[i]);
+				_normal[i][index] += static_cast<AccumlationValue>(features.normal[i]);
+			}
+			_depth[index] += static_cast<AccumlationValue>(features.depth);
+			if (_object_id[index] < 0) {
+				_object_id[index] = features.object;
+				_material_id[index] = features.material;
+			}
+		}
+
+		/*
+		輝度の平均の分散 (標準誤差の二乗)
+		輝度の二乗和を持たないか、サンプルが2つ未満なら0
+		*/
+		double mean_variance(int index) const {
+			int n = sample_count(index);
+			if (has_luminance_squared() == false || n < 2) {
+				return 0.0;
+			}
+			double mean = luminance(color(index)) / n;
+			double variance = std::max(luminance_squared(index) / n - mean * mean, 0.0) * n / (n - 1);
+			return variance / n;
+		}
+		void to_variance(std::vector<double> &variance) const {
+			variance.resize(pixel_count());
+			parallel_for(pixel_count(), [&variance, this](int beg, int end) {
+				for (int index = beg; index < end; ++index) {
+					variance[index] = mean_variance(index);
+				}
+			}, 4096);
+		}
+
+		// サンプル数で割った特徴
+		PixelFeatures features(int index) const {
+			PixelFeatures features;
+			int n = sample_count(index);
+			if (has_features() == false || n == 0) {
+				return features;
+			}
+			double inv = 1.0 / n;
+			features.albedo = Vec3(_albedo[0][index], _albedo[1][index], _albedo[2][index]) * inv;
+			features.normal = Vec3(_normal[0][index], _normal[1][index], _normal[2][index]) * inv;
+			features.depth = _depth[index] * inv;
+			features.object = _object_id[index];
+			features.material = _material_id[index];
+			return features;
+		}
+
+		/*
+		画素あたりのサンプル数 (全画素の平均、切り捨て)
+		画素ごとの数を持つなら実際に追った数から数える。適応サンプリングではパスごとの数が画素で違うので _ray_count とは合わない
+		*/
+		int samples_per_pixel() const {
+			if (_sample_count.empty() || pixel_count() == 0) {
+				return _uniform_sample_count;
+			}
+			int64_t sum = 0;
+			for (int n : _sample_count) {
+				sum += n;
+			}
+			return static_cast<int>(sum / pixel_count());
+		}
+
+		// パスを最後まで終えたときに呼ぶ
+		void finish_pass(int aa_sample) {
+			_iteration += 1;
+			_ray_count += aa_sample;
+			if (_sample_count.empty()) {
+				_uniform_sample_count += aa_sample;
+			}
+		}
+
+		// 画素ごとのサンプル数を持っていなければ、ここまでの一様なサンプル数で作る
+		void require_sample_count() {
+			if (_sample_count.empty()) {
+				_sample_count.assign(pixel_count(), _uniform_sample_count);
+			}
+		}
+
+		/*
+		同じ大きさの別のバッファの積算を足す
+		別々に描いた部分(サンプルの範囲やタイル)をまとめるのに使う。正規化は合計のサンプル数で行われる
+		*/
+		void merge(const AccumlationBuffer &other) {
+			require_sample_count();
+			bool luminance_squared = has_luminance_squared() && other.has_luminance_squared();
+			bool features = has_features() && other.has_features();
+			parallel_for(pixel_count(), [this, &other, luminance_squared, features](int beg, int end) {
+				for (int index = beg; index < end; ++index) {
+					for (int i = 0; i < 3; ++i) {
+						_color[i][index] += other._color[i][index];
+					}
+					if (luminance_squared) {
+						_luminance_squared[index] += other._luminance_squared[index];
+					}
+					if (features) {
+						for (int i = 0; i < 3; ++i) {
+							_albedo[i][index] += other._albedo[i][index];
+							_normal[i][index] += other._normal[i][index];
+						}
+						_depth[index] += other._depth[index];
+						if (_object_id[index] < 0) {
+							_object_id[index] = other._object_id[index];
+							_material_id[index] = other._material_id[index];
+						}
+					}
+					_sample_count[index] += other.sample_count(index);
+				}
+			}, 4096);
+			_iteration = std::max(_iteration, other._iteration);
+			_ray_count += other._ray_count;
+		}
+
+		void to_image(Image &image) const {
+			image.resize(_width, _height);
+			parallel_for(image.height, [&image, this](int beg_y, int end_y) {
+				for (int y = beg_y; y < end_y; ++y) {
+					Vec3 *lineHead = image.pixels.data() + image.width * y;
+					for (int x = 0; x < image.width; ++x) {
+						lineHead[x] = normalized(y * image.width + x);
+					}
+				}
+			});
+		}
+
+		// 特徴を平均して取り出す。特徴を持っていなければ空のまま
+		void to_feature_images(FeatureImages &images) const {
+			images.width = _width;
+			images.height = _height;
+			if (has_features() == false) {
+				images.albedo = Image();
+				images.normal = Image();
+				images.depth.clear();
+				images.object_id.clear();
+				images.material_id.clear();
+				return;
+			}
+			images.albedo.resize(_width, _height);
+			images.normal.resize(_width, _height);
+			images.depth.resize(pixel_count());
+			images.object_id.resize(pixel_count());
+			images.material_id.resize(pixel_count());
+			parallel_for(pixel_count(), [&images, this](int beg, int end) {
+				for (int index = beg; index < end; ++index) {
+					PixelFeatures f = features(index);
+					images.albedo.pixels[index] = f.albedo;
+					images.normal.pixels[index] = f.normal;
+					images.depth[index] = f.depth;
+					images.object_id[index] = f.object;
+					images.material_id[index] = f.material;
+				}
+			}, 4096);
+		}
+
+		int _width = 0;
+		int _height = 0;
+		std::array<std::vector<AccumlationValue>, 3> _color;
+		std::vector<AccumlationValue> _luminance_squared;
+		std::vector<int> _sample_count;
+		std::array<std::vector<AccumlationValue>, 3> _albedo;
+		std::array<std::vector<AccumlationValue>, 3> _normal;
+		std::vector<AccumlationValue> _depth;
+		std::vector<int> _object_id;
+		std::vector<int> _material_id;
+		uint32_t _random_skip = 0;
+		uint32_t _sample_offset = 0;
+		SamplerType _sampler_type = SamplerType::Sobol;
+		int _uniform_sample_count = 0;
+		int _iteration = 0;
+		int _ray_count = 0;
+	};
+
+	/*
+	正規化した値をその場で読むビュー
+	to_imageのようにコピーしないので、書き出し側が行やタイルの単位で読みながら処理できる
+	描画と並行して読むと、描画中の画素は途中の値になる
+	*/
+	struct NormalizedView {
+		NormalizedView(const AccumlationBuffer &buffer) :_buffer(&buffer), width(buffer._width), height(buffer._height) {}
+
+		Vec3 operator()(int x, int y) const {
+			return _buffer->normalized(y * width + x);
+		}
+
+		const AccumlationBuffer *_buffer;
+		int width = 0;
+		int height = 0;
+	};
+
+	/*
+	タイルひとつぶんの積算
+	スレッドごとに持ち、タイルを描き終えたら(途中で止めても)まとめて本体へ足す
+	本体への書き込みがタイルの終わりに一度だけになり、本体がfloatでもタイル内はdoubleで足せる
+	*/
+	struct TileAccumlation {
+		void reset(const Tile &t, bool with_features = false) {
+			tile = t;
+			int count = t.width * t.height;
+			color.assign(count, Vec3());
+			luminance_squared.assign(count, 0.0);
+			sample_count.assign(count, 0);
+			if (with_features) {
+				features.assign(count, PixelFeatures());
+			}
+			else {
+				features.clear();
+			}
+		}
+		int local_index(int x, int y) const {
+			return (y - tile.y) * tile.width + (x - tile.x);
+		}
+		void add(int x, int y, const Vec3 &c, double l2, int n) {
+			int index = local_index(x, y);
+			color[index] += c;
+			luminance_squared[index] += l2;
+			sample_count[index] += n;
+		}
+		void add_features(int x, int y, const PixelFeatures &f) {
+			if (features.empty()) {
+				return;
+			}
+			PixelFeatures &dst = features[local_index(x, y)];
+			dst.albedo += f.albedo;
+			dst.normal += f.normal;
+			dst.depth += f.depth;
+			if (dst.object < 0) {
+				dst.object = f.object;
+				dst.material = f.material;
+			}
+		}
+
+		// 本体へ足す。サンプルのない画素(締め切りで止めたときの残り)は触らない
+		void merge(AccumlationBuffer &buffer) const {
+			for (int y = 0; y < tile.height; ++y) {
+				for (int x = 0; x < tile.width; ++x) {
+					int index = y * tile.width + x;
+					if (sample_count[index] == 0) {
+						continue;
+					}
+					int dst_index = (tile.y + y) * buffer._width + tile.x + x;
+					buffer.add(dst_index, color[index], luminance_squared[index], sample_count[index]);
+					if (features.empty() == false) {
+						buffer.add_features(dst_index, features[index]);
+					}
+				}
+			}
+		}
+
+		Tile tile;
+		std::vector<Vec3> color;
+		std::vector<double> luminance_squared;
+		std::vector<int> sample_count;
+		std::vector<PixelFeatures> features; /* 本体が特徴を持つときだけ */
+	};
+
+	// 各スレッドのタイル用の積算 (使い回してメモリの確保を避ける)
+	inline TileAccumlation &thread_tile_accumlation() {
+		thread_local TileAccumlation accumlation;
+		return accumlation;
+	}
+}
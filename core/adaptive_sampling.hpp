@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include <vector>
+#include <limits>
+#include <cmath>
+
+#include "render.hpp"
+#include "tile_scheduler.hpp"
+
+/*
+分散にもとづく適応サンプリング
+画素ごとの輝度の一次・二次モーメントから平均の標準誤差を求め、平均に対する相対誤差をタイルごとに集計する
+  - 相対誤差が目標を下回ったタイルは収束したとみなし、以後サンプリングしない
+  - 収束していないタイルには、誤差に比例して多めのサンプルを割り当てる
+すべてのタイルが収束したら打ち切ってよい
+各画素は自分のサンプル数で正規化されるので、サンプル数が画素ごとに違っても平均は偏らない
+(ただし打ち切りの判断に同じサンプルを使うぶんの偏りは、判断をタイル単位にして小さくしている)
+*/
+namespace lc {
+	struct AdaptiveSampling {
+		// 目標の相対誤差 (平均の標準誤差 / 平均)
+		double target_error = 0.02;
+
+		// これより少ないサンプル数の画素は分散の推定を信用しない
+		int min_samples = 16;
+
+		// 1パスでひとつの画素に追うパスの最大数
+		int max_aa_sample = 8;
+
+		// 暗い画素で相対誤差が発散しないように分母に足す
+		double epsilon = 0.01;
+
+		// 直近のパスの開始時に見積もったタイルごとの相対誤差と、収束したか
+		std::vector<double> tile_error;
+		std::vector<char> tile_converged;
+		int converged_count = 0;
+
+		// 凍結したタイル (tile_denoise.hpp)。誤差によらず収束扱いにして、二度とサンプリングしない
+		std::vector<char> tile_frozen;
+
+		// 収束していないタイルの誤差の平均
+		double mean_error = 0.0;
+
+		bool converged() const {
+			return tile_converged.empty() == false && converged_count == static_cast<int>(tile_converged.size());
+		}
+	};
+
+	/*
+	画素の相対誤差
+	サンプルが足りないか、輝度の二乗和を持たないバッファなら無限大を返す
+	*/
+	inline double relative_error(const AccumlationBuffer &buffer, int index, const AdaptiveSampling &adaptive) {
+		int n = buffer.sample_count(index);
+		if (n < std::max(adaptive.min_samples, 2) || buffer.has_luminance_squared() == false) {
+			return std::numeric_limits<double>::infinity();
+		}
+		double mean = luminance(buffer.color(index)) / n;
+		double variance = glm::max(buffer.luminance_squared(index) / n - mean * mean, 0.0) * n / (n - 1);
+		double standard_error = glm::sqrt(variance / n);
+		return standard_error / (glm::abs(mean) + adaptive.epsilon);
+	}
+
+	// タイル内の画素の相対誤差の二乗平均平方根
+	inline double tile_relative_error(const AccumlationBuffer &buffer, const Tile &tile, const AdaptiveSampling &adaptive) {
+		double sum = 0.0;
+		for (int y = tile.y; y < tile.y + tile.height; ++y) {
+			for (int x = tile.x; x < tile.x + tile.width; ++x) {
+				double e = relative_error(buffer, y * buffer._width + x, adaptive);
+				if (std::isinf(e)) {
+					return e;
+				}
+				sum += e * e;
+			}
+		}
+		return glm::sqrt(sum / (tile.width * tile.height));
+	}
+
+	// 全タイルの誤差を見積もり、収束したタイルに印をつける
+	inline void update_tile_error(const AccumlationBuffer &buffer, const TileScheduler &scheduler, AdaptiveSampling &adaptive) {
+		int tile_count = static_cast<int>(scheduler.tiles.size());
+		adaptive.tile_error.resize(tile_count);
+		adaptive.tile_converged.resize(tile_count);
+		parallel_for(tile_count, [&buffer, &scheduler, &adaptive](int beg, int end) {
+			for (int i = beg; i < end; ++i) {
+				if (i < static_cast<int>(adaptive.tile_frozen.size()) && adaptive.tile_frozen[i]) {
+					adaptive.tile_error[i] = 0.0;
+					adaptive.tile_converged[i] = 1;
+					continue;
+				}
+				double e = tile_relative_error(buffer, scheduler.tiles[i], adaptive);
+				adaptive.tile_error[i] = e;
+				adaptive.tile_converged[i] = e < adaptive.target_error ? 1 : 0;
+			}
+		});
+		adaptive.converged_count = 0;
+		adaptive.mean_error = 0.0;
+		for (int i = 0; i < tile_count; ++i) {
+			if (adaptive.tile_converged[i]) {
+				adaptive.converged_count++;
+			}
+			else {
+				adaptive.mean_error += adaptive.tile_error[i];
+			}
+		}
+		if (adaptive.converged_count < tile_count) {
+			adaptive.mean_error /= tile_count - adaptive.converged_count;
+		}
+	}
+
+	/*
+	適応サンプリングのstep
+	パスの開始時にタイルの誤差を見積もり、収束したタイルは飛ばす
+	収束していないタイルには aa_sample * (誤差 / 誤差の平均) 本 (1 から max_aa_sample) のパスを追う
+	締め切りの扱いは締め切りつきstepと同じ。パスを最後まで終えたらtrue
+	adaptive.converged() になったら打ち切ってよい
+	*/
+	inline bool step_adaptive(AccumlationBuffer &buffer, const Scene &scene, int aa_sample, TileScheduler &scheduler, AdaptiveSampling &adaptive,
+		RenderClock::time_point deadline = RenderClock::time_point::max()) {
+		buffer.require_sample_count();
+		if (scheduler._remaining == 0) {
+			update_tile_error(buffer, scheduler, adaptive);
+		}
+		if (adaptive.converged()) {
+			return true;
+		}
+
+		const Tile *first_tile = scheduler.tiles.data();
+		bool completed = scheduler.run_until([&buffer, &scene, aa_sample, &scheduler, &adaptive, first_tile, deadline](const Tile &tile) {
+			int tile_index = static_cast<int>(&tile - first_tile);
+			if (adaptive.tile_converged[tile_index]) {
+				return true;
+			}
+
+			// まだ誤差の見積もれない画素があるタイルには基本のサンプル数
+			double ratio = adaptive.tile_error[tile_index] / adaptive.mean_error;
+			int tile_aa_sample = std::isinf(adaptive.mean_error) ? aa_sample : glm::clamp((int)(aa_sample * ratio + 0.5), 1, std::max(adaptive.max_aa_sample, aa_sample));
+
+			return render_tile(buffer, scene, scheduler, tile, tile_aa_sample, deadline);
+		}, deadline);
+
+		if (completed) {
+			buffer.finish_pass(aa_sample);
+		}
+		return completed;
+	}
+}
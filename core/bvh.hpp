@@ -7,6 +7,7 @@
 #include "collision.hpp"
 #include "collision_aabb.hpp"
 #include "collision_triangle.hpp"
+#include "thread_pool.hpp"
 
 #include <boost/optional.hpp>
 #include <boost/range.hpp>
@@ -15,6 +16,9 @@ namespace lc {
 	static const double kCOST_INTERSECT_AABB = 1.0;
 	static const double kCOST_INTERSECT_TRIANGLE = 2.0;
 
+	// これより三角形の多い部分木は別タスクで構築する
+	static const std::size_t kPARALLEL_BUILD_MIN_TRIANGLES = 4096;
+
 	inline double surface_area(const AABB &aabb) {
 		Vec3 size = aabb.max_position - aabb.min_position;
 		return (size.x * size.z + size.x * size.y + size.z * size.y) * 2.0;
@@ -186,14 +190,24 @@ namespace lc {
 			// 分配が完了したら自身の分を破棄する
 			std::swap(_nodes[node_index].indices, std::vector<int>());
 
+			// 左右の部分木は書き込むノードが重ならないので、大きければ左をタスクにして並列に作る
+			TaskGroup group;
 			if (_nodes[child_L_index].indices.empty() == false) {
 				// printf("L [%d]: %d\n",depth, (int)_nodes[child_L_index].indices.size());
-				this->build_recursive(depth + 1, child_L);
+				if (kPARALLEL_BUILD_MIN_TRIANGLES <= _nodes[child_L_index].indices.size()) {
+					group.run([this, depth, child_L]() {
+						this->build_recursive(depth + 1, child_L);
+					});
+				}
+				else {
+					this->build_recursive(depth + 1, child_L);
+				}
 			}
 			if (_nodes[child_R_index].indices.empty() == false) {
 				// printf("R [%d]: %d\n", depth, (int)_nodes[child_R_index].indices.size());
 				this->build_recursive(depth + 1, child_R);
 			}
+			group.wait();
 		}
 
 		struct BVHIntersection : public TriangleIntersection {
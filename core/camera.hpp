@@ -34,6 +34,10 @@ namespace lc {
 
 			return Ray(Vec3(), glm::normalize(to));
 		}
+
+		const Settings &settings() const {
+			return _settings;
+		}
 	private:
 		Settings _settings;
 	};
@@ -0,0 +1,290 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <future>
+
+#include "accumlation_buffer.hpp"
+#include "stopwatch.hpp"
+
+/*
+1 にすると、POSIXでは書き出しをmmapで行う (Windowsではいつも通常の書き込み)
+*/
+#define LC_CHECKPOINT_MMAP 0
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/*
+積算バッファのチェックポイント
+積算値の合計・二乗和・サンプル数 (と特徴) をそのままバイナリで保存し、読み戻して積算を続けられるようにする
+乱数は (画素, サンプル数, 次元) から作り直せるので、サンプラーの種類と種だけ持てば続きのサンプルも中断しなかった場合と同じになる
+書き込みは一時ファイルに書いてから rename で置き換えるので、途中で落ちても前のチェックポイントは壊れない
+*/
+namespace lc {
+	static const char kCheckpointMagic[4] = { 'L', 'C', 'C', 'K' };
+	static const uint32_t kCheckpointVersion = 1;
+
+	struct CheckpointHeader {
+		char magic[4];
+		uint32_t version = kCheckpointVersion;
+		int32_t width = 0;
+		int32_t height = 0;
+		uint32_t planes = 0; /* AccumlationBuffer::Plane */
+		uint32_t value_size = 0; /* sizeof(AccumlationValue) */
+		uint32_t sampler_type = 0;
+		uint32_t random_skip = 0;
+		int32_t uniform_sample_count = 0;
+		int32_t iteration = 0;
+		int32_t ray_count = 0;
+		uint32_t sample_offset = 0;
+	};
+
+	struct FileChunk {
+		const void *data = nullptr;
+		size_t size = 0;
+	};
+
+	/*
+	chunks を順に path へ書く
+	path + ".tmp" に書いてディスクへ同期してから置き換え、POSIXでは親ディレクトリも同期する
+	失敗したらfalse (一時ファイルは消す)
+	*/
+	inline bool write_file_atomic(const std::string &path, const std::vector<FileChunk> &chunks) {
+		std::string tmp_path = path + ".tmp";
+		size_t total = 0;
+		for (const FileChunk &chunk : chunks) {
+			total += chunk.size;
+		}
+
+#if LC_CHECKPOINT_MMAP && !defined(_WIN32)
+		int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		if (::ftruncate(fd, total) != 0) {
+			::close(fd);
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+		void *mapped = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED) {
+			::close(fd);
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+		char *dst = static_cast<char *>(mapped);
+		for (const FileChunk &chunk : chunks) {
+			std::memcpy(dst, chunk.data, chunk.size);
+			dst += chunk.size;
+		}
+		bool ok = ::msync(mapped, total, MS_SYNC) == 0;
+		::munmap(mapped, total);
+		ok = ::fsync(fd) == 0 && ok;
+		::close(fd);
+		if (ok == false) {
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+#else
+		FILE *fp = std::fopen(tmp_path.c_str(), "wb");
+		if (fp == nullptr) {
+			return false;
+		}
+		bool ok = true;
+		for (const FileChunk &chunk : chunks) {
+			if (std::fwrite(chunk.data, 1, chunk.size, fp) != chunk.size) {
+				ok = false;
+				break;
+			}
+		}
+		ok = std::fflush(fp) == 0 && ok;
+#ifdef _WIN32
+		ok = _commit(_fileno(fp)) == 0 && ok;
+#else
+		ok = ::fsync(::fileno(fp)) == 0 && ok;
+#endif
+		ok = std::fclose(fp) == 0 && ok;
+		if (ok == false) {
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+#endif
+
+#ifdef _WIN32
+		if (MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == 0) {
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+		return true;
+#else
+		if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+
+		// rename 自体をディスクに残すには、親ディレクトリも同期する
+		fs::path parent = fs::path(path).parent_path();
+		int dir_fd = ::open(parent.empty() ? "." : parent.string().c_str(), O_RDONLY);
+		if (dir_fd < 0) {
+			return false;
+		}
+		bool synced = ::fsync(dir_fd) == 0;
+		::close(dir_fd);
+		return synced;
+#endif
+	}
+
+	inline bool write_checkpoint(const AccumlationBuffer &buffer, const std::string &path) {
+		CheckpointHeader header;
+		std::memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+		header.width = buffer._width;
+		header.height = buffer._height;
+		header.planes = (buffer._sample_count.empty() ? 0 : AccumlationBuffer::kSampleCountPlane)
+			| (buffer._luminance_squared.empty() ? 0 : AccumlationBuffer::kLuminanceSquaredPlane)
+			| (buffer.has_features() ? AccumlationBuffer::kFeaturePlane : 0);
+		header.value_size = sizeof(AccumlationValue);
+		header.sampler_type = static_cast<uint32_t>(buffer._sampler_type);
+		header.random_skip = buffer._random_skip;
+		header.sample_offset = buffer._sample_offset;
+		header.uniform_sample_count = buffer._uniform_sample_count;
+		header.iteration = buffer._iteration;
+		header.ray_count = buffer._ray_count;
+
+		std::vector<FileChunk> chunks;
+		auto add_chunk = [&chunks](const void *data, size_t size) {
+			FileChunk chunk;
+			chunk.data = data;
+			chunk.size = size;
+			chunks.push_back(chunk);
+		};
+		add_chunk(&header, sizeof(header));
+		for (int i = 0; i < 3; ++i) {
+			add_chunk(buffer._color[i].data(), buffer._color[i].size() * sizeof(AccumlationValue));
+		}
+		add_chunk(buffer._luminance_squared.data(), buffer._luminance_squared.size() * sizeof(AccumlationValue));
+		add_chunk(buffer._sample_count.data(), buffer._sample_count.size() * sizeof(int));
+		for (int i = 0; i < 3; ++i) {
+			add_chunk(buffer._albedo[i].data(), buffer._albedo[i].size() * sizeof(AccumlationValue));
+			add_chunk(buffer._normal[i].data(), buffer._normal[i].size() * sizeof(AccumlationValue));
+		}
+		add_chunk(buffer._depth.data(), buffer._depth.size() * sizeof(AccumlationValue));
+		add_chunk(buffer._object_id.data(), buffer._object_id.size() * sizeof(int));
+		add_chunk(buffer._material_id.data(), buffer._material_id.size() * sizeof(int));
+		return write_file_atomic(path, chunks);
+	}
+
+	/*
+	チェックポイントを読んで buffer を置き換える
+	ファイルがない、壊れている、大きさや積算値の型が違う、知らないサンプラーのときはfalseを返し、buffer は変えない
+	buffer が空 (既定のコンストラクタで作ったもの) なら大きさはファイルに合わせる
+	*/
+	inline bool read_checkpoint(AccumlationBuffer &buffer, const std::string &path) {
+		FILE *fp = std::fopen(path.c_str(), "rb");
+		if (fp == nullptr) {
+			return false;
+		}
+		CheckpointHeader header;
+		bool ok = std::fread(&header, sizeof(header), 1, fp) == 1
+			&& std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) == 0
+			&& header.version == kCheckpointVersion
+			&& (buffer._width == 0 || (header.width == buffer._width && header.height == buffer._height))
+			&& 0 < header.width && 0 < header.height
+			&& header.value_size == sizeof(AccumlationValue)
+			&& header.sampler_type <= static_cast<uint32_t>(SamplerType::BlueNoise);
+		if (ok == false) {
+			std::fclose(fp);
+			return false;
+		}
+
+		AccumlationBuffer loaded(header.width, header.height, header.random_skip, header.planes);
+		loaded.set_sampler(static_cast<SamplerType>(header.sampler_type));
+		loaded.set_sample_offset(header.sample_offset);
+		loaded._uniform_sample_count = header.uniform_sample_count;
+		loaded._iteration = header.iteration;
+		loaded._ray_count = header.ray_count;
+
+		auto read_plane = [fp](void *data, size_t size) {
+			return std::fread(data, 1, size, fp) == size;
+		};
+		for (int i = 0; i < 3 && ok; ++i) {
+			ok = read_plane(loaded._color[i].data(), loaded._color[i].size() * sizeof(AccumlationValue));
+		}
+		ok = ok && read_plane(loaded._luminance_squared.data(), loaded._luminance_squared.size() * sizeof(AccumlationValue));
+		ok = ok && read_plane(loaded._sample_count.data(), loaded._sample_count.size() * sizeof(int));
+		for (int i = 0; i < 3 && ok; ++i) {
+			ok = read_plane(loaded._albedo[i].data(), loaded._albedo[i].size() * sizeof(AccumlationValue))
+				&& read_plane(loaded._normal[i].data(), loaded._normal[i].size() * sizeof(AccumlationValue));
+		}
+		ok = ok && read_plane(loaded._depth.data(), loaded._depth.size() * sizeof(AccumlationValue));
+		ok = ok && read_plane(loaded._object_id.data(), loaded._object_id.size() * sizeof(int));
+		ok = ok && read_plane(loaded._material_id.data(), loaded._material_id.size() * sizeof(int));
+		std::fclose(fp);
+		if (ok == false) {
+			return false;
+		}
+		buffer = std::move(loaded);
+		return true;
+	}
+
+	/*
+	非同期のチェックポイント書き出し
+	write_async は積算バッファを写してすぐに戻り、書き込みは別スレッドで行う
+	前の書き込みが終わっていなければ何もしない (描画を止めない)
+	*/
+	class CheckpointWriter {
+	public:
+		CheckpointWriter() {}
+		~CheckpointWriter() {
+			wait();
+		}
+		CheckpointWriter(const CheckpointWriter &) = delete;
+		void operator=(const CheckpointWriter &) = delete;
+
+		// 書き込みを始めたらtrue
+		bool write_async(const AccumlationBuffer &buffer, const std::string &path) {
+			if (busy()) {
+				return false;
+			}
+			wait();
+			_snapshot = buffer;
+			_task = std::async(std::launch::async, [this, path]() {
+				Stopwatch timer;
+				_succeeded = write_checkpoint(_snapshot, path);
+				return timer.elapsed();
+			});
+			return true;
+		}
+
+		bool busy() const {
+			return _task.valid() && _task.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+		}
+
+		// 書き込み中なら終わるまで待つ。直前の書き込みにかかった時間 [s] を返す
+		double wait() {
+			if (_task.valid()) {
+				_last_seconds = _task.get();
+			}
+			return _last_seconds;
+		}
+
+		// 直前の書き込みが成功したか (wait のあとに見る)
+		bool succeeded() const {
+			return _succeeded;
+		}
+	private:
+		AccumlationBuffer _snapshot;
+		std::future<double> _task;
+		double _last_seconds = 0.0;
+		bool _succeeded = true;
+	};
+}
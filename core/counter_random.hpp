@@ -0,0 +1,106 @@
+﻿#pragma once
+
+#include <inttypes.h>
+
+/*
+AVX2でまとめて生成するか
+コンパイラがAVX2を有効にしていないときは(1にしていても)スカラー版を使う
+*/
+#define LC_COUNTER_RANDOM_AVX2 1
+
+#if LC_COUNTER_RANDOM_AVX2 && defined(__AVX2__)
+#include <immintrin.h>
+#define LC_USE_COUNTER_RANDOM_AVX2 1
+#else
+#define LC_USE_COUNTER_RANDOM_AVX2 0
+#endif
+
+/*
+状態を持たない(カウンタベースの)乱数
+(画素の種, サンプル番号, 次元) の3つ組をハッシュした値を乱数とするので、どのサンプルもどのスレッド・どのマシンでも同じ値を作り直せる
+ハッシュは pcg3d (Jarzynski and Olano 2020, "Hash Functions for GPU Rendering")
+乗算と加算とシフトだけなので、8本ずつAVX2で並べて計算できる
+*/
+namespace lc {
+	inline void pcg3d(uint32_t &x, uint32_t &y, uint32_t &z) {
+		x = x * 1664525u + 1013904223u;
+		y = y * 1664525u + 1013904223u;
+		z = z * 1664525u + 1013904223u;
+		x += y * z;
+		y += z * x;
+		z += x * y;
+		x ^= x >> 16;
+		y ^= y >> 16;
+		z ^= z >> 16;
+		x += y * z;
+		y += z * x;
+		z += x * y;
+	}
+
+	inline uint32_t counter_random(uint32_t seed, uint32_t sample, uint32_t dimension) {
+		pcg3d(seed, sample, dimension);
+		return seed;
+	}
+
+	// 0 <= x < 1
+	inline double to_unit(uint32_t value) {
+		return value * (1.0 / 4294967296.0);
+	}
+
+#if LC_USE_COUNTER_RANDOM_AVX2
+	inline __m256i pcg3d_x8(__m256i x, __m256i y, __m256i z) {
+		const __m256i a = _mm256_set1_epi32(1664525);
+		const __m256i c = _mm256_set1_epi32(1013904223);
+		x = _mm256_add_epi32(_mm256_mullo_epi32(x, a), c);
+		y = _mm256_add_epi32(_mm256_mullo_epi32(y, a), c);
+		z = _mm256_add_epi32(_mm256_mullo_epi32(z, a), c);
+		x = _mm256_add_epi32(x, _mm256_mullo_epi32(y, z));
+		y = _mm256_add_epi32(y, _mm256_mullo_epi32(z, x));
+		z = _mm256_add_epi32(z, _mm256_mullo_epi32(x, y));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		y = _mm256_xor_si256(y, _mm256_srli_epi32(y, 16));
+		z = _mm256_xor_si256(z, _mm256_srli_epi32(z, 16));
+		x = _mm256_add_epi32(x, _mm256_mullo_epi32(y, z));
+		return x;
+	}
+#endif
+
+	/*
+	ひとつのサンプルの first_dimension から count 次元ぶんを out へ
+	counter_random(seed, sample, first_dimension + i) と同じ値
+	*/
+	inline void fill_counter_random(uint32_t seed, uint32_t sample, uint32_t first_dimension, int count, uint32_t *out) {
+		int i = 0;
+#if LC_USE_COUNTER_RANDOM_AVX2
+		const __m256i seed8 = _mm256_set1_epi32(seed);
+		const __m256i sample8 = _mm256_set1_epi32(sample);
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		for (; i + 8 <= count; i += 8) {
+			__m256i dimension8 = _mm256_add_epi32(_mm256_set1_epi32(first_dimension + i), lane);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), pcg3d_x8(seed8, sample8, dimension8));
+		}
+#endif
+		for (; i < count; ++i) {
+			out[i] = counter_random(seed, sample, first_dimension + i);
+		}
+	}
+
+	/*
+	画素(パス)ごとの種とサンプル番号の列について、同じ次元の値を out へ
+	ウェーブフロントのようにパスを並べて処理するときに使う
+	*/
+	inline void fill_counter_random(const uint32_t *seed, const uint32_t *sample, uint32_t dimension, int count, uint32_t *out) {
+		int i = 0;
+#if LC_USE_COUNTER_RANDOM_AVX2
+		const __m256i dimension8 = _mm256_set1_epi32(dimension);
+		for (; i + 8 <= count; i += 8) {
+			__m256i seed8 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seed + i));
+			__m256i sample8 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sample + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), pcg3d_x8(seed8, sample8, dimension8));
+		}
+#endif
+		for (; i < count; ++i) {
+			out[i] = counter_random(seed[i], sample[i], dimension);
+		}
+	}
+}
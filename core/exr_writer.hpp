@@ -0,0 +1,306 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "accumlation_buffer.hpp"
+#include "png_writer.hpp"
+
+/*
+HDR (トーンマッピング前の放射輝度) の書き出し。タイル形式の OpenEXR
+  チャンネルは B, G, R の half か float、圧縮はなしか ZIP (タイルごとに zlib。png_writer.hpp の deflate を使う)
+  lineOrder は RANDOM_Y なので、タイルはどの順でも書ける
+ExrTileWriter::write_tile は描き終えたタイルからその場で圧縮して追記するので、画像全体を写さずに書ける
+(複数のスレッドから呼んでよい。圧縮は呼んだスレッドで行い、追記だけを排他にする)
+タイルの位置の表はヘッダの直後に場所だけ取っておき、close で埋める。書いていないタイルは黒で埋める
+*/
+namespace lc {
+	enum class ExrPixelType {
+		Half = 1,
+		Float = 2
+	};
+	enum class ExrCompression {
+		None = 0,
+		Zip = 3
+	};
+
+	// 最も近い偶数への丸め。表せない大きさは無限大に
+	inline uint16_t float_to_half(float value) {
+		uint32_t f;
+		std::memcpy(&f, &value, sizeof(f));
+		uint32_t sign = (f >> 16) & 0x8000;
+		uint32_t a = f & 0x7fffffff;
+		if (0x7f800000 <= a) {
+			// 無限大と NaN
+			return (uint16_t)(sign | 0x7c00 | (0x7f800000 < a ? 0x200 : 0));
+		}
+		if (0x477ff000 <= a) {
+			return (uint16_t)(sign | 0x7c00);
+		}
+		if (a < 0x38800000) {
+			// half では非正規化数
+			if (a < 0x33000000) {
+				return (uint16_t)sign;
+			}
+			uint32_t mantissa = (a & 0x007fffff) | 0x00800000;
+			int shift = 126 - (int)(a >> 23);
+			uint32_t h = mantissa >> shift;
+			uint32_t rem = mantissa & ((1u << shift) - 1);
+			uint32_t halfway = 1u << (shift - 1);
+			if (halfway < rem || (rem == halfway && (h & 1))) {
+				h++;
+			}
+			return (uint16_t)(sign | h);
+		}
+		uint32_t h = a - 0x38000000;
+		h = (h + 0x0fff + ((h >> 13) & 1)) >> 13;
+		return (uint16_t)(sign | h);
+	}
+
+	class ExrTileWriter {
+	public:
+		ExrTileWriter() {}
+		~ExrTileWriter() {
+			close();
+		}
+		ExrTileWriter(const ExrTileWriter &) = delete;
+		void operator=(const ExrTileWriter &) = delete;
+
+		// ヘッダと空の位置の表を書く。失敗したら false
+		bool open(const std::string &path, int width, int height, int tile_size = 32, ExrPixelType type = ExrPixelType::Half, ExrCompression compression = ExrCompression::Zip) {
+			close();
+			if (width <= 0 || height <= 0 || tile_size <= 0) {
+				return false;
+			}
+			_fp = std::fopen(path.c_str(), "wb");
+			if (_fp == nullptr) {
+				return false;
+			}
+			_width = width;
+			_height = height;
+			_tile_size = tile_size;
+			_type = type;
+			_compression = compression;
+			_tiles_x = (width + tile_size - 1) / tile_size;
+			_tiles_y = (height + tile_size - 1) / tile_size;
+			_offsets.assign(_tiles_x * _tiles_y, 0);
+			_ok = true;
+
+			std::vector<uint8_t> header;
+			put_u32(header, 20000630); /* magic */
+			put_u32(header, 2 | 0x200); /* version 2, タイル形式 */
+
+			std::vector<uint8_t> channels;
+			for (const char *name : { "B", "G", "R" }) {
+				channels.push_back((uint8_t)name[0]);
+				channels.push_back(0);
+				put_u32(channels, (uint32_t)type);
+				put_u32(channels, 0); /* pLinear と予約 */
+				put_u32(channels, 1); /* xSampling */
+				put_u32(channels, 1); /* ySampling */
+			}
+			channels.push_back(0);
+			put_attribute(header, "channels", "chlist", channels);
+			put_attribute(header, "compression", "compression", { (uint8_t)compression });
+
+			std::vector<uint8_t> window;
+			put_u32(window, 0);
+			put_u32(window, 0);
+			put_u32(window, width - 1);
+			put_u32(window, height - 1);
+			put_attribute(header, "dataWindow", "box2i", window);
+			put_attribute(header, "displayWindow", "box2i", window);
+			put_attribute(header, "lineOrder", "lineOrder", { 2 /* RANDOM_Y */ });
+			put_attribute(header, "pixelAspectRatio", "float", float_bytes(1.0f));
+			std::vector<uint8_t> center = float_bytes(0.0f);
+			center.insert(center.end(), center.begin(), center.end());
+			put_attribute(header, "screenWindowCenter", "v2f", center);
+			put_attribute(header, "screenWindowWidth", "float", float_bytes(1.0f));
+			std::vector<uint8_t> tiles;
+			put_u32(tiles, tile_size);
+			put_u32(tiles, tile_size);
+			tiles.push_back(0); /* ONE_LEVEL */
+			put_attribute(header, "tiles", "tiledesc", tiles);
+			header.push_back(0);
+
+			_offset_table = header.size();
+			header.resize(header.size() + _offsets.size() * sizeof(uint64_t), 0);
+			_end = header.size();
+			if (std::fwrite(header.data(), 1, header.size(), _fp) != header.size()) {
+				_ok = false;
+			}
+			return _ok;
+		}
+
+		int tiles_x() const {
+			return _tiles_x;
+		}
+		int tiles_y() const {
+			return _tiles_y;
+		}
+
+		/*
+		タイル (tile_x, tile_y) を source(x, y) -> Vec3 から読んで書く
+		NormalizedView や描き終えたタイルの結果をそのまま渡せる
+		*/
+		template <class Source>
+		bool write_tile(int tile_x, int tile_y, const Source &source) {
+			if (_fp == nullptr || tile_x < 0 || _tiles_x <= tile_x || tile_y < 0 || _tiles_y <= tile_y) {
+				return false;
+			}
+			int x0 = tile_x * _tile_size;
+			int y0 = tile_y * _tile_size;
+			int w = std::min(_tile_size, _width - x0);
+			int h = std::min(_tile_size, _height - y0);
+			int sample_size = _type == ExrPixelType::Half ? 2 : 4;
+
+			// 行ごとに B, G, R の順でチャンネルを並べる
+			std::vector<uint8_t> raw((size_t)w * h * 3 * sample_size);
+			std::vector<Vec3> line(w);
+			uint8_t *dst = raw.data();
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					line[x] = source(x0 + x, y0 + y);
+				}
+				for (int c = 2; 0 <= c; --c) {
+					for (int x = 0; x < w; ++x) {
+						float v = (float)line[x][c];
+						if (_type == ExrPixelType::Half) {
+							uint16_t half = float_to_half(v);
+							std::memcpy(dst, &half, 2);
+						}
+						else {
+							std::memcpy(dst, &v, 4);
+						}
+						dst += sample_size;
+					}
+				}
+			}
+
+			std::vector<uint8_t> compressed;
+			const std::vector<uint8_t> *data = &raw;
+			if (_compression == ExrCompression::Zip) {
+				// OpenEXR の ZIP: バイトを偶数番目と奇数番目に分けて並べ、差分をとってから zlib
+				std::vector<uint8_t> shuffled(raw.size());
+				size_t half_size = (raw.size() + 1) / 2;
+				for (size_t i = 0; i < raw.size(); ++i) {
+					shuffled[(i & 1) ? half_size + i / 2 : i / 2] = raw[i];
+				}
+				for (size_t i = shuffled.size() - 1; 0 < i; --i) {
+					shuffled[i] = (uint8_t)(shuffled[i] - shuffled[i - 1] + 128);
+				}
+				zlib_compress(compressed, shuffled.data(), (int)shuffled.size(), PngCompression::High);
+				// 縮まなければそのまま (大きさが同じなら読む側は圧縮なしとみなす)
+				if (compressed.size() < raw.size()) {
+					data = &compressed;
+				}
+			}
+
+			std::vector<uint8_t> block;
+			put_u32(block, tile_x);
+			put_u32(block, tile_y);
+			put_u32(block, 0); /* level */
+			put_u32(block, 0);
+			put_u32(block, (uint32_t)data->size());
+			block.insert(block.end(), data->begin(), data->end());
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_fp == nullptr) {
+				return false;
+			}
+			if (std::fwrite(block.data(), 1, block.size(), _fp) != block.size()) {
+				_ok = false;
+				return false;
+			}
+			_offsets[tile_y * _tiles_x + tile_x] = _end;
+			_end += block.size();
+			return true;
+		}
+
+		// 書いていないタイルを黒で埋め、位置の表を書いて閉じる。すべて書けていたら true
+		bool close() {
+			if (_fp == nullptr) {
+				return false;
+			}
+			for (int i = 0; i < (int)_offsets.size(); ++i) {
+				if (_offsets[i] == 0) {
+					write_tile(i % _tiles_x, i / _tiles_x, [](int, int) { return Vec3(); });
+				}
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::vector<uint8_t> table;
+			for (uint64_t offset : _offsets) {
+				put_u32(table, (uint32_t)offset);
+				put_u32(table, (uint32_t)(offset >> 32));
+			}
+			_ok = std::fseek(_fp, (long)_offset_table, SEEK_SET) == 0 && _ok;
+			_ok = _ok && std::fwrite(table.data(), 1, table.size(), _fp) == table.size();
+			_ok = std::fclose(_fp) == 0 && _ok;
+			_fp = nullptr;
+			return _ok;
+		}
+	private:
+		static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+			for (int i = 0; i < 4; ++i) {
+				out.push_back((uint8_t)(v >> (i * 8)));
+			}
+		}
+		static std::vector<uint8_t> float_bytes(float v) {
+			uint32_t bits;
+			std::memcpy(&bits, &v, sizeof(bits));
+			std::vector<uint8_t> bytes;
+			put_u32(bytes, bits);
+			return bytes;
+		}
+		static void put_attribute(std::vector<uint8_t> &out, const char *name, const char *type, const std::vector<uint8_t> &value) {
+			out.insert(out.end(), name, name + std::strlen(name) + 1);
+			out.insert(out.end(), type, type + std::strlen(type) + 1);
+			put_u32(out, (uint32_t)value.size());
+			out.insert(out.end(), value.begin(), value.end());
+		}
+
+		FILE *_fp = nullptr;
+		std::mutex _mutex;
+		int _width = 0;
+		int _height = 0;
+		int _tile_size = 32;
+		int _tiles_x = 0;
+		int _tiles_y = 0;
+		ExrPixelType _type = ExrPixelType::Half;
+		ExrCompression _compression = ExrCompression::Zip;
+		std::vector<uint64_t> _offsets;
+		uint64_t _offset_table = 0;
+		uint64_t _end = 0;
+		bool _ok = false;
+	};
+
+	// source(x, y) -> Vec3 の画像全体を書く。タイルは並列に圧縮する
+	template <class Source>
+	inline bool write_exr(const std::string &path, int width, int height, const Source &source, ExrPixelType type = ExrPixelType::Half, ExrCompression compression = ExrCompression::Zip) {
+		ExrTileWriter writer;
+		if (writer.open(path, width, height, 32, type, compression) == false) {
+			return false;
+		}
+		parallel_for(writer.tiles_x() * writer.tiles_y(), [&writer, &source](int beg, int end) {
+			for (int i = beg; i < end; ++i) {
+				writer.write_tile(i % writer.tiles_x(), i / writer.tiles_x(), source);
+			}
+		});
+		return writer.close();
+	}
+
+	// 積算バッファの放射輝度 (サンプル数で割った値) を、写さずにそのまま書く
+	inline bool write_exr(const std::string &path, const AccumlationBuffer &buffer, ExrPixelType type = ExrPixelType::Half, ExrCompression compression = ExrCompression::Zip) {
+		return write_exr(path, buffer._width, buffer._height, NormalizedView(buffer), type, compression);
+	}
+
+	inline bool write_exr(const std::string &path, const Image &image, ExrPixelType type = ExrPixelType::Half, ExrCompression compression = ExrCompression::Zip) {
+		return write_exr(path, image.width, image.height, [&image](int x, int y) {
+			return image.pixels[y * image.width + x];
+		}, type, compression);
+	}
+}
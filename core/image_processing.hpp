@@ -1,8 +1,24 @@
 ﻿#pragma once
 
+#include <vector>
+#include <cmath>
+
 #include "render_type.hpp"
 #include "parallel_for.hpp"
 
+/*
+NLMとà-trousの重みの計算をAVX2で8画素ずつ行うか
+コンパイラがAVX2を有効にしていないときは(1にしていても)スカラー版を使う
+*/
+#define LC_IMAGE_PROCESSING_AVX2 1
+
+#if LC_IMAGE_PROCESSING_AVX2 && defined(__AVX2__)
+#include <immintrin.h>
+#define LC_USE_IMAGE_PROCESSING_AVX2 1
+#else
+#define LC_USE_IMAGE_PROCESSING_AVX2 0
+#endif
+
 namespace lc {
 	// マニュアルトーンマッピング
 	inline void tone_mapping(Image &image) {
@@ -49,7 +65,46 @@ namespace lc {
 		});
 	}
 
-	inline void non_local_means(Image &image_dst, const Image &image_src, double coef) {
+	// 特徴 (AOV) を見られる画像にする
+	// 法線: [-1, 1] を [0, 1] へ
+	inline void visualize_normal(Image &image, const FeatureImages &features) {
+		image.resize(features.normal.width, features.normal.height);
+		for (size_t i = 0; i < image.pixels.size(); ++i) {
+			image.pixels[i] = features.normal.pixels[i] * 0.5 + Vec3(0.5);
+		}
+	}
+
+	// 距離: 手前ほど明るく。何にも当たらなかった画素 (0) は黒
+	inline void visualize_depth(Image &image, const FeatureImages &features) {
+		image.resize(features.width, features.height);
+		double max_depth = 0.0;
+		for (double d : features.depth) {
+			max_depth = std::max(max_depth, d);
+		}
+		for (size_t i = 0; i < image.pixels.size(); ++i) {
+			double d = features.depth[i];
+			image.pixels[i] = Vec3(0.0 < d && 0.0 < max_depth ? 1.0 - d / max_depth : 0.0);
+		}
+	}
+
+	// ID: 番号ごとに色を散らす。-1 は黒
+	inline void visualize_id(Image &image, const std::vector<int> &ids, int width, int height) {
+		image.resize(width, height);
+		for (size_t i = 0; i < image.pixels.size(); ++i) {
+			if (ids[i] < 0) {
+				image.pixels[i] = Vec3();
+				continue;
+			}
+			uint32_t h = (uint32_t)ids[i] * 2654435761u;
+			h ^= h >> 15;
+			h *= 0x2c1b3c6d;
+			h ^= h >> 12;
+			image.pixels[i] = Vec3((h & 0xff) / 255.0, ((h >> 8) & 0xff) / 255.0, ((h >> 16) & 0xff) / 255.0);
+		}
+	}
+
+	// 素直な実装 (近傍の画素ごとにテンプレートを作り直す)。non_local_means の確認用
+	inline void non_local_means_reference(Image &image_dst, const Image &image_src, double coef) {
 		double param_h = std::max(0.0001, coef);
 		double sigma = std::max(0.0001, coef);
 		double frac_param_h_squared = 1.0 / (param_h * param_h);
@@ -137,4 +192,396 @@ namespace lc {
 			}
 		});
 	}
+#if LC_USE_IMAGE_PROCESSING_AVX2
+	// exp(x) (x <= 0)。Cephes の expf と同じ多項式で、相対誤差は 2e-7 程度
+	inline __m256 exp_avx2(__m256 x) {
+		x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+		__m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+		__m256 y = _mm256_set1_ps(1.9875691500e-4f);
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507e-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, x), x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+		__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+	}
+#endif
+
+	// non_local_means が参照する範囲 (パッチの半径 + 探索の半径)。タイルに分けてかけるときはこれだけ周りをつける
+	static const int kNonLocalMeansRadius = 5 / 2 + 13 / 2;
+
+	// non_local_means はこの大きさのタイルごとにひとつのタスクにする
+	static const int kNonLocalMeansTileSize = 64;
+
+	/*
+	non_local_means の高速版
+	パッチの距離は近傍のずらし (dx, dy) ごとに、差の二乗の画像を一度だけ作って 5x5 の箱フィルタで足すと求まる
+	  dist(p) = Σk |I(p + k) - I(p + k + d)|^2
+	画像を 64x64 のタイルに分け、タイルごとに float の平面で持ってずらしの 169 通りを回す (キャッシュに収まる)
+	端のクランプも含めて non_local_means_reference と同じ式 (float なので値は丸めの分だけ違う)
+	*/
+	inline void non_local_means(Image &image_dst, const Image &image_src, double coef) {
+		const float param_h = (float)std::max(0.0001, coef);
+		const float sigma = (float)std::max(0.0001, coef);
+		const float frac_param_h_squared = 1.0f / (param_h * param_h);
+		const float two_sigma_squared = 2.0f * sigma * sigma;
+
+		image_dst.resize(image_src.width, image_src.height);
+
+		const int kKernel = 5;
+		const int kSupport = 13;
+		const int kHalfKernel = kKernel / 2;
+		const int kHalfSupport = kSupport / 2;
+		const int kPadding = kHalfKernel + kHalfSupport;
+		const int kTileSize = kNonLocalMeansTileSize;
+
+		const int width = image_src.width;
+		const int height = image_src.height;
+		const int tiles_x = (width + kTileSize - 1) / kTileSize;
+		const int tiles_y = (height + kTileSize - 1) / kTileSize;
+
+		parallel_for(tiles_x * tiles_y, [&](int beg, int end) {
+			// タイルの作業領域。ひとつの区間の中で使い回す
+			const int src_stride = kTileSize + kPadding * 2;
+			const int diff_stride = kTileSize + kHalfKernel * 2;
+			std::vector<float> src[3];
+			for (int c = 0; c < 3; ++c) {
+				src[c].resize(src_stride * src_stride);
+			}
+			std::vector<float> diff(diff_stride * diff_stride);
+			std::vector<float> column(diff_stride);
+			std::vector<float> sum_weight(kTileSize * kTileSize);
+			std::vector<float> sum[3];
+			for (int c = 0; c < 3; ++c) {
+				sum[c].resize(kTileSize * kTileSize);
+			}
+
+			for (int tile_index = beg; tile_index < end; ++tile_index) {
+				const int tile_x = (tile_index % tiles_x) * kTileSize;
+				const int tile_y = (tile_index / tiles_x) * kTileSize;
+				const int tile_w = std::min(kTileSize, width - tile_x);
+				const int tile_h = std::min(tile_y + kTileSize, height) - tile_y;
+
+				// 周りを kPadding だけ広げて、端はクランプして写す
+				for (int y = 0; y < tile_h + kPadding * 2; ++y) {
+					int sy = glm::clamp(tile_y - kPadding + y, 0, height - 1);
+					const Vec3 *line = image_src.pixels.data() + sy * width;
+					for (int x = 0; x < tile_w + kPadding * 2; ++x) {
+						int sx = glm::clamp(tile_x - kPadding + x, 0, width - 1);
+						for (int c = 0; c < 3; ++c) {
+							src[c][y * src_stride + x] = (float)line[sx][c];
+						}
+					}
+				}
+				std::fill(sum_weight.begin(), sum_weight.end(), 0.0f);
+				for (int c = 0; c < 3; ++c) {
+					std::fill(sum[c].begin(), sum[c].end(), 0.0f);
+				}
+
+				const int diff_w = tile_w + kHalfKernel * 2;
+				const int diff_h = tile_h + kHalfKernel * 2;
+				for (int dy = -kHalfSupport; dy <= kHalfSupport; ++dy) {
+					for (int dx = -kHalfSupport; dx <= kHalfSupport; ++dx) {
+						// 差の二乗 (パッチの広がりの分だけタイルより広く)
+						for (int y = 0; y < diff_h; ++y) {
+							const int a = (y + kHalfSupport) * src_stride + kHalfSupport;
+							const int b = a + dy * src_stride + dx;
+							const float *r = src[0].data(), *g = src[1].data(), *bl = src[2].data();
+							float *d = diff.data() + y * diff_stride;
+							for (int x = 0; x < diff_w; ++x) {
+								float dr = r[a + x] - r[b + x];
+								float dg = g[a + x] - g[b + x];
+								float db = bl[a + x] - bl[b + x];
+								d[x] = dr * dr + dg * dg + db * db;
+							}
+						}
+
+						for (int y = 0; y < tile_h; ++y) {
+							// 5x5 の箱フィルタ: 縦に5行足してから横に5つ足す
+							const float *d = diff.data() + y * diff_stride;
+							for (int x = 0; x < diff_w; ++x) {
+								column[x] = d[x] + d[x + diff_stride] + d[x + diff_stride * 2] + d[x + diff_stride * 3] + d[x + diff_stride * 4];
+							}
+
+							const int neighbor = (y + kPadding + dy) * src_stride + kPadding + dx;
+							const float *nr = src[0].data() + neighbor;
+							const float *ng = src[1].data() + neighbor;
+							const float *nb = src[2].data() + neighbor;
+							float *w_line = sum_weight.data() + y * kTileSize;
+							float *r_line = sum[0].data() + y * kTileSize;
+							float *g_line = sum[1].data() + y * kTileSize;
+							float *b_line = sum[2].data() + y * kTileSize;
+							const float *col = column.data();
+							int x = 0;
+#if LC_USE_IMAGE_PROCESSING_AVX2
+							const __m256 zero = _mm256_setzero_ps();
+							const __m256 offset8 = _mm256_set1_ps(two_sigma_squared);
+							const __m256 scale8 = _mm256_set1_ps(-frac_param_h_squared);
+							for (; x + 8 <= tile_w; x += 8) {
+								__m256 dist = _mm256_add_ps(
+									_mm256_add_ps(_mm256_loadu_ps(col + x), _mm256_loadu_ps(col + x + 1)),
+									_mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(col + x + 2), _mm256_loadu_ps(col + x + 3)), _mm256_loadu_ps(col + x + 4)));
+								__m256 arg = _mm256_mul_ps(_mm256_max_ps(_mm256_sub_ps(dist, offset8), zero), scale8);
+								__m256 weight = exp_avx2(arg);
+								_mm256_storeu_ps(w_line + x, _mm256_add_ps(_mm256_loadu_ps(w_line + x), weight));
+								_mm256_storeu_ps(r_line + x, _mm256_add_ps(_mm256_loadu_ps(r_line + x), _mm256_mul_ps(weight, _mm256_loadu_ps(nr + x))));
+								_mm256_storeu_ps(g_line + x, _mm256_add_ps(_mm256_loadu_ps(g_line + x), _mm256_mul_ps(weight, _mm256_loadu_ps(ng + x))));
+								_mm256_storeu_ps(b_line + x, _mm256_add_ps(_mm256_loadu_ps(b_line + x), _mm256_mul_ps(weight, _mm256_loadu_ps(nb + x))));
+							}
+#endif
+							for (; x < tile_w; ++x) {
+								float dist = col[x] + col[x + 1] + (col[x + 2] + col[x + 3] + col[x + 4]);
+								float weight = std::exp(-std::max(dist - two_sigma_squared, 0.0f) * frac_param_h_squared);
+								w_line[x] += weight;
+								r_line[x] += weight * nr[x];
+								g_line[x] += weight * ng[x];
+								b_line[x] += weight * nb[x];
+							}
+						}
+					}
+				}
+
+				for (int y = 0; y < tile_h; ++y) {
+					Vec3 *line = image_dst.pixels.data() + (tile_y + y) * width + tile_x;
+					for (int x = 0; x < tile_w; ++x) {
+						int index = y * kTileSize + x;
+						float inv_weight = 1.0f / sum_weight[index];
+						line[x] = Vec3(sum[0][index] * inv_weight, sum[1][index] * inv_weight, sum[2][index] * inv_weight);
+					}
+				}
+			}
+		});
+	}
+	struct AtrousSettings {
+		int iterations = 5;             /* 刻みは 1, 2, 4, ... 画素 */
+		double sigma_luminance = 2.0;   /* 輝度の差を標準偏差の何倍まで許すか */
+		double sigma_normal = 1.0;      /* 法線の向きの差への鋭さ (メッシュの面の継ぎ目で止まりすぎないよう弱め) */
+		double sigma_depth = 0.2;       /* 距離の相対的な差 (刻み1画素あたり) */
+		double sigma_albedo = 0.5;
+		bool demodulate_albedo = true;  /* アルベドで割ってからかけ、あとで掛け戻す (模様をぼかさない) */
+	};
+
+	/*
+	特徴で止めるà-trousウェーブレットフィルタ (Dammertz et al. 2010, "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering")
+	5x5 の B3 スプラインの核を、刻みを倍にしながら iterations 回かける
+	重みは 輝度の差 (分散で正規化)・法線・距離・アルベドの差と、物体のIDが同じかどうかで決める
+	分散もフィルタと一緒に伝える (Schied et al. 2017, SVGF)
+	features が空なら輝度と分散だけで止める。variance は画素ごとの輝度の平均の分散で、空なら一定とみなす
+	*/
+	inline void atrous_filter(Image &image_dst, const Image &image_src, const FeatureImages &features, const std::vector<double> &variance, const AtrousSettings &settings = AtrousSettings()) {
+		const int width = image_src.width;
+		const int height = image_src.height;
+		const int count = width * height;
+		const bool has_features = (int)features.depth.size() == count && (int)features.albedo.pixels.size() == count;
+		const bool demodulate = has_features && settings.demodulate_albedo;
+
+		// float の平面に分ける
+		std::vector<float> color[3], next_color[3], normal[3], albedo[3];
+		std::vector<float> var(count), next_var(count), depth(count, 0.0f);
+		std::vector<int> id(count, 0);
+		for (int c = 0; c < 3; ++c) {
+			color[c].resize(count);
+			next_color[c].resize(count);
+			normal[c].assign(count, 0.0f);
+			albedo[c].assign(count, 1.0f);
+		}
+		parallel_for(count, [&](int beg, int end) {
+			for (int i = beg; i < end; ++i) {
+				Vec3 a = demodulate ? glm::max(features.albedo.pixels[i], Vec3(1.0e-3)) : Vec3(1.0);
+				for (int c = 0; c < 3; ++c) {
+					color[c][i] = (float)(image_src.pixels[i][c] / a[c]);
+					albedo[c][i] = (float)a[c];
+				}
+				double v = (int)variance.size() == count ? variance[i] : 1.0e-2;
+				var[i] = (float)(v / glm::pow(luminance(a), 2.0));
+				if (has_features) {
+					for (int c = 0; c < 3; ++c) {
+						normal[c][i] = (float)features.normal.pixels[i][c];
+						if (demodulate == false) {
+							albedo[c][i] = (float)features.albedo.pixels[i][c];
+						}
+					}
+					depth[i] = (float)features.depth[i];
+					id[i] = (int)features.object_id.size() == count ? features.object_id[i] : 0;
+				}
+			}
+		}, 4096);
+
+		// 少ないサンプルでの分散の推定はばらつくので、最初に 3x3 でならしておく
+		parallel_for(height, [&](int beg_y, int end_y) {
+			const float k3[3] = { 0.25f, 0.5f, 0.25f };
+			for (int y = beg_y; y < end_y; ++y) {
+				for (int x = 0; x < width; ++x) {
+					float sum = 0.0f, sum_k = 0.0f;
+					for (int ky = -1; ky <= 1; ++ky) {
+						int qy = glm::clamp(y + ky, 0, height - 1);
+						for (int kx = -1; kx <= 1; ++kx) {
+							int qx = glm::clamp(x + kx, 0, width - 1);
+							float k = k3[kx + 1] * k3[ky + 1];
+							sum += k * var[qy * width + qx];
+							sum_k += k;
+						}
+					}
+					next_var[y * width + x] = sum / sum_k;
+				}
+			}
+		});
+		std::swap(var, next_var);
+
+		const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+		const float sigma_luminance = (float)settings.sigma_luminance;
+		const float sigma_normal = has_features ? (float)settings.sigma_normal : 0.0f;
+		const float sigma_depth = (float)settings.sigma_depth;
+		const float inv_sigma_albedo_squared = has_features ? (float)(1.0 / (settings.sigma_albedo * settings.sigma_albedo)) : 0.0f;
+		const float kLuminance[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+		std::vector<float> lum(count);
+		for (int iteration = 0; iteration < settings.iterations; ++iteration) {
+			const int step = 1 << iteration;
+			parallel_for(count, [&](int beg, int end) {
+				for (int i = beg; i < end; ++i) {
+					lum[i] = kLuminance[0] * color[0][i] + kLuminance[1] * color[1][i] + kLuminance[2] * color[2][i];
+				}
+			}, 4096);
+
+			// 1画素ぶん (端や AVX2 の残り)
+			auto filter_pixel = [&](int x, int y) {
+				int p = y * width + x;
+				float lp = lum[p];
+				float inv_l = 1.0f / (sigma_luminance * std::sqrt(var[p]) + 1.0e-4f);
+				float inv_z = 1.0f / (sigma_depth * std::max(depth[p], 1.0e-4f) * step);
+				float sum_w = 0.0f, sum_var = 0.0f;
+				float sum[3] = { 0.0f, 0.0f, 0.0f };
+				for (int ky = -2; ky <= 2; ++ky) {
+					int qy = y + ky * step;
+					if (qy < 0 || height <= qy) {
+						continue;
+					}
+					for (int kx = -2; kx <= 2; ++kx) {
+						int qx = x + kx * step;
+						if (qx < 0 || width <= qx) {
+							continue;
+						}
+						int q = qy * width + qx;
+						if (id[q] != id[p]) {
+							continue;
+						}
+						float lq = lum[q];
+						float n_dot = normal[0][p] * normal[0][q] + normal[1][p] * normal[1][q] + normal[2][p] * normal[2][q];
+						float da[3];
+						for (int c = 0; c < 3; ++c) {
+							da[c] = albedo[c][q] - albedo[c][p];
+						}
+						float arg = -std::abs(lq - lp) * inv_l
+							- (1.0f - n_dot) * sigma_normal
+							- std::abs(depth[q] - depth[p]) * inv_z
+							- (da[0] * da[0] + da[1] * da[1] + da[2] * da[2]) * inv_sigma_albedo_squared;
+						if (kx == 0 && ky == 0) {
+							arg = 0.0f;
+						}
+						float w = kernel[kx + 2] * kernel[ky + 2] * std::exp(arg);
+						sum_w += w;
+						sum_var += w * w * var[q];
+						for (int c = 0; c < 3; ++c) {
+							sum[c] += w * color[c][q];
+						}
+					}
+				}
+				float inv_w = 1.0f / sum_w;
+				for (int c = 0; c < 3; ++c) {
+					next_color[c][p] = sum[c] * inv_w;
+				}
+				next_var[p] = sum_var * inv_w * inv_w;
+			};
+
+			parallel_for(height, [&](int beg_y, int end_y) {
+				for (int y = beg_y; y < end_y; ++y) {
+					int x = 0;
+#if LC_USE_IMAGE_PROCESSING_AVX2
+					// 横の近傍がすべて画像の中にある範囲を8画素ずつ
+					for (; x < std::min(2 * step, width); ++x) {
+						filter_pixel(x, y);
+					}
+					const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+					for (; x + 8 <= width - 2 * step; x += 8) {
+						int p = y * width + x;
+						__m256 lp = _mm256_loadu_ps(&lum[p]);
+						__m256 inv_l = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(sigma_luminance), _mm256_sqrt_ps(_mm256_loadu_ps(&var[p]))), _mm256_set1_ps(1.0e-4f)));
+						__m256 zp = _mm256_loadu_ps(&depth[p]);
+						__m256 inv_z = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(sigma_depth * step), _mm256_max_ps(zp, _mm256_set1_ps(1.0e-4f))));
+						__m256 np[3], ap[3];
+						for (int c = 0; c < 3; ++c) {
+							np[c] = _mm256_loadu_ps(&normal[c][p]);
+							ap[c] = _mm256_loadu_ps(&albedo[c][p]);
+						}
+						__m256i idp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&id[p]));
+
+						__m256 sum_w = _mm256_setzero_ps(), sum_var = _mm256_setzero_ps();
+						__m256 sum[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+						for (int ky = -2; ky <= 2; ++ky) {
+							int qy = y + ky * step;
+							if (qy < 0 || height <= qy) {
+								continue;
+							}
+							for (int kx = -2; kx <= 2; ++kx) {
+								int q = qy * width + x + kx * step;
+								__m256 h = _mm256_set1_ps(kernel[kx + 2] * kernel[ky + 2]);
+								__m256 w = h;
+								if (kx != 0 || ky != 0) {
+									__m256 dl = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(_mm256_loadu_ps(&lum[q]), lp));
+									__m256 n_dot = _mm256_add_ps(_mm256_add_ps(
+										_mm256_mul_ps(np[0], _mm256_loadu_ps(&normal[0][q])),
+										_mm256_mul_ps(np[1], _mm256_loadu_ps(&normal[1][q]))),
+										_mm256_mul_ps(np[2], _mm256_loadu_ps(&normal[2][q])));
+									__m256 dz = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(_mm256_loadu_ps(&depth[q]), zp));
+									__m256 da2 = _mm256_setzero_ps();
+									for (int c = 0; c < 3; ++c) {
+										__m256 da = _mm256_sub_ps(_mm256_loadu_ps(&albedo[c][q]), ap[c]);
+										da2 = _mm256_add_ps(da2, _mm256_mul_ps(da, da));
+									}
+									__m256 arg = _mm256_add_ps(
+										_mm256_add_ps(_mm256_mul_ps(dl, inv_l), _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), n_dot), _mm256_set1_ps(sigma_normal))),
+										_mm256_add_ps(_mm256_mul_ps(dz, inv_z), _mm256_mul_ps(da2, _mm256_set1_ps(inv_sigma_albedo_squared))));
+									w = _mm256_mul_ps(h, exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), arg)));
+									__m256i idq = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&id[q]));
+									w = _mm256_and_ps(w, _mm256_castsi256_ps(_mm256_cmpeq_epi32(idp, idq)));
+								}
+								sum_w = _mm256_add_ps(sum_w, w);
+								sum_var = _mm256_add_ps(sum_var, _mm256_mul_ps(_mm256_mul_ps(w, w), _mm256_loadu_ps(&var[q])));
+								for (int c = 0; c < 3; ++c) {
+									sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(w, _mm256_loadu_ps(&color[c][q])));
+								}
+							}
+						}
+						__m256 inv_w = _mm256_div_ps(_mm256_set1_ps(1.0f), sum_w);
+						for (int c = 0; c < 3; ++c) {
+							_mm256_storeu_ps(&next_color[c][p], _mm256_mul_ps(sum[c], inv_w));
+						}
+						_mm256_storeu_ps(&next_var[p], _mm256_mul_ps(sum_var, _mm256_mul_ps(inv_w, inv_w)));
+					}
+#endif
+					for (; x < width; ++x) {
+						filter_pixel(x, y);
+					}
+				}
+			});
+
+			for (int c = 0; c < 3; ++c) {
+				std::swap(color[c], next_color[c]);
+			}
+			std::swap(var, next_var);
+		}
+
+		image_dst.resize(width, height);
+		parallel_for(count, [&](int beg, int end) {
+			for (int i = beg; i < end; ++i) {
+				Vec3 c(color[0][i], color[1][i], color[2][i]);
+				image_dst.pixels[i] = demodulate ? c * Vec3(albedo[0][i], albedo[1][i], albedo[2][i]) : c;
+			}
+		}, 4096);
+	}
 }
\ No newline at end of file
@@ -1,5 +1,9 @@
 ﻿#pragma once
 
+#include <cstdint>
+#include <cassert>
+#include <limits>
+#include <vector>
 #include <boost/variant.hpp>
 #include "render_type.hpp"
 
@@ -40,11 +44,34 @@ namespace lc {
 
 	typedef boost::variant<EmissiveMaterial, LambertMaterial, CookTorranceMaterial, RefractionMaterial, PerfectSpecularMaterial> Material;
 
+	/*
+	シーン全体のマテリアルテーブル
+	オブジェクトや衝突情報はMaterialのコピーではなくIDだけを持つ
+	*/
+	typedef uint16_t MaterialID;
+
+	struct MaterialTable {
+		// IDは16bitなので、それを超えて積めない
+		MaterialID add(const Material &m) {
+			assert(_materials.size() < std::numeric_limits<MaterialID>::max());
+			_materials.push_back(m);
+			return static_cast<MaterialID>(_materials.size() - 1);
+		}
+		const Material &operator[](MaterialID id) const {
+			return _materials[id];
+		}
+		std::size_t size() const {
+			return _materials.size();
+		}
+		std::vector<Material> _materials;
+	};
+
 	struct MicroSurface {
 		Vec3 p;
 		Vec3 n;
 		Vec3 vn; /* virtual normal */
 		bool isback = false;
-		Material m;
+		MaterialID material = 0;
+		int object = -1; /* Scene::objects の番号 (intersect で入る) */
 	};
 }
\ No newline at end of file
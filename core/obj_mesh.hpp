@@ -0,0 +1,148 @@
+﻿#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// 実装を持つ翻訳単位では、このヘッダより前に TINYOBJLOADER_IMPLEMENTATION 付きで include しておくこと
+#include <tiny_obj_loader.h>
+
+#include "render_type.hpp"
+#include "transform.hpp"
+#include "material.hpp"
+#include "scene.hpp"
+
+namespace lc {
+	/*
+	.mtl の material_t を lc::Material に変換する
+	Ke があれば発光、d < 1 か屈折系の illum ならガラス、
+	illum 3 は完全鏡面、Ks があれば CookTorrance、それ以外は Lambert
+	*/
+	inline Material to_material(const tinyobj::material_t &m) {
+		auto to_vec3 = [](const float *v) {
+			return Vec3(v[0], v[1], v[2]);
+		};
+		auto max_compornent = [](const Vec3 &v) {
+			return glm::max(glm::max(v.x, v.y), v.z);
+		};
+
+		Vec3 emission = to_vec3(m.emission);
+		Vec3 diffuse = to_vec3(m.diffuse);
+		Vec3 specular = to_vec3(m.specular);
+		Vec3 transmittance = to_vec3(m.transmittance);
+
+		if (0.0 < max_compornent(emission)) {
+			return EmissiveMaterial(emission);
+		}
+		if (m.dissolve < 1.0f || m.illum == 4 || m.illum == 6 || m.illum == 7 || m.illum == 9) {
+			double ior = 1.0f < m.ior ? m.ior : 1.4;
+			Vec3 albedo = 0.0 < max_compornent(transmittance) ? transmittance : Vec3(1.0);
+			return RefractionMaterial(ior, albedo);
+		}
+		if (m.illum == 3) {
+			return PerfectSpecularMaterial();
+		}
+		if (0.0 < max_compornent(specular)) {
+			// Phong の Ns から GGX の roughness へ (alpha = sqrt(2 / (Ns + 2)))
+			double roughness = glm::sqrt(glm::sqrt(2.0 / (glm::max(static_cast<double>(m.shininess), 0.0) + 2.0)));
+			double fresnel_coef = glm::clamp(max_compornent(specular), 0.01, 0.99);
+			return CookTorranceMaterial(diffuse, specular, roughness, fresnel_coef);
+		}
+		return LambertMaterial(diffuse);
+	}
+
+	// 同じOBJを置く位置と、そのインスタンスの既定のマテリアル
+	struct ObjInstance {
+		Mat4 transform;
+		MaterialID material = 0;
+	};
+
+	/*
+	OBJ全体をひとつのMeshObject(ひとつのBVH)として読み込む
+	instances ごとに三角形を変換して足すので、同じOBJを何か所に置いてもBVHはひとつ
+	三角形ごとのマテリアルは次の優先順で決める
+	  1. shape_materials にシェイプ名があればそれ
+	  2. .mtl で usemtl されていれば、その material_t を変換したもの
+	  3. インスタンスの material
+	.mtl のマテリアルは使われていなくてもすべてシーンのテーブルに登録される
+	*/
+	inline bool load_obj_mesh(
+		MeshObject &mesh,
+		Scene &scene,
+		const fs::path &path,
+		const std::vector<ObjInstance> &instances,
+		const std::map<std::string, MaterialID> &shape_materials = std::map<std::string, MaterialID>()) {
+
+		if (instances.empty()) {
+			return false;
+		}
+
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		std::string err;
+		std::string obj_path = path.string();
+		std::string mtl_basepath = path.parent_path().string() + "/";
+		if (tinyobj::LoadObj(shapes, materials, err, obj_path.c_str(), mtl_basepath.c_str()) == false) {
+			return false;
+		}
+
+		std::vector<MaterialID> mtl_ids(materials.size());
+		for (size_t i = 0; i < materials.size(); ++i) {
+			mtl_ids[i] = scene.add_material(to_material(materials[i]));
+		}
+
+		std::vector<Triangle> triangles;
+		std::vector<MaterialID> triangle_materials;
+		for (const ObjInstance &instance : instances) {
+			for (size_t s = 0; s < shapes.size(); ++s) {
+				const tinyobj::shape_t &shape = shapes[s];
+				auto shape_material = shape_materials.find(shape.name);
+
+				for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
+					Triangle tri;
+					for (int j = 0; j < 3; ++j) {
+						int idx = shape.mesh.indices[i + j];
+						for (int k = 0; k < 3; ++k) {
+							tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
+						}
+						tri.v[j] = mul3x4(instance.transform, tri.v[j]);
+					}
+					triangles.push_back(tri);
+
+					MaterialID material = instance.material;
+					size_t face = i / 3;
+					if (shape_material != shape_materials.end()) {
+						material = shape_material->second;
+					}
+					else if (face < shape.mesh.material_ids.size()) {
+						int mtl_index = shape.mesh.material_ids[face];
+						if (0 <= mtl_index && (size_t)mtl_index < mtl_ids.size()) {
+							material = mtl_ids[mtl_index];
+						}
+					}
+					triangle_materials.push_back(material);
+				}
+			}
+		}
+
+		mesh.material = instances[0].material;
+		mesh.bvh.set_triangle(triangles);
+		mesh.bvh.build();
+		mesh.triangle_materials = triangle_materials;
+
+		return true;
+	}
+
+	inline bool load_obj_mesh(
+		MeshObject &mesh,
+		Scene &scene,
+		const fs::path &path,
+		const Mat4 &transform,
+		MaterialID default_material,
+		const std::map<std::string, MaterialID> &shape_materials = std::map<std::string, MaterialID>()) {
+		ObjInstance instance;
+		instance.transform = transform;
+		instance.material = default_material;
+		return load_obj_mesh(mesh, scene, path, std::vector<ObjInstance>(1, instance), shape_materials);
+	}
+}
@@ -1,9 +1,22 @@
 ﻿#pragma once
 
-#define PPL_PARALLEL 1
+/*
+並列化のバックエンド選択
+POOL_PARALLEL : thread_pool.hpp のワークスティーリングプール (std::threadのみで動く)
+PPL_PARALLEL  : Windows の PPL
+TBB_PARALLEL  : Intel TBB
+すべて 0 なら直列
+*/
+#define POOL_PARALLEL 1
+#define PPL_PARALLEL 0
 #define TBB_PARALLEL 0
 
-#if PPL_PARALLEL 
+#if POOL_PARALLEL
+#include "thread_pool.hpp"
+#endif
+
+#if PPL_PARALLEL
+
 #include <ppl.h>
 #endif
 
@@ -11,9 +24,28 @@
 #include <tbb/tbb.h>
 #endif
 
+// 選んだバックエンドで同時に動くスレッドの数
+inline int parallel_concurrency() {
+#if POOL_PARALLEL
+	return lc::thread_pool().thread_count();
+#elif PPL_PARALLEL && TBB_PARALLEL == 0
+	return static_cast<int>(concurrency::GetProcessorCount());
+#elif TBB_PARALLEL && PPL_PARALLEL == 0
+	return tbb::this_task_arena::max_concurrency();
+#else
+	return 1;
+#endif
+}
+
+/*
+action(begin, end) を [0, count) の区間に分けて並列に呼ぶ
+grain はひとつの区間の最大の長さ (POOL_PARALLEL のみ)
+*/
 template <class F>
-inline void parallel_for(int count, F &action /*begin, end*/) {
-#if PPL_PARALLEL && TBB_PARALLEL == 0
+inline void parallel_for(int count, const F &action /*begin, end*/, int grain = 1) {
+#if POOL_PARALLEL
+	lc::parallel_range(0, count, action, grain);
+#elif PPL_PARALLEL && TBB_PARALLEL == 0
 	concurrency::parallel_for<int>(0, count, [&action](int i) {
 		action(i, i + 1);
 	}, concurrency::auto_partitioner());
@@ -0,0 +1,747 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "parallel_for.hpp"
+
+/*
+PNGの書き出し (並列)
+行を kPngChunkBytes ほどの塊に分け、塊ごとに別スレッドでフィルタをかけて deflate する
+塊は前の塊を参照しない独立したブロックで、最後の塊以外は空の stored ブロックでバイト境界に揃える (zlib の Z_SYNC_FLUSH と同じ)
+ので、順につなげるとひとつの zlib ストリームになる。Adler-32 は塊ごとに求めて合成する
+塊はそれぞれ別の IDAT チャンクにするので、CRC も塊ごとに並列に求まる
+  Fast : フィルタは Paeth だけ、一致は1候補だけ探し、固定ハフマン (途中経過のスナップショット向け)
+  High : 行ごとに5種のフィルタから選び、ハッシュチェーンと遅延一致で探し、動的ハフマン (最終フレーム向け)
+*/
+namespace lc {
+	enum class PngCompression {
+		Fast,
+		High
+	};
+
+	static const int kPngChunkBytes = 1 << 18;
+	static const int kDeflateWindow = 1 << 15;
+	static const int kDeflateMinMatch = 3;
+	static const int kDeflateMaxMatch = 258;
+
+	inline uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+		static const std::vector<uint32_t> table = []() {
+			std::vector<uint32_t> t(256);
+			for (uint32_t n = 0; n < 256; ++n) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; ++k) {
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				}
+				t[n] = c;
+			}
+			return t;
+		}();
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i) {
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	inline uint32_t adler32(const uint8_t *data, size_t size) {
+		uint32_t a = 1;
+		uint32_t b = 0;
+		while (size) {
+			// 5552 バイトまでは 32bit であふれない
+			size_t n = std::min<size_t>(size, 5552);
+			for (size_t i = 0; i < n; ++i) {
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += n;
+			size -= n;
+		}
+		return (b << 16) | a;
+	}
+
+	// 続けた列 A + B の Adler-32 を、A と B の Adler-32 と B の長さから
+	inline uint32_t adler32_combine(uint32_t adler_a, uint32_t adler_b, size_t size_b) {
+		const uint32_t base = 65521;
+		uint32_t rem = (uint32_t)(size_b % base);
+		uint32_t sum1 = adler_a & 0xffff;
+		uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+		sum1 += (adler_b & 0xffff) + base - 1;
+		sum2 += (adler_a >> 16) + (adler_b >> 16) + base - rem;
+		if (base <= sum1) {
+			sum1 -= base;
+		}
+		if (base <= sum1) {
+			sum1 -= base;
+		}
+		if ((base << 1) <= sum2) {
+			sum2 -= base << 1;
+		}
+		if (base <= sum2) {
+			sum2 -= base;
+		}
+		return (sum2 << 16) | sum1;
+	}
+
+	// deflate のビット列 (下位ビットから詰める)
+	struct BitWriter {
+		BitWriter(std::vector<uint8_t> &out) :_out(out) {}
+
+		void put(uint32_t value, int count) {
+			_bits |= (uint64_t)value << _count;
+			_count += count;
+			while (8 <= _count) {
+				_out.push_back(static_cast<uint8_t>(_bits));
+				_bits >>= 8;
+				_count -= 8;
+			}
+		}
+		void align() {
+			if (_count) {
+				put(0, 8 - _count);
+			}
+		}
+
+		std::vector<uint8_t> &_out;
+		uint64_t _bits = 0;
+		int _count = 0;
+	};
+
+	/*
+	ハフマン符号 (deflate の正準符号)
+	codes はビットを反転してあるので、そのまま BitWriter::put に渡せる
+	*/
+	struct HuffmanCode {
+		// 頻度から、長さが max_length 以下の符号を作る
+		void build(const std::vector<uint32_t> &frequencies, int max_length) {
+			int symbol_count = (int)frequencies.size();
+			std::vector<std::pair<uint32_t, int>> used;
+			for (int i = 0; i < symbol_count; ++i) {
+				if (frequencies[i]) {
+					used.push_back(std::make_pair(frequencies[i], i));
+				}
+			}
+			// 符号は2つ以上ないと完全にならない
+			for (int i = 0; used.size() < 2 && i < symbol_count; ++i) {
+				if (frequencies[i] == 0) {
+					used.push_back(std::make_pair(1u, i));
+				}
+			}
+			std::sort(used.begin(), used.end());
+
+			// 頻度の昇順に並べた葉から、キュー2本でハフマン木を作る
+			int n = (int)used.size();
+			std::vector<uint64_t> weight(2 * n - 1);
+			std::vector<int> parent(2 * n - 1, 0);
+			for (int i = 0; i < n; ++i) {
+				weight[i] = used[i].first;
+			}
+			int leaf = 0;
+			int internal = n;
+			for (int next = n; next < 2 * n - 1; ++next) {
+				int pair[2];
+				for (int k = 0; k < 2; ++k) {
+					if (leaf < n && (next <= internal || weight[leaf] <= weight[internal])) {
+						pair[k] = leaf++;
+					}
+					else {
+						pair[k] = internal++;
+					}
+				}
+				weight[next] = weight[pair[0]] + weight[pair[1]];
+				parent[pair[0]] = next;
+				parent[pair[1]] = next;
+			}
+			std::vector<int> depth(2 * n - 1, 0);
+			for (int i = 2 * n - 3; 0 <= i; --i) {
+				depth[i] = depth[parent[i]] + 1;
+			}
+
+			// 長すぎる符号を max_length に詰め、クラフトの不等式が等号になるまで浅い符号を割る
+			std::vector<int> count(max_length + 1, 0);
+			for (int i = 0; i < n; ++i) {
+				count[std::min(depth[i], max_length)]++;
+			}
+			uint32_t total = 0;
+			for (int l = 1; l <= max_length; ++l) {
+				total += (uint32_t)count[l] << (max_length - l);
+			}
+			while (total != (1u << max_length)) {
+				count[max_length]--;
+				for (int l = max_length - 1; 0 < l; --l) {
+					if (count[l]) {
+						count[l]--;
+						count[l + 1] += 2;
+						break;
+					}
+				}
+				total--;
+			}
+
+			// 頻度の低いものから長い符号を割り当てる
+			std::vector<uint8_t> code_lengths(symbol_count, 0);
+			int index = 0;
+			for (int l = max_length; 0 < l; --l) {
+				for (int k = 0; k < count[l]; ++k) {
+					code_lengths[used[index++].second] = (uint8_t)l;
+				}
+			}
+			assign(code_lengths);
+		}
+
+		// 長さから正準符号を作る
+		void assign(const std::vector<uint8_t> &code_lengths) {
+			lengths = code_lengths;
+			codes.assign(lengths.size(), 0);
+			int length_count[16] = {};
+			for (uint8_t l : lengths) {
+				length_count[l]++;
+			}
+			length_count[0] = 0;
+			uint32_t next_code[16] = {};
+			uint32_t code = 0;
+			for (int bits = 1; bits < 16; ++bits) {
+				code = (code + length_count[bits - 1]) << 1;
+				next_code[bits] = code;
+			}
+			for (size_t i = 0; i < lengths.size(); ++i) {
+				int l = lengths[i];
+				if (l == 0) {
+					continue;
+				}
+				uint32_t c = next_code[l]++;
+				uint32_t reversed = 0;
+				for (int k = 0; k < l; ++k) {
+					reversed = (reversed << 1) | ((c >> k) & 1);
+				}
+				codes[i] = (uint16_t)reversed;
+			}
+		}
+
+		void put(BitWriter &writer, int symbol) const {
+			writer.put(codes[symbol], lengths[symbol]);
+		}
+
+		std::vector<uint8_t> lengths;
+		std::vector<uint16_t> codes;
+	};
+
+	// distance が 0 なら value はリテラル、そうでなければ一致の長さ
+	struct DeflateToken {
+		uint16_t value;
+		uint16_t distance;
+	};
+
+	inline int floor_log2(uint32_t v) {
+		int l = 0;
+		while (v >>= 1) {
+			++l;
+		}
+		return l;
+	}
+
+	// 長さ 3..258 の符号 (257..285) と追加ビット
+	inline void deflate_length_code(int length, int &code, int &extra_bits, int &extra) {
+		int v = length - kDeflateMinMatch;
+		if (v < 8) {
+			code = 257 + v;
+			extra_bits = 0;
+			extra = 0;
+		}
+		else if (length == kDeflateMaxMatch) {
+			code = 285;
+			extra_bits = 0;
+			extra = 0;
+		}
+		else {
+			int l = floor_log2(v);
+			extra_bits = l - 2;
+			code = 257 + 4 * (l - 1) + ((v >> extra_bits) & 3);
+			extra = v & ((1 << extra_bits) - 1);
+		}
+	}
+
+	// 距離 1..32768 の符号 (0..29) と追加ビット
+	inline void deflate_distance_code(int distance, int &code, int &extra_bits, int &extra) {
+		int v = distance - 1;
+		if (v < 4) {
+			code = v;
+			extra_bits = 0;
+			extra = 0;
+		}
+		else {
+			int l = floor_log2(v);
+			extra_bits = l - 1;
+			code = 2 * l + ((v >> extra_bits) & 1);
+			extra = v & ((1 << extra_bits) - 1);
+		}
+	}
+
+	// LZ77。窓は data の中だけ (塊をまたいで参照しない)
+	inline void deflate_tokens(std::vector<DeflateToken> &tokens, const uint8_t *data, int size, PngCompression compression) {
+		const bool high = compression == PngCompression::High;
+		// 小さい入力 (EXRのタイルなど) では表の初期化の方が重くなるので、表を小さくする
+		const int hash_bits = size < (1 << 16) ? 12 : 15;
+		const int max_chain = high ? 32 : 1;
+		const int lazy_length = 32;
+		std::vector<int> head(1 << hash_bits, -1);
+		std::vector<int> prev(high ? size : 0);
+
+		auto hash = [data, hash_bits](int i) {
+			uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+			return (v * 2654435761u) >> (32 - hash_bits);
+		};
+		auto insert = [&](int i) {
+			uint32_t h = hash(i);
+			int candidate = head[h];
+			head[h] = i;
+			if (high) {
+				prev[i] = candidate;
+			}
+			return candidate;
+		};
+		auto longest_match = [&](int i, int candidate, int &distance) {
+			int best = 0;
+			int limit = std::min(kDeflateMaxMatch, size - i);
+			for (int chain = 0; 0 <= candidate && i - candidate <= kDeflateWindow && chain < max_chain; ++chain) {
+				const uint8_t *a = data + candidate;
+				const uint8_t *b = data + i;
+				if (a[best] == b[best]) {
+					int n = 0;
+					while (n < limit && a[n] == b[n]) {
+						++n;
+					}
+					if (best < n) {
+						best = n;
+						distance = i - candidate;
+						if (n == limit) {
+							break;
+						}
+					}
+				}
+				candidate = high ? prev[candidate] : -1;
+			}
+			// 遠くの3バイトの一致は、リテラルより短くならない
+			if (best == kDeflateMinMatch && 4096 < distance) {
+				best = 0;
+			}
+			return best;
+		};
+
+		tokens.clear();
+		tokens.reserve(size / 2);
+		int i = 0;
+		while (i < size) {
+			if (size - i < kDeflateMinMatch) {
+				tokens.push_back({ data[i], 0 });
+				++i;
+				continue;
+			}
+			int distance = 0;
+			int length = longest_match(i, insert(i), distance);
+
+			// 遅延一致: 次の位置からの方が長ければ、今の位置はリテラルにする
+			if (high && kDeflateMinMatch <= length && length < lazy_length && i + 1 + kDeflateMinMatch <= size) {
+				int next_distance = 0;
+				if (length < longest_match(i + 1, head[hash(i + 1)], next_distance)) {
+					tokens.push_back({ data[i], 0 });
+					++i;
+					continue;
+				}
+			}
+
+			if (kDeflateMinMatch <= length) {
+				tokens.push_back({ (uint16_t)length, (uint16_t)distance });
+				if (high) {
+					for (int k = 1; k < length && i + k + kDeflateMinMatch <= size; ++k) {
+						insert(i + k);
+					}
+				}
+				i += length;
+			}
+			else {
+				tokens.push_back({ data[i], 0 });
+				++i;
+			}
+		}
+	}
+
+	inline const std::pair<HuffmanCode, HuffmanCode> &fixed_huffman() {
+		static const std::pair<HuffmanCode, HuffmanCode> fixed = []() {
+			std::vector<uint8_t> literal_lengths(288);
+			for (int i = 0; i < 288; ++i) {
+				literal_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+			}
+			std::pair<HuffmanCode, HuffmanCode> codes;
+			codes.first.assign(literal_lengths);
+			codes.second.assign(std::vector<uint8_t>(30, 5));
+			return codes;
+		}();
+		return fixed;
+	}
+
+	inline void deflate_write_tokens(BitWriter &writer, const std::vector<DeflateToken> &tokens, const HuffmanCode &literal, const HuffmanCode &distance) {
+		for (const DeflateToken &token : tokens) {
+			if (token.distance == 0) {
+				literal.put(writer, token.value);
+				continue;
+			}
+			int code, extra_bits, extra;
+			deflate_length_code(token.value, code, extra_bits, extra);
+			literal.put(writer, code);
+			writer.put(extra, extra_bits);
+			deflate_distance_code(token.distance, code, extra_bits, extra);
+			distance.put(writer, code);
+			writer.put(extra, extra_bits);
+		}
+		literal.put(writer, 256);
+	}
+
+	/*
+	data をひとつのブロックにして out へ足す
+	last でなければ、空の stored ブロックを続けてバイト境界で終える (次の塊をそのままつなげられる)
+	*/
+	inline void deflate_chunk(std::vector<uint8_t> &out, const uint8_t *data, int size, bool last, PngCompression compression) {
+		std::vector<DeflateToken> tokens;
+		deflate_tokens(tokens, data, size, compression);
+
+		const HuffmanCode &fixed_literal = fixed_huffman().first;
+		const HuffmanCode &fixed_distance = fixed_huffman().second;
+		BitWriter writer(out);
+
+		bool dynamic = false;
+		HuffmanCode literal, distance, code_length;
+		std::vector<std::pair<int, int>> runs; /* 符号長の列の (記号, 追加ビットの値) */
+		int literal_count = 0, distance_count = 0, code_length_count = 0;
+		static const int kCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		static const int kCodeLengthExtra[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+		if (compression == PngCompression::High) {
+			std::vector<uint32_t> literal_frequencies(286, 0);
+			std::vector<uint32_t> distance_frequencies(30, 0);
+			for (const DeflateToken &token : tokens) {
+				if (token.distance == 0) {
+					literal_frequencies[token.value]++;
+					continue;
+				}
+				int code, extra_bits, extra;
+				deflate_length_code(token.value, code, extra_bits, extra);
+				literal_frequencies[code]++;
+				deflate_distance_code(token.distance, code, extra_bits, extra);
+				distance_frequencies[code]++;
+			}
+			literal_frequencies[256] = 1;
+			literal.build(literal_frequencies, 15);
+			distance.build(distance_frequencies, 15);
+
+			literal_count = 286;
+			while (257 < literal_count && literal.lengths[literal_count - 1] == 0) {
+				--literal_count;
+			}
+			distance_count = 30;
+			while (1 < distance_count && distance.lengths[distance_count - 1] == 0) {
+				--distance_count;
+			}
+
+			// 符号長の列を連長で縮める (16: 直前の長さの繰り返し, 17, 18: 0 の繰り返し)
+			std::vector<uint8_t> all(literal.lengths.begin(), literal.lengths.begin() + literal_count);
+			all.insert(all.end(), distance.lengths.begin(), distance.lengths.begin() + distance_count);
+			for (int i = 0; i < (int)all.size(); ) {
+				int length = all[i];
+				int run = 1;
+				while (i + run < (int)all.size() && all[i + run] == length) {
+					++run;
+				}
+				i += run;
+				if (length == 0) {
+					while (11 <= run) {
+						int n = std::min(run, 138);
+						runs.push_back(std::make_pair(18, n - 11));
+						run -= n;
+					}
+					if (3 <= run) {
+						runs.push_back(std::make_pair(17, run - 3));
+						run = 0;
+					}
+				}
+				else {
+					runs.push_back(std::make_pair(length, 0));
+					--run;
+					while (3 <= run) {
+						int n = std::min(run, 6);
+						runs.push_back(std::make_pair(16, n - 3));
+						run -= n;
+					}
+				}
+				for (; 0 < run; --run) {
+					runs.push_back(std::make_pair(length, 0));
+				}
+			}
+			std::vector<uint32_t> code_length_frequencies(19, 0);
+			for (const auto &run : runs) {
+				code_length_frequencies[run.first]++;
+			}
+			code_length.build(code_length_frequencies, 7);
+			code_length_count = 19;
+			while (4 < code_length_count && code_length.lengths[kCodeLengthOrder[code_length_count - 1]] == 0) {
+				--code_length_count;
+			}
+
+			// 固定ハフマンより短くなるときだけ使う (追加ビットはどちらも同じなので数えない)
+			uint64_t fixed_bits = 0;
+			uint64_t dynamic_bits = 14 + 3 * code_length_count;
+			for (const auto &run : runs) {
+				dynamic_bits += code_length.lengths[run.first] + kCodeLengthExtra[run.first];
+			}
+			for (int i = 0; i < 286; ++i) {
+				fixed_bits += (uint64_t)literal_frequencies[i] * fixed_literal.lengths[i];
+				dynamic_bits += (uint64_t)literal_frequencies[i] * literal.lengths[i];
+			}
+			for (int i = 0; i < 30; ++i) {
+				fixed_bits += (uint64_t)distance_frequencies[i] * fixed_distance.lengths[i];
+				dynamic_bits += (uint64_t)distance_frequencies[i] * distance.lengths[i];
+			}
+			dynamic = dynamic_bits < fixed_bits;
+		}
+
+		writer.put(last ? 1 : 0, 1);
+		if (dynamic) {
+			writer.put(2, 2);
+			writer.put(literal_count - 257, 5);
+			writer.put(distance_count - 1, 5);
+			writer.put(code_length_count - 4, 4);
+			for (int i = 0; i < code_length_count; ++i) {
+				writer.put(code_length.lengths[kCodeLengthOrder[i]], 3);
+			}
+			for (const auto &run : runs) {
+				code_length.put(writer, run.first);
+				writer.put(run.second, kCodeLengthExtra[run.first]);
+			}
+			deflate_write_tokens(writer, tokens, literal, distance);
+		}
+		else {
+			writer.put(1, 2);
+			deflate_write_tokens(writer, tokens, fixed_literal, fixed_distance);
+		}
+
+		if (last == false) {
+			writer.put(0, 3);
+			writer.align();
+			writer.put(0x0000, 16);
+			writer.put(0xffff, 16);
+		}
+		writer.align();
+	}
+
+	// data をひとつの zlib ストリームにして out へ
+	inline void zlib_compress(std::vector<uint8_t> &out, const uint8_t *data, int size, PngCompression compression) {
+		out.clear();
+		out.push_back(0x78);
+		out.push_back(compression == PngCompression::High ? 0xda : 0x01);
+		deflate_chunk(out, data, size, true, compression);
+		uint32_t adler = adler32(data, size);
+		for (int i = 3; 0 <= i; --i) {
+			out.push_back((uint8_t)(adler >> (i * 8)));
+		}
+	}
+
+	enum PngFilter {
+		kPngFilterNone = 0,
+		kPngFilterSub = 1,
+		kPngFilterUp = 2,
+		kPngFilterAverage = 3,
+		kPngFilterPaeth = 4
+	};
+
+	inline uint8_t png_paeth(int a, int b, int c) {
+		int p = a + b - c;
+		int pa = std::abs(p - a);
+		int pb = std::abs(p - b);
+		int pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc) {
+			return (uint8_t)a;
+		}
+		return (uint8_t)(pb <= pc ? b : c);
+	}
+
+	// row (size バイト、1画素 bpp バイト) にフィルタをかけて dst へ。prior は前の行
+	inline void png_filter_row(uint8_t *dst, const uint8_t *row, const uint8_t *prior, int size, int bpp, int filter) {
+		switch (filter) {
+		case kPngFilterSub:
+			for (int i = 0; i < size; ++i) {
+				dst[i] = (uint8_t)(row[i] - (bpp <= i ? row[i - bpp] : 0));
+			}
+			break;
+		case kPngFilterUp:
+			for (int i = 0; i < size; ++i) {
+				dst[i] = (uint8_t)(row[i] - prior[i]);
+			}
+			break;
+		case kPngFilterAverage:
+			for (int i = 0; i < size; ++i) {
+				dst[i] = (uint8_t)(row[i] - (((bpp <= i ? row[i - bpp] : 0) + prior[i]) >> 1));
+			}
+			break;
+		case kPngFilterPaeth:
+			for (int i = 0; i < size; ++i) {
+				dst[i] = (uint8_t)(row[i] - (bpp <= i ? png_paeth(row[i - bpp], prior[i], prior[i - bpp]) : prior[i]));
+			}
+			break;
+		default:
+			std::memcpy(dst, row, size);
+			break;
+		}
+	}
+
+	// PNG の行のバイト列 (16bit はビッグエンディアン)
+	inline void png_row_bytes(uint8_t *dst, const uint8_t *src, int count) {
+		std::memcpy(dst, src, count);
+	}
+	inline void png_row_bytes(uint8_t *dst, const uint16_t *src, int count) {
+		for (int i = 0; i < count; ++i) {
+			dst[i * 2] = (uint8_t)(src[i] >> 8);
+			dst[i * 2 + 1] = (uint8_t)src[i];
+		}
+	}
+
+	inline void put_u32_be(uint8_t *dst, uint32_t v) {
+		dst[0] = (uint8_t)(v >> 24);
+		dst[1] = (uint8_t)(v >> 16);
+		dst[2] = (uint8_t)(v >> 8);
+		dst[3] = (uint8_t)v;
+	}
+
+	/*
+	pixels (width * height * channels、T は uint8_t か uint16_t) を PNG で path へ書く
+	channels は 1: グレー, 2: グレー + α, 3: RGB, 4: RGBA。失敗したら false
+	*/
+	template <class T>
+	inline bool write_png(const std::string &path, const T *pixels, int width, int height, int channels, PngCompression compression = PngCompression::Fast) {
+		static_assert(sizeof(T) <= 2, "8bit or 16bit");
+		if (width <= 0 || height <= 0 || channels < 1 || 4 < channels) {
+			return false;
+		}
+		const int bpp = channels * (int)sizeof(T);
+		const int stride = width * bpp;
+		const int rows_per_chunk = std::max(1, kPngChunkBytes / (stride + 1));
+		const int chunk_count = (height + rows_per_chunk - 1) / rows_per_chunk;
+
+		std::vector<std::vector<uint8_t>> idat(chunk_count);
+		std::vector<uint32_t> adler(chunk_count);
+		std::vector<size_t> filtered_size(chunk_count);
+		parallel_for(chunk_count, [&](int beg, int end) {
+			std::vector<uint8_t> prior(stride), row(stride), trial(stride), filtered;
+			for (int c = beg; c < end; ++c) {
+				int beg_y = c * rows_per_chunk;
+				int end_y = std::min(beg_y + rows_per_chunk, height);
+				filtered.resize((size_t)(end_y - beg_y) * (stride + 1));
+				if (beg_y == 0) {
+					std::fill(prior.begin(), prior.end(), 0);
+				}
+				else {
+					png_row_bytes(prior.data(), pixels + (size_t)(beg_y - 1) * width * channels, width * channels);
+				}
+				for (int y = beg_y; y < end_y; ++y) {
+					png_row_bytes(row.data(), pixels + (size_t)y * width * channels, width * channels);
+					uint8_t *dst = filtered.data() + (size_t)(y - beg_y) * (stride + 1);
+					if (compression == PngCompression::Fast) {
+						dst[0] = kPngFilterPaeth;
+						png_filter_row(dst + 1, row.data(), prior.data(), stride, bpp, kPngFilterPaeth);
+					}
+					else {
+						// 差分の絶対値の和が最小のフィルタ
+						uint64_t best_cost = ~0ull;
+						for (int filter = kPngFilterNone; filter <= kPngFilterPaeth; ++filter) {
+							png_filter_row(trial.data(), row.data(), prior.data(), stride, bpp, filter);
+							uint64_t cost = 0;
+							for (int i = 0; i < stride; ++i) {
+								cost += std::abs((int)(int8_t)trial[i]);
+							}
+							if (cost < best_cost) {
+								best_cost = cost;
+								dst[0] = (uint8_t)filter;
+								std::memcpy(dst + 1, trial.data(), stride);
+							}
+						}
+					}
+					std::swap(prior, row);
+				}
+				adler[c] = adler32(filtered.data(), filtered.size());
+				filtered_size[c] = filtered.size();
+
+				std::vector<uint8_t> &out = idat[c];
+				out.clear();
+				out.reserve(filtered.size() / 2);
+				if (c == 0) {
+					// zlib のヘッダ (32K の窓, FLEVEL)
+					out.push_back(0x78);
+					out.push_back(compression == PngCompression::High ? 0xda : 0x01);
+				}
+				deflate_chunk(out, filtered.data(), (int)filtered.size(), c == chunk_count - 1, compression);
+			}
+		});
+
+		uint32_t total_adler = adler[0];
+		for (int c = 1; c < chunk_count; ++c) {
+			total_adler = adler32_combine(total_adler, adler[c], filtered_size[c]);
+		}
+		uint8_t adler_bytes[4];
+		put_u32_be(adler_bytes, total_adler);
+		idat.back().insert(idat.back().end(), adler_bytes, adler_bytes + 4);
+
+		static const uint8_t kIdat[4] = { 'I', 'D', 'A', 'T' };
+		std::vector<uint32_t> crc(chunk_count);
+		parallel_for(chunk_count, [&](int beg, int end) {
+			for (int c = beg; c < end; ++c) {
+				crc[c] = crc32(idat[c].data(), idat[c].size(), crc32(kIdat, 4));
+			}
+		});
+
+		FILE *fp = std::fopen(path.c_str(), "wb");
+		if (fp == nullptr) {
+			return false;
+		}
+		bool ok = true;
+		auto write = [fp, &ok](const void *data, size_t size) {
+			// IEND のように中身のないチャンクでは fwrite に nullptr を渡さない
+			if (size != 0) {
+				ok = ok && std::fwrite(data, 1, size, fp) == size;
+			}
+		};
+		auto write_chunk = [&write](const char *type, const uint8_t *data, size_t size, uint32_t chunk_crc) {
+			uint8_t bytes[4];
+			put_u32_be(bytes, (uint32_t)size);
+			write(bytes, 4);
+			write(type, 4);
+			write(data, size);
+			put_u32_be(bytes, chunk_crc);
+			write(bytes, 4);
+		};
+
+		static const uint8_t kSignature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		static const uint8_t kColorType[4] = { 0, 4, 2, 6 };
+		write(kSignature, 8);
+
+		uint8_t header[17] = { 'I', 'H', 'D', 'R' };
+		put_u32_be(header + 4, width);
+		put_u32_be(header + 8, height);
+		header[12] = (uint8_t)(8 * sizeof(T));
+		header[13] = kColorType[channels - 1];
+		write_chunk("IHDR", header + 4, 13, crc32(header, 17));
+
+		for (int c = 0; c < chunk_count; ++c) {
+			write_chunk("IDAT", idat[c].data(), idat[c].size(), crc[c]);
+		}
+		write_chunk("IEND", nullptr, 0, crc32((const uint8_t *)"IEND", 4));
+
+		ok = std::fclose(fp) == 0 && ok;
+		return ok;
+	}
+}
@@ -0,0 +1,177 @@
+﻿#pragma once
+
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <inttypes.h>
+
+#include "accumlation_buffer.hpp"
+#include "image_processing.hpp"
+
+/*
+書き出し用の後処理をひとつのパスにまとめる
+  正規化 -> トーンマッピング -> コントラスト -> ガンマ -> 量子化 (8bit か 16bit のRGB)
+tone_mapping, contrast, gamma と書き出しの量子化を順にかけた場合と同じ式 (float なので値は丸めの分だけ違う)
+行を kPostProcessChunk 画素ずつ float の作業領域に取り出し、チャンネルごとに8画素ずつ曲線をかけて、そのまま出力へ書く
+atan と pow は AVX2 では多項式で近似する (Cephes の atanf, logf, expf と同じ多項式)
+*/
+namespace lc {
+	struct PostProcessSettings {
+		bool tone_mapping = true;
+		double contrast = 1.15; /* 1 なら何もしない */
+		double gamma = 2.2;     /* 1 なら何もしない */
+	};
+
+	static const int kPostProcessChunk = 1024;
+
+#if LC_USE_IMAGE_PROCESSING_AVX2
+	// atan(x) (0 <= x)
+	inline __m256 atan_avx2(__m256 x) {
+		const __m256 one = _mm256_set1_ps(1.0f);
+		__m256 large = _mm256_cmp_ps(x, _mm256_set1_ps(2.414213562373095f), _CMP_GT_OQ);
+		__m256 middle = _mm256_andnot_ps(large, _mm256_cmp_ps(x, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ));
+		__m256 y = _mm256_or_ps(_mm256_and_ps(large, _mm256_set1_ps(1.5707963267948966f)), _mm256_and_ps(middle, _mm256_set1_ps(0.7853981633974483f)));
+		__m256 x_large = _mm256_div_ps(_mm256_set1_ps(-1.0f), x);
+		__m256 x_middle = _mm256_div_ps(_mm256_sub_ps(x, one), _mm256_add_ps(x, one));
+		x = _mm256_blendv_ps(_mm256_blendv_ps(x, x_middle, middle), x_large, large);
+		__m256 z = _mm256_mul_ps(x, x);
+		__m256 p = _mm256_set1_ps(8.05374449538e-2f);
+		p = _mm256_sub_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.38776856032e-1f));
+		p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.99777106478e-1f));
+		p = _mm256_sub_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(3.33329491539e-1f));
+		p = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, z), x), x);
+		return _mm256_add_ps(y, p);
+	}
+
+	// log(x) (0 < x)
+	inline __m256 log_avx2(__m256 x) {
+		const __m256 one = _mm256_set1_ps(1.0f);
+		__m256i bits = _mm256_castps_si256(x);
+		__m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+		x = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+
+		// 仮数を [sqrt(1/2), sqrt(2)) に寄せる
+		__m256 small = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+		e = _mm256_sub_ps(e, _mm256_and_ps(small, one));
+		x = _mm256_sub_ps(_mm256_add_ps(x, _mm256_and_ps(small, x)), one);
+
+		__m256 z = _mm256_mul_ps(x, x);
+		__m256 y = _mm256_set1_ps(7.0376836292e-2f);
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.1514610310e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.1676998740e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.2420140846e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.4249322787e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.6668057665e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(2.0000714765e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-2.4999993993e-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(3.3333331174e-1f));
+		y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+		y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+		y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+		x = _mm256_add_ps(x, y);
+		return _mm256_add_ps(x, _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+	}
+#endif
+
+	/*
+	1チャンネルぶんの曲線 (src[0, count) -> dst[i * stride])
+	quantize は出力の最大値 + 0.99 (書き出しの量子化と同じく切り捨てる)
+	*/
+	template <class T>
+	inline void post_process_channel(T *dst, int stride, const float *src, int count, const PostProcessSettings &settings, float quantize) {
+		const float k = 2.4f * glm::two_over_pi<float>();
+		const float c = (float)settings.contrast;
+		const float p = (float)(1.0 / settings.gamma);
+		int i = 0;
+#if LC_USE_IMAGE_PROCESSING_AVX2
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		alignas(32) int32_t values[8];
+		for (; i + 8 <= count; i += 8) {
+			// 負と NaN は 0 に
+			__m256 v = _mm256_max_ps(_mm256_loadu_ps(src + i), zero);
+			if (settings.tone_mapping) {
+				v = _mm256_mul_ps(_mm256_set1_ps(glm::two_over_pi<float>()), atan_avx2(_mm256_mul_ps(v, _mm256_set1_ps(k))));
+			}
+			if (c != 1.0f) {
+				v = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v, _mm256_set1_ps(0.5f)), _mm256_set1_ps(c)), _mm256_set1_ps(0.5f));
+			}
+			v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+			if (p != 1.0f) {
+				__m256 positive = _mm256_cmp_ps(v, zero, _CMP_GT_OQ);
+				__m256 powered = exp_avx2(_mm256_mul_ps(log_avx2(_mm256_max_ps(v, _mm256_set1_ps(1.0e-30f))), _mm256_set1_ps(p)));
+				v = _mm256_and_ps(positive, _mm256_min_ps(powered, one));
+			}
+			_mm256_store_si256(reinterpret_cast<__m256i *>(values), _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(quantize))));
+			for (int j = 0; j < 8; ++j) {
+				dst[(i + j) * stride] = static_cast<T>(values[j]);
+			}
+		}
+#endif
+		for (; i < count; ++i) {
+			float v = std::max(src[i], 0.0f);
+			if (settings.tone_mapping) {
+				v = glm::two_over_pi<float>() * std::atan(k * v);
+			}
+			v = glm::clamp((v - 0.5f) * c + 0.5f, 0.0f, 1.0f);
+			v = std::pow(v, p);
+			dst[i * stride] = static_cast<T>(v * quantize);
+		}
+	}
+
+	/*
+	後処理して RGB (width * height * 3) へ。T は uint8_t か uint16_t
+	read_row(y, x, count, r, g, b) は行 y の x から count 画素を float で返す
+	*/
+	template <class T, class ReadRow>
+	inline void post_process_rows(std::vector<T> &pixels, int width, int height, const PostProcessSettings &settings, const ReadRow &read_row) {
+		pixels.resize((size_t)width * height * 3);
+		const float quantize = (float)std::numeric_limits<T>::max() + 0.99f;
+		parallel_for(height, [&](int beg_y, int end_y) {
+			std::vector<float> planes(kPostProcessChunk * 3);
+			float *r = planes.data();
+			float *g = r + kPostProcessChunk;
+			float *b = g + kPostProcessChunk;
+			for (int y = beg_y; y < end_y; ++y) {
+				T *lineHead = pixels.data() + (size_t)width * 3 * y;
+				for (int x = 0; x < width; x += kPostProcessChunk) {
+					int count = std::min(kPostProcessChunk, width - x);
+					read_row(y, x, count, r, g, b);
+					T *dst = lineHead + x * 3;
+					post_process_channel(dst + 0, 3, r, count, settings, quantize);
+					post_process_channel(dst + 1, 3, g, count, settings, quantize);
+					post_process_channel(dst + 2, 3, b, count, settings, quantize);
+				}
+			}
+		});
+	}
+
+	// 積算バッファから直接 (to_image を経ない)
+	template <class T>
+	inline void post_process(std::vector<T> &pixels, const AccumlationBuffer &buffer, const PostProcessSettings &settings = PostProcessSettings()) {
+		post_process_rows(pixels, buffer._width, buffer._height, settings, [&buffer](int y, int x, int count, float *r, float *g, float *b) {
+			int head = y * buffer._width + x;
+			for (int i = 0; i < count; ++i) {
+				int n = buffer.sample_count(head + i);
+				float inv = 0 < n ? 1.0f / n : 0.0f;
+				r[i] = (float)buffer._color[0][head + i] * inv;
+				g[i] = (float)buffer._color[1][head + i] * inv;
+				b[i] = (float)buffer._color[2][head + i] * inv;
+			}
+		});
+	}
+
+	// デノイズした画像などから
+	template <class T>
+	inline void post_process(std::vector<T> &pixels, const Image &image, const PostProcessSettings &settings = PostProcessSettings()) {
+		post_process_rows(pixels, image.width, image.height, settings, [&image](int y, int x, int count, float *r, float *g, float *b) {
+			const Vec3 *src = image.pixels.data() + y * image.width + x;
+			for (int i = 0; i < count; ++i) {
+				r[i] = (float)src[i].x;
+				g[i] = (float)src[i].y;
+				b[i] = (float)src[i].z;
+			}
+		});
+	}
+}
@@ -0,0 +1,363 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <new>
+
+#include "accumlation_buffer.hpp"
+#include "post_process.hpp"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+別のプロセスへの途中経過のプレビュー (POSIX の共有メモリ上のリングバッファ)
+描画側 (PreviewPublisher) は縮小した画像をスロットへ順に書き、見る側 (PreviewReader) は最新のスロットを写して読む
+  スロットのシーケンス番号は書いている間は奇数、書き終えたら偶数 (seqlock)
+  読む側は写す前後で番号が同じ偶数なら成功、違えば途中で書き換えられたので読み直す
+描画側は見る側を一切待たない。スロットは kPreviewSlots 個あるので、見る側が遅れても直前のフレームとは重ならない
+形式は Rgb8 (後処理済みの 8bit, post_process.hpp) か RgbFloat (トーンマッピング前の放射輝度)
+名前は shm_open の名前 ('/' がなければ先頭につける)。Windows ではいつも open が false
+*/
+namespace lc {
+	enum class PreviewFormat : uint32_t {
+		Rgb8 = 0,
+		RgbFloat = 1
+	};
+
+	static const char kPreviewMagic[4] = { 'L', 'C', 'P', 'V' };
+	static const uint32_t kPreviewVersion = 1;
+	static const int kPreviewSlots = 3;
+
+	// 64bit のアトミックがロックなしでないと、プロセスをまたいで共有できない
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared atomics must be lock free");
+
+	struct PreviewHeader {
+		char magic[4];
+		uint32_t version;
+		int32_t width;  /* プレビューの大きさ */
+		int32_t height;
+		int32_t slot_count;
+		uint32_t format; /* PreviewFormat */
+		uint64_t slot_stride; /* スロットの見出しと画素を合わせた大きさ */
+		std::atomic<uint64_t> latest; /* 最後に書き終えたフレームの番号 (1 から。0 ならまだない) */
+		std::atomic<uint64_t> closed; /* 描画を終えたら 1 */
+	};
+
+	// 画素はスロットの見出しの直後に続く
+	struct PreviewSlot {
+		std::atomic<uint64_t> sequence;
+		uint64_t frame;
+		int32_t pass;
+		int32_t spp;
+		double elapsed;
+	};
+
+	struct PreviewFrame {
+		uint64_t frame = 0;
+		int width = 0;
+		int height = 0;
+		PreviewFormat format = PreviewFormat::Rgb8;
+		int pass = 0;
+		int spp = 0;
+		double elapsed = 0.0;
+		std::vector<uint8_t> pixels; /* Rgb8 なら width * height * 3 バイト、RgbFloat なら width * height * 3 個の float */
+	};
+
+	inline size_t preview_align(size_t size) {
+		return (size + 63) & ~size_t(63);
+	}
+	inline size_t preview_pixel_bytes(int width, int height, PreviewFormat format) {
+		return (size_t)width * height * 3 * (format == PreviewFormat::Rgb8 ? 1 : sizeof(float));
+	}
+	inline std::string preview_shm_name(const std::string &name) {
+		return name.empty() == false && name[0] == '/' ? name : "/" + name;
+	}
+
+	class PreviewPublisher {
+	public:
+		PreviewPublisher() {}
+		~PreviewPublisher() {
+			close();
+		}
+		PreviewPublisher(const PreviewPublisher &) = delete;
+		void operator=(const PreviewPublisher &) = delete;
+
+		/*
+		共有メモリを作る。width x height の画像を整数分の1に縮め、長辺を max_size 以下にして流す
+		同じ名前の古いものは消して作り直す
+		*/
+		bool open(const std::string &name, int width, int height, int max_size = 256, PreviewFormat format = PreviewFormat::Rgb8) {
+			close();
+#ifdef _WIN32
+			return false;
+#else
+			if (width <= 0 || height <= 0 || max_size <= 0) {
+				return false;
+			}
+			_scale = (std::max(width, height) + max_size - 1) / max_size;
+			_width = std::max(width / _scale, 1);
+			_height = std::max(height / _scale, 1);
+			_format = format;
+			size_t slot_stride = preview_align(sizeof(PreviewSlot)) + preview_align(preview_pixel_bytes(_width, _height, format));
+			_size = preview_align(sizeof(PreviewHeader)) + slot_stride * kPreviewSlots;
+
+			_name = preview_shm_name(name);
+			::shm_unlink(_name.c_str());
+			int fd = ::shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+			if (fd < 0) {
+				return false;
+			}
+			if (::ftruncate(fd, _size) != 0) {
+				::close(fd);
+				::shm_unlink(_name.c_str());
+				return false;
+			}
+			void *mapped = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (mapped == MAP_FAILED) {
+				::shm_unlink(_name.c_str());
+				return false;
+			}
+			_memory = static_cast<uint8_t *>(mapped);
+
+			_header = new (_memory) PreviewHeader();
+			std::memcpy(_header->magic, kPreviewMagic, sizeof(_header->magic));
+			_header->version = kPreviewVersion;
+			_header->width = _width;
+			_header->height = _height;
+			_header->slot_count = kPreviewSlots;
+			_header->format = static_cast<uint32_t>(format);
+			_header->slot_stride = slot_stride;
+			_header->latest.store(0);
+			_header->closed.store(0);
+			for (int i = 0; i < kPreviewSlots; ++i) {
+				PreviewSlot *slot = new (slot_at(i)) PreviewSlot();
+				slot->sequence.store(0);
+			}
+			_frame = 0;
+			return true;
+#endif
+		}
+
+		bool is_open() const {
+			return _memory != nullptr;
+		}
+
+		// 縮小して次のスロットへ書く。見る側は待たない
+		void publish(const AccumlationBuffer &buffer, int pass, double elapsed) {
+			if (_memory == nullptr) {
+				return;
+			}
+			// 縮める (scale x scale 画素の平均)
+			_image.resize(_width, _height);
+			int scale = _scale;
+			parallel_for(_height, [this, &buffer, scale](int beg_y, int end_y) {
+				double inv = 1.0 / (scale * scale);
+				for (int y = beg_y; y < end_y; ++y) {
+					for (int x = 0; x < _width; ++x) {
+						Vec3 sum;
+						for (int sy = 0; sy < scale; ++sy) {
+							int src_y = std::min(y * scale + sy, buffer._height - 1);
+							for (int sx = 0; sx < scale; ++sx) {
+								int src_x = std::min(x * scale + sx, buffer._width - 1);
+								sum += buffer.normalized(src_y * buffer._width + src_x);
+							}
+						}
+						_image.pixels[y * _width + x] = sum * inv;
+					}
+				}
+			});
+
+			uint64_t frame = _frame + 1;
+			PreviewSlot *slot = slot_at((int)(frame % kPreviewSlots));
+			uint8_t *pixels = reinterpret_cast<uint8_t *>(slot) + preview_align(sizeof(PreviewSlot));
+
+			uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+			slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			slot->frame = frame;
+			slot->pass = pass;
+			slot->spp = buffer.samples_per_pixel();
+			slot->elapsed = elapsed;
+			if (_format == PreviewFormat::Rgb8) {
+				post_process(_rgb8, _image);
+				std::memcpy(pixels, _rgb8.data(), _rgb8.size());
+			}
+			else {
+				float *dst = reinterpret_cast<float *>(pixels);
+				for (size_t i = 0; i < _image.pixels.size(); ++i) {
+					for (int c = 0; c < 3; ++c) {
+						dst[i * 3 + c] = (float)_image.pixels[i][c];
+					}
+				}
+			}
+
+			slot->sequence.store(sequence + 2, std::memory_order_release);
+			_header->latest.store(frame, std::memory_order_release);
+			_frame = frame;
+		}
+
+		// 描画を終えたことを知らせて外す (見る側が開いたままでも名前は消える)
+		void close() {
+#ifndef _WIN32
+			if (_memory == nullptr) {
+				return;
+			}
+			_header->closed.store(1, std::memory_order_release);
+			::munmap(_memory, _size);
+			::shm_unlink(_name.c_str());
+			_memory = nullptr;
+			_header = nullptr;
+#endif
+		}
+
+		int width() const {
+			return _width;
+		}
+		int height() const {
+			return _height;
+		}
+	private:
+		PreviewSlot *slot_at(int index) const {
+			return reinterpret_cast<PreviewSlot *>(_memory + preview_align(sizeof(PreviewHeader)) + _header->slot_stride * index);
+		}
+
+		std::string _name;
+		uint8_t *_memory = nullptr;
+		size_t _size = 0;
+		PreviewHeader *_header = nullptr;
+		int _scale = 1;
+		int _width = 0;
+		int _height = 0;
+		PreviewFormat _format = PreviewFormat::Rgb8;
+		uint64_t _frame = 0;
+		Image _image;
+		std::vector<uint8_t> _rgb8;
+	};
+
+	class PreviewReader {
+	public:
+		PreviewReader() {}
+		~PreviewReader() {
+			close();
+		}
+		PreviewReader(const PreviewReader &) = delete;
+		void operator=(const PreviewReader &) = delete;
+
+		// 描画側が作った共有メモリを読み取り専用で開く。まだなければ false (あとで開き直す)
+		bool open(const std::string &name) {
+			close();
+#ifdef _WIN32
+			return false;
+#else
+			int fd = ::shm_open(preview_shm_name(name).c_str(), O_RDONLY, 0);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PreviewHeader)) {
+				::close(fd);
+				return false;
+			}
+			void *mapped = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (mapped == MAP_FAILED) {
+				return false;
+			}
+			_memory = static_cast<const uint8_t *>(mapped);
+			_size = st.st_size;
+			_header = reinterpret_cast<const PreviewHeader *>(_memory);
+			bool ok = std::memcmp(_header->magic, kPreviewMagic, sizeof(_header->magic)) == 0
+				&& _header->version == kPreviewVersion
+				&& 0 < _header->slot_count
+				&& preview_align(sizeof(PreviewHeader)) + _header->slot_stride * _header->slot_count <= _size;
+			if (ok == false) {
+				close();
+				return false;
+			}
+			_last = 0;
+			_skipped = 0;
+			return true;
+#endif
+		}
+
+		/*
+		前に読んだものより新しいフレームがあれば frame へ写して true
+		書き換えと重なったら読み直す。何度も重なるときは諦めて false (次の呼び出しで読む)
+		*/
+		bool read(PreviewFrame &frame) {
+			if (_memory == nullptr) {
+				return false;
+			}
+			int width = _header->width;
+			int height = _header->height;
+			PreviewFormat format = static_cast<PreviewFormat>(_header->format);
+			size_t pixel_bytes = preview_pixel_bytes(width, height, format);
+			for (int attempt = 0; attempt < 4; ++attempt) {
+				uint64_t latest = _header->latest.load(std::memory_order_acquire);
+				if (latest == 0 || latest <= _last) {
+					return false;
+				}
+				const uint8_t *slot_memory = _memory + preview_align(sizeof(PreviewHeader)) + _header->slot_stride * (latest % _header->slot_count);
+				const PreviewSlot *slot = reinterpret_cast<const PreviewSlot *>(slot_memory);
+
+				uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+				if (sequence & 1) {
+					continue;
+				}
+				frame.frame = slot->frame;
+				frame.pass = slot->pass;
+				frame.spp = slot->spp;
+				frame.elapsed = slot->elapsed;
+				frame.width = width;
+				frame.height = height;
+				frame.format = format;
+				frame.pixels.resize(pixel_bytes);
+				std::memcpy(frame.pixels.data(), slot_memory + preview_align(sizeof(PreviewSlot)), pixel_bytes);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot->sequence.load(std::memory_order_relaxed) != sequence || frame.frame <= _last) {
+					continue;
+				}
+				_skipped += frame.frame - _last - 1;
+				_last = frame.frame;
+				return true;
+			}
+			return false;
+		}
+
+		// 描画側が閉じたか (そのあとも最後のフレームは読める)
+		bool closed() const {
+			return _memory != nullptr && _header->closed.load(std::memory_order_acquire) != 0;
+		}
+
+		// 読まずに飛ばしたフレームの数
+		uint64_t skipped() const {
+			return _skipped;
+		}
+
+		void close() {
+#ifndef _WIN32
+			if (_memory != nullptr) {
+				::munmap(const_cast<uint8_t *>(_memory), _size);
+			}
+#endif
+			_memory = nullptr;
+			_header = nullptr;
+		}
+	private:
+		const uint8_t *_memory = nullptr;
+		size_t _size = 0;
+		const PreviewHeader *_header = nullptr;
+		uint64_t _last = 0;
+		uint64_t _skipped = 0;
+	};
+}
@@ -13,10 +13,12 @@
 #include <math.h>
 #include <algorithm>
 #include <random>
+#include <tuple>
 
 #include <glm/glm.hpp>
 
 #include "render_type.hpp"
+#include "sampler.hpp"
 
 namespace lc {
 	struct Xor {
@@ -97,6 +99,13 @@ namespace lc {
 			return a + continuous() * (b - a);
 		}
 
+		// 続けて2次元ぶん。make_tuple(continuous(), continuous()) は引数の評価順がコンパイラで違うので使わない
+		std::tuple<double, double> continuous_2d() {
+			double x = continuous();
+			double y = continuous();
+			return std::make_tuple(x, y);
+		}
+
 		// R = 1
 		Vec2 on_circle() {
 			double r_sqrt = glm::sqrt(this->continuous());
@@ -131,7 +140,10 @@ namespace lc {
 		}
 	};
 
-	typedef RandomEngine<Xor> DefaultEngine;
+	// パスの乱数は次元を意識したサンプラーから引く (sampler.hpp)
+	typedef RandomEngine<PathSampler> DefaultEngine;
+
+	//typedef RandomEngine<Xor> DefaultEngine;
 
 	//// typedef MersenneTwister DefaultEngine;
 	//// typedef LCGs DefaultEngine;
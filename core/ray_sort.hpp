@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include <boost/optional.hpp>
+
+#include "render_type.hpp"
+#include "collision_aabb.hpp"
+#include "scene.hpp"
+
+/*
+レイの並べ替え
+拡散面から出たレイはほぼランダムな方向を向くので、そのまま追うとBVHのキャッシュ効率が悪い
+方向の象限(3bit)と原点のモートンコード(30bit)をキーにして並べ替え、似たレイをまとめて追う
+*/
+namespace lc {
+	// 10bitの値を3bitおきに広げる
+	inline uint32_t expand_bits_10(uint32_t v) {
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x030000ff;
+		v = (v | (v << 8)) & 0x0300f00f;
+		v = (v | (v << 4)) & 0x030c30c3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+	inline uint32_t morton3(uint32_t x, uint32_t y, uint32_t z) {
+		return (expand_bits_10(x) << 2) | (expand_bits_10(y) << 1) | expand_bits_10(z);
+	}
+
+	// 上位3bitが方向の象限、下位30bitが原点のモートンコード
+	inline uint64_t ray_sort_key(const Ray &ray, const AABB &bounds) {
+		uint64_t octant =
+			(ray.d.x < 0.0 ? 4 : 0) |
+			(ray.d.y < 0.0 ? 2 : 0) |
+			(ray.d.z < 0.0 ? 1 : 0);
+
+		Vec3 size = bounds.max_position - bounds.min_position;
+		uint32_t q[3];
+		for (int i = 0; i < 3; ++i) {
+			double t = 0.0 < size[i] ? (ray.o[i] - bounds.min_position[i]) / size[i] : 0.0;
+			q[i] = static_cast<uint32_t>(glm::clamp(t, 0.0, 1.0) * 1023.0);
+		}
+		return (octant << 30) | morton3(q[0], q[1], q[2]);
+	}
+
+	/*
+	indicesを、rays[indices[i]]のキー順に並べ替える
+	boundsはレイの原点を量子化する範囲で、空ならレイの原点から求める
+	*/
+	inline void sort_rays(std::vector<int> &indices, const std::vector<Ray> &rays, AABB bounds = AABB()) {
+		if (indices.size() < 2) {
+			return;
+		}
+		if (empty(bounds)) {
+			for (int index : indices) {
+				bounds = expand(bounds, rays[index].o);
+			}
+		}
+
+		std::vector<std::pair<uint64_t, int>> keys(indices.size());
+		for (int i = 0; i < indices.size(); ++i) {
+			keys[i] = std::make_pair(ray_sort_key(rays[indices[i]], bounds), indices[i]);
+		}
+		std::sort(keys.begin(), keys.end());
+		for (int i = 0; i < indices.size(); ++i) {
+			indices[i] = keys[i].second;
+		}
+	}
+
+	/*
+	並べ替えてからまとめて交差判定する
+	結果はrayと同じ並び
+	*/
+	inline void intersect_sorted(const std::vector<Ray> &rays, const Scene &scene, std::vector<boost::optional<MicroSurface>> &surfaces) {
+		std::vector<int> order(rays.size());
+		for (int i = 0; i < rays.size(); ++i) {
+			order[i] = i;
+		}
+		sort_rays(order, rays);
+
+		surfaces.resize(rays.size());
+		for (int index : order) {
+			surfaces[index] = intersect(rays[index], scene);
+		}
+	}
+
+	// 並べ替えてからまとめて遮蔽を調べる
+	inline void is_visible_sorted(const std::vector<Ray> &rays, const std::vector<double> &tmin_targets, const Scene &scene, std::vector<char> &visibles) {
+		std::vector<int> order(rays.size());
+		for (int i = 0; i < rays.size(); ++i) {
+			order[i] = i;
+		}
+		sort_rays(order, rays);
+
+		visibles.resize(rays.size());
+		for (int index : order) {
+			visibles[index] = is_visible(rays[index], scene, tmin_targets[index]) ? 1 : 0;
+		}
+	}
+}
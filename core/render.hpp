@@ -1,6 +1,8 @@
 ﻿#pragma once
 
 #include "parallel_for.hpp"
+#include "tile_scheduler.hpp"
+#include "accumlation_buffer.hpp"
 
 #include "constants.hpp"
 #include "collision_triangle.hpp"
@@ -18,46 +20,6 @@
 #include "fixed_vector.hpp"
 
 namespace lc {
-	struct AccumlationBuffer {
-		AccumlationBuffer(int width, int height, int random_skip = 50) :_width(width), _height(height), _data(width * height) {
-			for (int y = 0; y < _height; ++y) {
-				for (int x = 0; x < _width; ++x) {
-					int index = y * _width + x;
-					Pixel &pixel = _data[index];
-					pixel.engine = DefaultEngine(index + 1);
-					pixel.engine.discard(random_skip);
-				}
-			}
-		}
-		struct Pixel {
-			Vec3 color;
-			DefaultEngine engine;
-		};
-
-		void to_image(Image &image) {
-			image.resize(_width, _height);
-			double normalize_value = 1.0 / _iteration;
-			parallel_for(image.height, [normalize_value, &image, this](int beg_y, int end_y) {
-				for (int y = beg_y; y < end_y; ++y) {
-					Vec3 *lineHead = image.pixels.data() + image.width * y;
-					for (int x = 0; x < image.width; ++x) {
-						int index = y * image.width + x;
-						const AccumlationBuffer::Pixel &pixel = _data[index];
-						Vec3 *dstRGB = lineHead + x;
-						Vec3 color = pixel.color * normalize_value;
-						*dstRGB = color;
-					}
-				}
-			});
-		}
-
-		int _width = 0;
-		int _height = 0;
-		std::vector<Pixel> _data;
-		int _iteration = 0;
-		int _ray_count = 0;
-	};
-	
 	struct Path {
 		struct Node {
 			Vec3 omega_i;
@@ -91,17 +53,20 @@ namespace lc {
 		// path.nodes.reserve(max_trace);
 
 		for (int i = 0; i < kMaxDepth && diffusion_count < max_diffusion_count; ++i) {
+			engine.start_bounce(i);
 			auto intersection = intersect(curr_ray, scene);
 			if (!intersection) {
 				break;
 			}
 			auto surface = *intersection;
+			const Material &material = scene.materials[surface.material];
 
 			Vec3 omega_o = -curr_ray.d;
-			if (auto lambert = boost::get<LambertMaterial>(&surface.m)) {
+			if (auto lambert = boost::get<LambertMaterial>(&material)) {
 				diffusion_count += 1.0;
 
-				auto eps = std::make_tuple(engine.continuous(), engine.continuous());
+				engine.start_dimension(kDimensionBSDFDirection);
+				auto eps = engine.continuous_2d();
 				Sample<Vec3> lambert_sample = importance_lambert(eps, surface.n);
 				Vec3 omega_i = lambert_sample.value;
 				Vec3 omega_o = -curr_ray.d;
@@ -127,10 +92,11 @@ namespace lc {
 				curr_ray = Ray(glm::fma(omega_o, kReflectionBias, surface.p), omega_i);
 				continue;
 			}
-			else if (auto cook = boost::get<CookTorranceMaterial>(&surface.m)) {
+			else if (auto cook = boost::get<CookTorranceMaterial>(&material)) {
 				diffusion_count += cook->roughness;
 
-				auto eps = std::make_tuple(engine.continuous(), engine.continuous());
+				engine.start_dimension(kDimensionBSDFDirection);
+				auto eps = engine.continuous_2d();
 				Sample<GGXValue> ggx_sample = importance_ggx(eps, surface.n, omega_o, cook->roughness);
 
 				Vec3 n = surface.n;
@@ -155,6 +121,7 @@ namespace lc {
 
 				// フレネルによるBRDFブレンディング
 				Vec3 albedo;
+				engine.start_dimension(kDimensionBSDFLobe);
 				if (engine.continuous() < f) {
 					double g = G(omega_i, omega_o, ggx_sample.value.h, n, cook->roughness);
 					double d = ggx_d(glm::dot(ggx_sample.value.h, n), cook->roughness);
@@ -164,7 +131,8 @@ namespace lc {
 				}
 				else {
 					// brdf = 0;
-					auto eps = std::make_tuple(engine.continuous(), engine.continuous());
+					engine.start_dimension(kDimensionBSDFDiffuse);
+					auto eps = engine.continuous_2d();
 					Sample<Vec3> lambert_sample = importance_lambert(eps, surface.n);
 					omega_i = lambert_sample.value;
 					omega_o = -curr_ray.d;
@@ -193,12 +161,13 @@ namespace lc {
 				curr_ray = Ray(glm::fma(omega_o, kReflectionBias, surface.p), omega_i);
 				continue;
 			}
-			else if (auto refrac = boost::get<RefractionMaterial>(&surface.m)) {
+			else if (auto refrac = boost::get<RefractionMaterial>(&material)) {
 				double eta = surface.isback ? refrac->ior / 1.0 : 1.0 / refrac->ior;
 				double fresnel_value = fresnel(dot(omega_o, surface.n), 0.02);
 
 				coef *= refrac->albedo;
 
+				engine.start_dimension(kDimensionBSDFLobe);
 				if (fresnel_value < engine.continuous()) {
 					auto omega_i_refract = refraction(-omega_o, surface.n, eta);
 					curr_ray = Ray(glm::fma(omega_i_refract, kReflectionBias, surface.p), omega_i_refract);
@@ -210,12 +179,12 @@ namespace lc {
 					continue;
 				}
 			}
-			else if (auto specular = boost::get<PerfectSpecularMaterial>(&surface.m)) {
+			else if (boost::get<PerfectSpecularMaterial>(&material)) {
 				auto omega_i_reflect = glm::reflect(-omega_o, surface.n);
 				curr_ray = Ray(glm::fma(omega_i_reflect, kReflectionBias, surface.p), omega_i_reflect);
 				continue;
 			}
-			else if (auto emissive = boost::get<EmissiveMaterial>(&surface.m)) {
+			else if (boost::get<EmissiveMaterial>(&material)) {
 				Path::Node node;
 				node.coef = coef;
 				node.pdf = pdf;
@@ -230,110 +199,198 @@ namespace lc {
 		return path;
 	}
 
-	inline Vec3 radiance(const Ray &camera_ray, const Scene &scene, DefaultEngine &engine) {
-		// 通常のパストレーシング
-		Path camera_path = path_trace(camera_ray, scene, engine);
+	/*
+	NEEの候補
+	contrib.value は遮蔽がなかった場合の寄与で、shadow_rayで可視性を調べてから確定する
+	*/
+	struct ExplicitCandidate {
+		Sample<Vec3> contrib;
+		Ray shadow_ray;
+		double tmin = 0.0;
+	};
 
-		// そもそもカメラレイが衝突していない
-		if (camera_path.nodes.empty()) {
-			return Vec3();
+	// Lambert面からのNEE
+	// coef, pdf_path はこの面に至るまでの経路の係数と確率密度
+	inline ExplicitCandidate explicit_candidate_lambert(const Scene &scene, const MicroSurface &surface, const LambertMaterial &lambert, const Vec3 &coef, double pdf_path, DefaultEngine &engine) {
+		auto sample = direct_light_sample(scene, surface.p, engine);
+		// TODO emissiveが0ならやらなくていい？
+		double pdf = pdf_path * sample.pdf;
+
+		auto emissive = sample->onLight.emissive;
+		Vec3 omega_i = sample->ray.d;
+		double brdf = glm::one_over_pi<double>();
+		double cos_term = glm::max(glm::dot(surface.n, omega_i), 0.0);
+		Vec3 this_coef = lambert.albedo * brdf * cos_term;
+
+		ExplicitCandidate candidate;
+		candidate.contrib.value = this_coef * emissive.color * coef / glm::max(pdf, kEPS);
+		candidate.contrib.pdf = pdf;
+		candidate.shadow_ray = sample->ray;
+		candidate.tmin = sample->tmin - kEPS;
+		return candidate;
+	}
+
+	// CookTorrance面からのNEE
+	inline ExplicitCandidate explicit_candidate_cook_torrance(const Scene &scene, const MicroSurface &surface, const Vec3 &omega_o, const CookTorranceMaterial &cook, const Vec3 &coef, double pdf_path, DefaultEngine &engine) {
+		auto sample = direct_light_sample(scene, surface.p, engine);
+
+		auto emissive = sample->onLight.emissive;
+		double pdf = pdf_path * sample.pdf;
+
+		Vec3 n = surface.n;
+		Vec3 omega_i = sample->ray.d;
+		double cos_term = glm::max(glm::dot(n, omega_i), 0.0);
+		double f = lc::fresnel(cos_term, cook.fesnel_coef);
+
+		double brdf = 0.0;
+		Vec3 albedo;
+		engine.start_dimension(kDimensionLightLobe);
+		if (engine.continuous() < f) {
+			Vec3 h = glm::normalize(omega_i + omega_o);
+			double g = G(omega_i, omega_o, h, n, cook.roughness);
+			double d = ggx_d(glm::dot(h, n), cook.roughness);
+			brdf = d * g / glm::max(4.0 * glm::dot(omega_o, n) * cos_term, kEPS);
+			albedo = cook.albedo_specular;
+		}
+		else {
+			brdf = glm::one_over_pi<double>();
+			albedo = cook.albedo_diffuse;
 		}
 
-		// そもそも最初がライトだった特殊ケース
-		if (auto emissive = boost::get<EmissiveMaterial>(&camera_path.nodes[0].surface.m)) {
-			return emissive->color;
+		Vec3 this_coef = albedo * brdf * cos_term;
+
+		// 
+		//double max_coef = glm::max(glm::max(this_coef.r, this_coef.g), this_coef.b);
+		//double nee_probability = glm::clamp(max_coef * 1.5, 0.01, 1.0);
+		//if (engine.continuous() < nee_probability) {
+		//	if (is_visible(sample->ray, scene, sample->tmin - kEPS)) {
+		//		Sample<Vec3> contrib;
+		//		contrib.value = this_coef * emissive.color * camera_node.coef / glm::max(pdf, kEPS);
+		//		contrib.pdf = nee_probability * pdf;
+		//		explicit_contributions.push_back(contrib);
+		//	}
+		//}
+
+		ExplicitCandidate candidate;
+		candidate.contrib.value = this_coef * emissive.color * coef / glm::max(pdf, kEPS);
+		candidate.contrib.pdf = pdf;
+		candidate.shadow_ray = sample->ray;
+		candidate.tmin = sample->tmin - kEPS;
+		return candidate;
+	}
+
+	// 遮蔽されていたら寄与は0 (pdfはMISのために残す)
+	inline Sample<Vec3> resolve_explicit(const Scene &scene, const ExplicitCandidate &candidate) {
+		Sample<Vec3> contrib = candidate.contrib;
+		if (is_visible(candidate.shadow_ray, scene, candidate.tmin) == false) {
+			contrib.value = Vec3();
 		}
+		return contrib;
+	}
 
-		Sample<Vec3> implicit_contribution;
-		fixed_vector<Sample<Vec3>, kMaxDepth> explicit_contributions;
+	inline Sample<Vec3> explicit_lambert(const Scene &scene, const MicroSurface &surface, const LambertMaterial &lambert, const Vec3 &coef, double pdf_path, DefaultEngine &engine) {
+		return resolve_explicit(scene, explicit_candidate_lambert(scene, surface, lambert, coef, pdf_path, engine));
+	}
+	inline Sample<Vec3> explicit_cook_torrance(const Scene &scene, const MicroSurface &surface, const Vec3 &omega_o, const CookTorranceMaterial &cook, const Vec3 &coef, double pdf_path, DefaultEngine &engine) {
+		return resolve_explicit(scene, explicit_candidate_cook_torrance(scene, surface, omega_o, cook, coef, pdf_path, engine));
+	}
 
-		for (int ci = 0; ci < camera_path.nodes.size(); ++ci) {
-			bool is_term = ci + 1 == camera_path.nodes.size();
+	/*
+	BSDFに基づいて次のレイを決める
+	coef, pdf はこの面までの経路の係数と確率密度で、この面の分を掛けて更新する
+	*/
+	inline Ray bounce_lambert(const MicroSurface &surface, const Vec3 &omega_o, const LambertMaterial &lambert, Vec3 &coef, double &pdf, DefaultEngine &engine) {
+		engine.start_dimension(kDimensionBSDFDirection);
+		auto eps = engine.continuous_2d();
+		Sample<Vec3> lambert_sample = importance_lambert(eps, surface.n);
+		Vec3 omega_i = lambert_sample.value;
+
+		// BRDF 
+		double brdf = glm::one_over_pi<double>();
+		double cos_term = glm::max(glm::dot(surface.n, omega_i), 0.0);
+		Vec3 this_coef = lambert.albedo * brdf * cos_term;
+
+		coef *= this_coef;
+		pdf *= lambert_sample.pdf;
+
+		return Ray(glm::fma(omega_o, kReflectionBias, surface.p), omega_i);
+	}
 
-			Path::Node camera_node = camera_path.nodes[ci];
-			if (auto lambert = boost::get<LambertMaterial>(&camera_node.surface.m)) {
-				auto sample = direct_light_sample(scene, camera_node.surface.p, engine);
-				// TODO emissiveが0ならやらなくていい？
-				double pdf = camera_node.pdf * sample.pdf;
-
-				if (is_visible(sample->ray, scene, sample->tmin - kEPS)) {
-					auto emissive = sample->onLight.emissive;
-					Vec3 omega_i = sample->ray.d;
-					double brdf = glm::one_over_pi<double>();
-					double cos_term = glm::max(glm::dot(camera_node.surface.n, omega_i), 0.0);
-					Vec3 this_coef = lambert->albedo * brdf * cos_term;
-					Sample<Vec3> contrib;
-					contrib.value = this_coef * emissive.color * camera_node.coef / glm::max(pdf, kEPS);
-					contrib.pdf = pdf;
-					explicit_contributions.push_back(contrib);
-				}
-				else {
-					Sample<Vec3> contrib;
-					contrib.value = Vec3();
-					contrib.pdf = pdf;
-					explicit_contributions.push_back(contrib);
-				}
-			}
-			else if (auto cook = boost::get<CookTorranceMaterial>(&camera_node.surface.m)) {
-				auto sample = direct_light_sample(scene, camera_node.surface.p, engine);
+	// 面の裏へ抜けた場合はfalse (パス全体を捨てる)
+	inline bool bounce_cook_torrance(const MicroSurface &surface, const Vec3 &omega_o, const CookTorranceMaterial &cook, Vec3 &coef, double &pdf, Ray &next_ray, DefaultEngine &engine) {
+		Vec3 n = surface.n;
+		engine.start_dimension(kDimensionBSDFDirection);
+		auto eps = engine.continuous_2d();
+		Sample<GGXValue> ggx_sample = importance_ggx(eps, n, omega_o, cook.roughness);
+		Vec3 omega_i = ggx_sample.value.omega_i;
 
-				auto emissive = sample->onLight.emissive;
-				double pdf = camera_node.pdf * sample.pdf;
+		if (glm::dot(omega_i, n) < 0.0) {
+			return false;
+		}
 
-				Vec3 n = camera_node.surface.n;
-				Vec3 omega_o = camera_node.omega_o;
-				Vec3 omega_i = sample->ray.d;
-				double cos_term = glm::max(glm::dot(n, omega_i), 0.0);
-				double f = lc::fresnel(cos_term, cook->fesnel_coef);
+		double this_pdf = ggx_sample.pdf;
+		double cos_term = glm::max(glm::dot(n, omega_i), 0.0);
+		double f = lc::fresnel(cos_term, cook.fesnel_coef);
 
-				double brdf = 0.0;
-				Vec3 albedo;
-				if (engine.continuous() < f) {
-					Vec3 h = glm::normalize(omega_i + omega_o);
-					double g = G(omega_i, omega_o, h, n, cook->roughness);
-					double d = ggx_d(glm::dot(h, n), cook->roughness);
-					brdf = d * g / glm::max(4.0 * glm::dot(omega_o, n) * cos_term, kEPS);
-					albedo = cook->albedo_specular;
-				}
-				else {
-					brdf = glm::one_over_pi<double>();
-					albedo = cook->albedo_diffuse;
-				}
+		double brdf = 0.0;
 
-				Vec3 this_coef = albedo * brdf * cos_term;
-				if (is_visible(sample->ray, scene, sample->tmin - kEPS)) {
-					Sample<Vec3> contrib;
-					contrib.value = this_coef * emissive.color * camera_node.coef / glm::max(pdf, kEPS);
-					contrib.pdf = pdf;
-					explicit_contributions.push_back(contrib);
-				}
-				else {
-					Sample<Vec3> contrib;
-					contrib.value = Vec3();
-					contrib.pdf = pdf;
-					explicit_contributions.push_back(contrib);
-				}
+		// フレネルによるBRDFブレンディング
+		Vec3 albedo;
+		engine.start_dimension(kDimensionBSDFLobe);
+		if (engine.continuous() < f) {
+			double g = G(omega_i, omega_o, ggx_sample.value.h, n, cook.roughness);
+			double d = ggx_d(glm::dot(ggx_sample.value.h, n), cook.roughness);
+			brdf = d * g / glm::max(4.0 * glm::dot(omega_o, n) * cos_term, kEPS);
 
-				// 
-				//double max_coef = glm::max(glm::max(this_coef.r, this_coef.g), this_coef.b);
-				//double nee_probability = glm::clamp(max_coef * 1.5, 0.01, 1.0);
-				//if (engine.continuous() < nee_probability) {
-				//	if (is_visible(sample->ray, scene, sample->tmin - kEPS)) {
-				//		Sample<Vec3> contrib;
-				//		contrib.value = this_coef * emissive.color * camera_node.coef / glm::max(pdf, kEPS);
-				//		contrib.pdf = nee_probability * pdf;
-				//		explicit_contributions.push_back(contrib);
-				//	}
-				//}
-			}
-			if (is_term) {
-				if (auto emissive = boost::get<EmissiveMaterial>(&camera_node.surface.m)) {
-					implicit_contribution.value = emissive->color * camera_node.coef / glm::max(camera_node.pdf, kEPS);
-					implicit_contribution.pdf = camera_node.pdf;
-				}
-			}
+			albedo = cook.albedo_specular;
 		}
+		else {
+			engine.start_dimension(kDimensionBSDFDiffuse);
+			auto eps = engine.continuous_2d();
+			Sample<Vec3> lambert_sample = importance_lambert(eps, n);
+			omega_i = lambert_sample.value;
+			this_pdf = lambert_sample.pdf;
+
+			brdf = glm::one_over_pi<double>();
+
+			cos_term = glm::max(glm::dot(n, omega_i), 0.0);
 
+			albedo = cook.albedo_diffuse;
+		}
+
+		Vec3 this_coef = albedo * brdf * cos_term;
+
+		coef *= this_coef;
+		pdf *= this_pdf;
+
+		next_ray = Ray(glm::fma(omega_o, kReflectionBias, surface.p), omega_i);
+		return true;
+	}
+
+	inline Ray bounce_refraction(const MicroSurface &surface, const Vec3 &omega_o, const RefractionMaterial &refrac, Vec3 &coef, DefaultEngine &engine) {
+		double eta = surface.isback ? refrac.ior / 1.0 : 1.0 / refrac.ior;
+		double fresnel_value = fresnel(dot(omega_o, surface.n), 0.02);
+
+		coef *= refrac.albedo;
+
+		engine.start_dimension(kDimensionBSDFLobe);
+		if (fresnel_value < engine.continuous()) {
+			auto omega_i_refract = refraction(-omega_o, surface.n, eta);
+			return Ray(glm::fma(omega_i_refract, kReflectionBias, surface.p), omega_i_refract);
+		}
+		auto omega_i_reflect = glm::reflect(-omega_o, surface.n);
+		return Ray(glm::fma(omega_i_reflect, kReflectionBias, surface.p), omega_i_reflect);
+	}
+
+	inline Ray bounce_specular(const MicroSurface &surface, const Vec3 &omega_o) {
+		auto omega_i_reflect = glm::reflect(-omega_o, surface.n);
+		return Ray(glm::fma(omega_i_reflect, kReflectionBias, surface.p), omega_i_reflect);
+	}
+
+	typedef fixed_vector<Sample<Vec3>, kMaxDepth> ExplicitContributions;
+
+	// 終端の発光(implicit)と各頂点のNEE(explicit)をMISでマージ
+	inline Vec3 merge_contributions(const Sample<Vec3> &implicit_contribution, const ExplicitContributions &explicit_contributions) {
 		// ビジュアライズ
 		/*
 		implicit_contribution.value = Vec3(0.4, 0.0, 0.0);
@@ -341,8 +398,6 @@ namespace lc {
 			explicit_contributions[i].value = Vec3(0.0, 0.4, 0.0);
 		}
 		*/
-		{
-		}
 
 		// 片方の戦略しか使えない場合に対応
 		if (explicit_contributions.empty()) {
@@ -350,7 +405,7 @@ namespace lc {
 		}
 		if (implicit_contribution.pdf < glm::epsilon<double>()) {
 			Vec3 color;
-			for (int i = 0; i < explicit_contributions.size(); ++i) {
+			for (size_t i = 0; i < explicit_contributions.size(); ++i) {
 				color += *explicit_contributions[i];
 			}
 			return color;
@@ -360,9 +415,9 @@ namespace lc {
 		Vec3 color;
 
 		double implicit_weight = glm::pow(implicit_contribution.pdf, 2.0);
-		Vec3 implicit = implicit_contribution.value * implicit_weight / explicit_contributions.size();
+		Vec3 implicit = implicit_contribution.value * implicit_weight / (double)explicit_contributions.size();
 
-		for (int i = 0; i < explicit_contributions.size(); ++i) {
+		for (size_t i = 0; i < explicit_contributions.size(); ++i) {
 			auto explicit_contribution = explicit_contributions[i];
 			double explicit_weight = glm::pow(explicit_contribution.pdf * explicit_contributions.size(), 2.0);
 
@@ -375,41 +430,251 @@ namespace lc {
 		return color;
 	}
 
+	inline Vec3 radiance(const Ray &camera_ray, const Scene &scene, DefaultEngine &engine) {
+		// 通常のパストレーシング
+		Path camera_path = path_trace(camera_ray, scene, engine);
+
+		// そもそもカメラレイが衝突していない
+		if (camera_path.nodes.empty()) {
+			return Vec3();
+		}
+
+		// そもそも最初がライトだった特殊ケース
+		if (auto emissive = boost::get<EmissiveMaterial>(&scene.materials[camera_path.nodes[0].surface.material])) {
+			return emissive->color;
+		}
+
+		Sample<Vec3> implicit_contribution;
+		ExplicitContributions explicit_contributions;
+
+		for (int ci = 0; ci < camera_path.nodes.size(); ++ci) {
+			bool is_term = ci + 1 == camera_path.nodes.size();
+
+			const Path::Node &camera_node = camera_path.nodes[ci];
+			const Material &camera_material = scene.materials[camera_node.surface.material];
+			engine.start_bounce(ci);
+			if (auto lambert = boost::get<LambertMaterial>(&camera_material)) {
+				explicit_contributions.push_back(explicit_lambert(scene, camera_node.surface, *lambert, camera_node.coef, camera_node.pdf, engine));
+			}
+			else if (auto cook = boost::get<CookTorranceMaterial>(&camera_material)) {
+				explicit_contributions.push_back(explicit_cook_torrance(scene, camera_node.surface, camera_node.omega_o, *cook, camera_node.coef, camera_node.pdf, engine));
+			}
+			if (is_term) {
+				if (auto emissive = boost::get<EmissiveMaterial>(&camera_material)) {
+					implicit_contribution.value = emissive->color * camera_node.coef / glm::max(camera_node.pdf, kEPS);
+					implicit_contribution.pdf = camera_node.pdf;
+				}
+			}
+		}
+
+		return merge_contributions(implicit_contribution, explicit_contributions);
+	}
+
+	// 最初の衝突の特徴 (AOV) を足す。鏡面や屈折でも先へは追わず、当たった面のものを使う
+	inline void add_primary_hit(PixelFeatures &features, const Scene &scene, const Ray &camera_ray, const MicroSurface &surface) {
+		const Material &material = scene.materials[surface.material];
+		Vec3 albedo(1.0);
+		if (auto lambert = boost::get<LambertMaterial>(&material)) {
+			albedo = lambert->albedo;
+		}
+		else if (auto cook = boost::get<CookTorranceMaterial>(&material)) {
+			albedo = cook->albedo_diffuse;
+		}
+		else if (auto refrac = boost::get<RefractionMaterial>(&material)) {
+			albedo = refrac->albedo;
+		}
+		else if (auto emissive = boost::get<EmissiveMaterial>(&material)) {
+			albedo = glm::clamp(emissive->color, Vec3(0.0), Vec3(1.0));
+		}
+		features.albedo += albedo;
+		features.normal += surface.n;
+		features.depth += glm::distance(camera_ray.o, surface.p);
+		if (features.object < 0) {
+			features.object = surface.object;
+			features.material = surface.material;
+		}
+	}
+
+	/*
+	1パス版のradiance
+	Pathを作らず、各バウンスでNEEと発光をその場で評価する。Path::Node (MicroSurface と Material) のコピーはない
+	推定量はradiance(path_trace + 後段のMIS)と同じ
+	状態は O(1) ではない: このMISの重みはパス全体のNEE回数と終端の発光のpdfで決まり、途中では畳み込めないので、
+	NEEの寄与 (値とpdf、1つ 32 バイト) を最大 kMaxDepth 個まで終端まで持ってからマージする
+	バウンスごとに重みを確定させる (最後のBSDFのpdfだけを持つ) には、MISを頂点ごとの光源/BSDFの重みに替える必要がある
+	速さは radiance とほとんど変わらない (時間はほぼ交差判定)
+	features があれば最初の衝突の特徴をそこへ足す
+	*/
+	inline Vec3 radiance_streaming(const Ray &camera_ray, const Scene &scene, DefaultEngine &engine, PixelFeatures *features = nullptr) {
+		Ray curr_ray = camera_ray;
+
+		Vec3 coef(1.0);
+		double pdf = 1.0;
+		double diffusion_count = 0;
+		double max_diffusion_count = 5.0;
+
+		Sample<Vec3> implicit_contribution;
+		ExplicitContributions explicit_contributions;
+
+		for (int i = 0; i < kMaxDepth && diffusion_count < max_diffusion_count; ++i) {
+			engine.start_bounce(i);
+			auto intersection = intersect(curr_ray, scene);
+			if (!intersection) {
+				break;
+			}
+			const MicroSurface &surface = *intersection;
+			const Material &material = scene.materials[surface.material];
+			if (i == 0 && features) {
+				add_primary_hit(*features, scene, curr_ray, surface);
+			}
+
+			Vec3 omega_o = -curr_ray.d;
+			if (auto lambert = boost::get<LambertMaterial>(&material)) {
+				diffusion_count += 1.0;
+
+				explicit_contributions.push_back(explicit_lambert(scene, surface, *lambert, coef, pdf, engine));
+				curr_ray = bounce_lambert(surface, omega_o, *lambert, coef, pdf, engine);
+				continue;
+			}
+			else if (auto cook = boost::get<CookTorranceMaterial>(&material)) {
+				diffusion_count += cook->roughness;
+
+				explicit_contributions.push_back(explicit_cook_torrance(scene, surface, omega_o, *cook, coef, pdf, engine));
+
+				// path_traceと同様に、面の裏へ抜けたパスは全体を捨てる
+				if (bounce_cook_torrance(surface, omega_o, *cook, coef, pdf, curr_ray, engine) == false) {
+					return Vec3();
+				}
+				continue;
+			}
+			else if (auto refrac = boost::get<RefractionMaterial>(&material)) {
+				curr_ray = bounce_refraction(surface, omega_o, *refrac, coef, engine);
+				continue;
+			}
+			else if (boost::get<PerfectSpecularMaterial>(&material)) {
+				curr_ray = bounce_specular(surface, omega_o);
+				continue;
+			}
+			else if (auto emissive = boost::get<EmissiveMaterial>(&material)) {
+				// そもそも最初(拡散面より前)がライトだった特殊ケース
+				if (explicit_contributions.empty()) {
+					return emissive->color;
+				}
+				implicit_contribution.value = emissive->color * coef / glm::max(pdf, kEPS);
+				implicit_contribution.pdf = pdf;
+				break;
+			}
+		}
+
+		return merge_contributions(implicit_contribution, explicit_contributions);
+	}
+
+	struct PixelSample {
+		Vec3 color;
+		double luminance_squared = 0.0;
+		PixelFeatures features;
+	};
+
+	// 1画素にaa_sample本のパスを追い、合計を返す
+	inline PixelSample trace_pixel(const Scene &scene, int x, int y, int width, int height, int aa_sample, DefaultEngine &engine) {
+		PixelSample pixel_sample;
+		for (int aai = 0; aai < aa_sample; ++aai) {
+			engine.start_path();
+			double jitter_x = engine.continuous();
+			double jitter_y = engine.continuous();
+			auto aa_offset = Vec2(jitter_x - 0.5, jitter_y - 0.5);
+
+			/* ビュー空間 */
+			auto ray_view = scene.camera.generate_ray(x + aa_offset.x, y + aa_offset.y, width, height);
+
+			/* ワールド空間 */
+			auto ray = scene.viewTransform.to_local_ray(ray_view);
+
+			Vec3 sample = radiance_streaming(ray, scene, engine, &pixel_sample.features);
+			pixel_sample.color += sample;
+			pixel_sample.luminance_squared += glm::pow(luminance(sample), 2.0);
+		}
+
+		// TODO 対症療法すぎるだろうか
+		// 捨てたサンプルも数には入れる (特徴は残す)
+		if (glm::all(glm::lessThan(pixel_sample.color, Vec3(500.0 * aa_sample))) == false) {
+			PixelSample discarded;
+			discarded.features = pixel_sample.features;
+			return discarded;
+		}
+		return pixel_sample;
+	}
+
+	// 1画素にaa_sample本のパスを追い、積算する
+	inline void sample_pixel(AccumlationBuffer &buffer, const Scene &scene, int x, int y, int aa_sample) {
+		int index = y * buffer._width + x;
+		DefaultEngine engine = buffer.sampler(index);
+		PixelSample pixel_sample = trace_pixel(scene, x, y, buffer._width, buffer._height, aa_sample, engine);
+		buffer.add(index, pixel_sample.color, pixel_sample.luminance_squared, aa_sample);
+		buffer.add_features(index, pixel_sample.features);
+	}
+
+	/*
+	タイルをスレッドごとの積算に描いてから、まとめて本体へ足す
+	締め切りを過ぎたら画素の区切りで止める (描けた画素は足す)。最後まで描けたらtrue
+	*/
+	inline bool render_tile(AccumlationBuffer &buffer, const Scene &scene, const TileScheduler &scheduler, const Tile &tile, int aa_sample,
+		RenderClock::time_point deadline = RenderClock::time_point::max()) {
+		TileAccumlation &local = thread_tile_accumlation();
+		local.reset(tile, buffer.has_features());
+		bool completed = scheduler.for_each_pixel_until(tile, deadline, [&buffer, &scene, aa_sample, &local](int x, int y) {
+			int index = y * buffer._width + x;
+			DefaultEngine engine = buffer.sampler(index);
+			PixelSample pixel_sample = trace_pixel(scene, x, y, buffer._width, buffer._height, aa_sample, engine);
+			local.add(x, y, pixel_sample.color, pixel_sample.luminance_squared, aa_sample);
+			local.add_features(x, y, pixel_sample.features);
+		});
+		local.merge(buffer);
+		return completed;
+	}
+
 	inline void step(AccumlationBuffer &buffer, const Scene &scene, int aa_sample) {
-		double aa_sample_inverse = 1.0 / aa_sample;
 		// concurrency::parallel_for<int>(0, buffer._height, [&buffer, &scene, aa_sample, aa_sample_inverse](int y) {
-		parallel_for(buffer._height, [&buffer, &scene, aa_sample, aa_sample_inverse] (int beg_y, int end_y) {
+		parallel_for(buffer._height, [&buffer, &scene, aa_sample] (int beg_y, int end_y) {
 			for (int y = beg_y; y < end_y; ++y) {
 				for (int x = 0; x < buffer._width; ++x) {
-					int index = y * buffer._width + x;
-					AccumlationBuffer::Pixel &pixel = buffer._data[index];
-
-					Vec3 color;
-					for (int aai = 0; aai < aa_sample; ++aai) {
-						auto aa_offset = Vec2(
-							pixel.engine.continuous() - 0.5,
-							pixel.engine.continuous() - 0.5
-						);
-
-						/* ビュー空間 */
-						auto ray_view = scene.camera.generate_ray(x + aa_offset.x, y + aa_offset.y, buffer._width, buffer._height);
-
-						/* ワールド空間 */
-						auto ray = scene.viewTransform.to_local_ray(ray_view);
-
-						color += radiance(ray, scene, pixel.engine);
-					}
-					color *= aa_sample_inverse;
-
-					// TODO 対症療法すぎるだろうか
-					if (glm::all(glm::lessThan(color, Vec3(500.0)))) {
-						pixel.color += color;
-					}
+					sample_pixel(buffer, scene, x, y, aa_sample);
 				}
 			}
 		});
 
-		buffer._iteration += 1;
-		buffer._ray_count += aa_sample;
+		buffer.finish_pass(aa_sample);
+	}
+
+	/*
+	タイル単位のstep
+	行の代わりにschedulerのタイルを配り、タイル内は曲線の順に回す
+	タイルごとの所要時間はschedulerに残り、次回の配る順に使われる
+	*/
+	inline void step(AccumlationBuffer &buffer, const Scene &scene, int aa_sample, TileScheduler &scheduler) {
+		scheduler.run([&buffer, &scene, aa_sample, &scheduler](const Tile &tile) {
+			render_tile(buffer, scene, scheduler, tile, aa_sample);
+		});
+
+		buffer.finish_pass(aa_sample);
+	}
+
+	/*
+	締め切りつきのタイル単位step
+	deadlineを過ぎたら画素の区切りで止め、残りのタイルは次の呼び出しで続ける
+	サンプル数は画素ごとに数えるので、途中で止めても正規化した結果は偏らない
+	パスを最後まで終えたらtrue
+	*/
+	inline bool step(AccumlationBuffer &buffer, const Scene &scene, int aa_sample, TileScheduler &scheduler, RenderClock::time_point deadline) {
+		buffer.require_sample_count();
+
+		bool completed = scheduler.run_until([&buffer, &scene, aa_sample, &scheduler, deadline](const Tile &tile) {
+			return render_tile(buffer, scene, scheduler, tile, aa_sample, deadline);
+		}, deadline);
+
+		if (completed) {
+			buffer.finish_pass(aa_sample);
+		}
+		return completed;
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,198 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <future>
+
+#include "render.hpp"
+#include "tile_scheduler.hpp"
+#include "render_server.hpp"
+#include "stopwatch.hpp"
+
+/*
+アニメーション・複数カメラのまとめ描き
+ひとつのシーン(BVHを含む)に対して、キーフレームごとにカメラだけ差し替えて順に描く
+フレーム N の後処理と書き出し(finish)は別スレッドで行い、フレーム N+1 の描画と重ねる
+後処理はいつもひとつだけ走らせ、前のフレームの後処理が終わるのを待ってから次を渡す
+キーフレームのファイルは1行1フレーム:
+  eye=x,y,z target=x,y,z [up=x,y,z] [fovy=<度>] [seconds=<s>] [spp=<n>]
+  省いた項目は既定のキーフレームのまま。# から行末まではコメント
+*/
+namespace lc {
+	struct Keyframe {
+		Transform view_transform;
+		Camera::Settings camera;
+		double seconds = 10.0; /* 描画の時間の予算。0 なら制限なし */
+		int spp = 0;           /* 画素あたりのサンプル数の上限。0 なら制限なし */
+	};
+
+	// target を中心に up 軸まわりに一周するカメラ
+	inline std::vector<Keyframe> make_turntable(const Keyframe &base, Vec3 eye, Vec3 target, Vec3 up, int frame_count) {
+		std::vector<Keyframe> keyframes;
+		for (int i = 0; i < frame_count; ++i) {
+			double angle = glm::two_pi<double>() * i / frame_count;
+			Vec3 rotated = target + glm::rotate(eye - target, angle, up);
+			Keyframe keyframe = base;
+			keyframe.view_transform = Transform(glm::lookAt(rotated, target, up));
+			keyframes.push_back(keyframe);
+		}
+		return keyframes;
+	}
+
+	// 1行を読む。失敗したら error に理由を入れて false
+	inline bool parse_keyframe(const std::string &line, Keyframe &keyframe, std::string &error) {
+		std::istringstream stream(line);
+		std::string token;
+		bool has_view = false;
+		Vec3 eye;
+		Vec3 target;
+		Vec3 up(0.0, 1.0, 0.0);
+		while (stream >> token) {
+			auto eq = token.find('=');
+			if (eq == std::string::npos) {
+				error = "bad token " + token;
+				return false;
+			}
+			std::string key = token.substr(0, eq);
+			std::string value = token.substr(eq + 1);
+			bool ok = true;
+			if (key == "eye") {
+				ok = parse_vec3(value, eye);
+				has_view = true;
+			}
+			else if (key == "target") {
+				ok = parse_vec3(value, target);
+				has_view = true;
+			}
+			else if (key == "up") {
+				ok = parse_vec3(value, up);
+			}
+			else if (key == "fovy") {
+				keyframe.camera.fovy = glm::radians(std::atof(value.c_str()));
+			}
+			else if (key == "seconds") {
+				keyframe.seconds = std::atof(value.c_str());
+			}
+			else if (key == "spp") {
+				keyframe.spp = std::atoi(value.c_str());
+			}
+			else {
+				error = "unknown key " + key;
+				return false;
+			}
+			if (ok == false) {
+				error = "bad value " + token;
+				return false;
+			}
+		}
+		if (has_view) {
+			keyframe.view_transform = Transform(glm::lookAt(eye, target, up));
+		}
+		if (keyframe.seconds <= 0.0 && keyframe.spp <= 0) {
+			error = "no budget";
+			return false;
+		}
+		return true;
+	}
+
+	/*
+	キーフレームのファイルを読む。読めない行があれば error に行番号と理由を入れて false
+	*/
+	inline bool read_keyframes(const std::string &path, const Keyframe &base, std::vector<Keyframe> &keyframes, std::string &error) {
+		std::ifstream stream(path);
+		if (!stream) {
+			error = "can't open " + path;
+			return false;
+		}
+		keyframes.clear();
+		std::string line;
+		for (int line_number = 1; std::getline(stream, line); ++line_number) {
+			auto comment = line.find('#');
+			if (comment != std::string::npos) {
+				line.erase(comment);
+			}
+			if (line.find_first_not_of(" \t\r") == std::string::npos) {
+				continue;
+			}
+			Keyframe keyframe = base;
+			if (parse_keyframe(line, keyframe, error) == false) {
+				error = "line " + std::to_string(line_number) + ": " + error;
+				return false;
+			}
+			keyframes.push_back(keyframe);
+		}
+		return true;
+	}
+
+	struct BatchFrameStats {
+		int frame = 0;
+		int passes = 0;
+		int spp = 0;
+		double render_seconds = 0.0;
+		double wait_seconds = 0.0; /* 前のフレームの後処理を待った時間 */
+	};
+
+	/*
+	keyframes を順に描く
+	finish(frame, buffer) は描き終えたフレームごとに別スレッドで呼ばれ、次のフレームの描画と重なる
+	report(stats) は描画スレッドで、フレームを描き終えるたびに呼ばれる
+	戻るときには最後のフレームの finish も終わっている。シーンのカメラは元に戻す
+	*/
+	inline void render_batch(Scene &scene, const std::vector<Keyframe> &keyframes, int width, int height, int aa_sample,
+		std::function<void(int /*frame*/, const AccumlationBuffer &)> finish,
+		std::function<void(const BatchFrameStats &)> report = std::function<void(const BatchFrameStats &)>()) {
+		Camera default_camera = scene.camera;
+		Transform default_view = scene.viewTransform;
+
+		std::future<void> finish_task;
+		AccumlationBuffer finishing;
+		TileScheduler scheduler(width, height);
+		for (int frame = 0; frame < (int)keyframes.size(); ++frame) {
+			const Keyframe &keyframe = keyframes[frame];
+			Stopwatch timer;
+			scene.camera = Camera(keyframe.camera);
+			scene.viewTransform = keyframe.view_transform;
+
+			AccumlationBuffer buffer(width, height);
+			scheduler.reset_schedule();
+			auto deadline = 0.0 < keyframe.seconds ? after_seconds(timer._beg, keyframe.seconds) : RenderClock::time_point::max();
+
+			BatchFrameStats stats;
+			stats.frame = frame;
+			for (;;) {
+				bool completed = step(buffer, scene, aa_sample, scheduler, deadline);
+				stats.passes++;
+				if (completed == false || (0 < keyframe.spp && keyframe.spp <= buffer.samples_per_pixel())) {
+					break;
+				}
+			}
+			stats.spp = buffer.samples_per_pixel();
+			stats.render_seconds = timer.elapsed();
+
+			// 前のフレームの後処理が終わっていなければ待つ
+			Stopwatch wait_timer;
+			if (finish_task.valid()) {
+				finish_task.get();
+			}
+			stats.wait_seconds = wait_timer.elapsed();
+
+			finishing = std::move(buffer);
+			finish_task = std::async(std::launch::async, [&finish, &finishing, frame]() {
+				finish(frame, finishing);
+			});
+
+			if (report) {
+				report(stats);
+			}
+		}
+		if (finish_task.valid()) {
+			finish_task.get();
+		}
+
+		scene.camera = default_camera;
+		scene.viewTransform = default_view;
+	}
+}
@@ -0,0 +1,293 @@
+﻿#pragma once
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <cstdio>
+
+#include "render.hpp"
+#include "tile_scheduler.hpp"
+#include "stopwatch.hpp"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+/*
+常駐する描画サーバー
+シーン(BVHを含む)を一度だけ作って持ち続け、1行1件のジョブを受けて順に描く
+  ジョブ: render output=<path> [width=512] [height=512] [seconds=10] [spp=0] [aa=2]
+                 [eye=x,y,z] [target=x,y,z] [up=x,y,z] [fovy=<度>]
+    seconds か spp (画素あたりのサンプル数) の先に達した方で止める。0 なら制限なし
+    カメラを省いた項目はシーンの既定のまま
+  応答: ready (接続の開始時)
+        accepted <id>
+        progress <id> pass=<n> spp=<n> elapsed=<s>
+        done <id> output=<path> spp=<n> seconds=<s> startup=<s>
+        error <id> <理由>
+  ping には pong、quit には bye を返してサーバーを止める
+接続は標準入出力(パイプ)か、POSIXの Unix ドメインソケット
+ジョブは受けた順にひとつずつ描く (描画は中でスレッドプールを使う)
+*/
+namespace lc {
+	struct RenderJob {
+		std::string output;
+		int width = 512;
+		int height = 512;
+		double seconds = 10.0;
+		int spp = 0;
+		int aa_sample = 2;
+
+		bool has_view = false;
+		Vec3 eye;
+		Vec3 target;
+		Vec3 up = Vec3(0.0, 1.0, 0.0);
+		double fovy_degree = 0.0; /* 0 なら既定 */
+	};
+
+	inline bool parse_vec3(const std::string &text, Vec3 &v) {
+		return std::sscanf(text.c_str(), "%lf,%lf,%lf", &v.x, &v.y, &v.z) == 3;
+	}
+
+	// "render key=value ..." を読む。失敗したら error に理由を入れて false
+	inline bool parse_render_job(const std::string &line, RenderJob &job, std::string &error) {
+		std::istringstream stream(line);
+		std::string command;
+		stream >> command;
+		std::string token;
+		while (stream >> token) {
+			auto eq = token.find('=');
+			if (eq == std::string::npos) {
+				error = "bad token " + token;
+				return false;
+			}
+			std::string key = token.substr(0, eq);
+			std::string value = token.substr(eq + 1);
+			bool ok = true;
+			if (key == "output") {
+				job.output = value;
+			}
+			else if (key == "width") {
+				job.width = std::atoi(value.c_str());
+			}
+			else if (key == "height") {
+				job.height = std::atoi(value.c_str());
+			}
+			else if (key == "seconds") {
+				job.seconds = std::atof(value.c_str());
+			}
+			else if (key == "spp") {
+				job.spp = std::atoi(value.c_str());
+			}
+			else if (key == "aa") {
+				job.aa_sample = std::atoi(value.c_str());
+			}
+			else if (key == "eye") {
+				ok = parse_vec3(value, job.eye);
+				job.has_view = true;
+			}
+			else if (key == "target") {
+				ok = parse_vec3(value, job.target);
+				job.has_view = true;
+			}
+			else if (key == "up") {
+				ok = parse_vec3(value, job.up);
+			}
+			else if (key == "fovy") {
+				job.fovy_degree = std::atof(value.c_str());
+			}
+			else {
+				error = "unknown key " + key;
+				return false;
+			}
+			if (ok == false) {
+				error = "bad value " + token;
+				return false;
+			}
+		}
+		if (job.output.empty()) {
+			error = "no output";
+			return false;
+		}
+		if (job.width <= 0 || job.height <= 0 || job.aa_sample <= 0 || (job.seconds <= 0.0 && job.spp <= 0)) {
+			error = "bad size or budget";
+			return false;
+		}
+		return true;
+	}
+
+	class RenderServer {
+	public:
+		// 描き終えたバッファを書き出す。失敗したら false
+		typedef std::function<bool(const std::string & /*path*/, const AccumlationBuffer &)> Writer;
+		typedef std::function<void(const std::string & /*line*/)> Sender;
+
+		RenderServer(Scene &scene, Writer writer) :_scene(scene), _writer(writer), _default_camera(scene.camera), _default_view(scene.viewTransform) {
+		}
+
+		// 1行を処理して応答を send で返す。quit なら false
+		bool handle(const std::string &line, const Sender &send) {
+			std::istringstream stream(line);
+			std::string command;
+			stream >> command;
+			if (command.empty()) {
+				return true;
+			}
+			if (command == "ping") {
+				send("pong");
+				return true;
+			}
+			if (command == "quit") {
+				send("bye");
+				return false;
+			}
+			int id = _next_id++;
+			if (command != "render") {
+				send("error " + std::to_string(id) + " unknown command " + command);
+				return true;
+			}
+			RenderJob job;
+			std::string error;
+			if (parse_render_job(line, job, error) == false) {
+				send("error " + std::to_string(id) + " " + error);
+				return true;
+			}
+			send("accepted " + std::to_string(id));
+			render(id, job, send);
+			return true;
+		}
+
+		// パイプ: in から1行ずつ読み、out へ返す
+		void serve_stream(std::istream &in, std::ostream &out) {
+			Sender send = [&out](const std::string &line) {
+				out << line << std::endl;
+			};
+			send("ready");
+			std::string line;
+			while (std::getline(in, line)) {
+				if (handle(line, send) == false) {
+					break;
+				}
+			}
+		}
+
+		/*
+		Unix ドメインソケット: 接続をひとつずつ受ける。quit を受けるまで戻らない
+		ソケットを作れなければ false (Windowsではいつも false なので serve_stream を使う)
+		*/
+		bool serve_unix_socket(const std::string &path) {
+#ifdef _WIN32
+			return false;
+#else
+			int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (listener < 0) {
+				return false;
+			}
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			if (sizeof(address.sun_path) <= path.size()) {
+				::close(listener);
+				return false;
+			}
+			std::snprintf(address.sun_path, sizeof(address.sun_path), "%s", path.c_str());
+			::unlink(path.c_str());
+			if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, 4) != 0) {
+				::close(listener);
+				return false;
+			}
+
+			bool running = true;
+			while (running) {
+				int connection = ::accept(listener, nullptr, nullptr);
+				if (connection < 0) {
+					continue;
+				}
+				Sender send = [connection](const std::string &line) {
+					std::string data = line + "\n";
+					for (size_t sent = 0; sent < data.size(); ) {
+						ssize_t n = ::send(connection, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+						if (n <= 0) {
+							return;
+						}
+						sent += n;
+					}
+				};
+				send("ready");
+
+				std::string pending;
+				char chunk[4096];
+				while (running) {
+					ssize_t n = ::recv(connection, chunk, sizeof(chunk), 0);
+					if (n <= 0) {
+						break;
+					}
+					pending.append(chunk, n);
+					for (auto eol = pending.find('\n'); eol != std::string::npos; eol = pending.find('\n')) {
+						std::string line = pending.substr(0, eol);
+						pending.erase(0, eol + 1);
+						if (handle(line, send) == false) {
+							running = false;
+							break;
+						}
+					}
+				}
+				::close(connection);
+			}
+			::close(listener);
+			::unlink(path.c_str());
+			return true;
+#endif
+		}
+	private:
+		void render(int id, const RenderJob &job, const Sender &send) {
+			Stopwatch timer;
+
+			// カメラだけ差し替える。シーンとBVHはそのまま使う
+			Camera::Settings settings = _default_camera.settings();
+			if (0.0 < job.fovy_degree) {
+				settings.fovy = glm::radians(job.fovy_degree);
+			}
+			_scene.camera = Camera(settings);
+			_scene.viewTransform = job.has_view ? Transform(glm::lookAt(job.eye, job.target, job.up)) : _default_view;
+
+			AccumlationBuffer buffer(job.width, job.height);
+			TileScheduler scheduler(job.width, job.height);
+			auto deadline = 0.0 < job.seconds ? after_seconds(timer._beg, job.seconds) : RenderClock::time_point::max();
+			double startup = timer.elapsed();
+
+			for (int pass = 0; ; ++pass) {
+				bool completed = step(buffer, _scene, job.aa_sample, scheduler, deadline);
+				int spp = buffer.samples_per_pixel();
+				send("progress " + std::to_string(id)
+					+ " pass=" + std::to_string(pass)
+					+ " spp=" + std::to_string(spp)
+					+ " elapsed=" + std::to_string(timer.elapsed()));
+				if (completed == false || (0 < job.spp && job.spp <= spp)) {
+					break;
+				}
+			}
+
+			if (_writer(job.output, buffer) == false) {
+				send("error " + std::to_string(id) + " write failed " + job.output);
+				return;
+			}
+			send("done " + std::to_string(id)
+				+ " output=" + job.output
+				+ " spp=" + std::to_string(buffer.samples_per_pixel())
+				+ " seconds=" + std::to_string(timer.elapsed())
+				+ " startup=" + std::to_string(startup));
+		}
+
+		Scene &_scene;
+		Writer _writer;
+		Camera _default_camera;
+		Transform _default_view;
+		int _next_id = 1;
+	};
+}
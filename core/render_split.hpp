@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include "accumlation_buffer.hpp"
+#include "tile_scheduler.hpp"
+#include "checkpoint.hpp"
+#include "stopwatch.hpp"
+
+/*
+1フレームを複数のプロセス(マシン)で分けて描く
+  Samples : 全画素を描き、ワーカーごとにサンプル番号の範囲をずらす (kSplitSampleBlock ずつ)
+  Tiles   : タイルをワーカーごとに分ける (TileScheduler::keep_tiles)
+各ワーカーは描き終えた積算バッファを共有ディレクトリへ part_###.bin (チェックポイントの形式) で書き、
+まとめ役がそれを足して合計のサンプル数で正規化する
+実行ごとの名前 (run) を与えると part_<run>_###.bin になり、前の実行の部分を拾わない
+乱数は (画素, サンプル番号, 次元) で決まるので、どのワーカーがどこを描いても結果は決まっている
+部分のファイルは rename で置かれるので、見えた時点で書き終わっている
+*/
+namespace lc {
+	enum class SplitMode {
+		Samples,
+		Tiles
+	};
+
+	// 1ワーカーが使うサンプル番号の幅。画素あたりこれを超えて描くと次のワーカーの範囲と重なる
+	static const uint32_t kSplitSampleBlock = 1u << 20;
+
+	struct RenderSplit {
+		SplitMode mode = SplitMode::Samples;
+		int worker_index = 0;
+		int worker_count = 1;
+
+		// 描き始める前に呼ぶ
+		void apply(AccumlationBuffer &buffer, TileScheduler &scheduler) const {
+			if (mode == SplitMode::Samples) {
+				buffer.set_sample_offset(worker_index * kSplitSampleBlock);
+			}
+			else {
+				scheduler.keep_tiles(worker_index, worker_count);
+			}
+		}
+	};
+
+	inline std::string split_part_path(const std::string &directory, int worker_index, const std::string &run = std::string()) {
+		char name[64];
+		std::snprintf(name, sizeof(name), "part_%03d.bin", worker_index);
+		return (fs::path(directory) / (run.empty() ? std::string(name) : "part_" + run + "_" + (name + 5))).string();
+	}
+
+	/*
+	ワーカーの部分をまとめる
+	worker_count 個の部分がそろうか timeout_seconds が過ぎるまで待ち、読めた部分を merged に足す
+	足した部分の数を返す。大きさの違う部分があれば (別の設定の実行が混ざっている) error に理由を入れて -1
+	*/
+	inline int merge_split_parts(AccumlationBuffer &merged, const std::string &directory, int worker_count, double timeout_seconds, std::string &error, const std::string &run = std::string()) {
+		auto deadline = after_seconds(RenderClock::now(), timeout_seconds);
+		std::vector<char> done(worker_count, 0);
+		int done_count = 0;
+		int merged_count = 0;
+		merged = AccumlationBuffer();
+		for (;;) {
+			for (int i = 0; i < worker_count; ++i) {
+				if (done[i]) {
+					continue;
+				}
+				AccumlationBuffer part;
+				std::string path = split_part_path(directory, i, run);
+				if (read_checkpoint(part, path) == false) {
+					continue;
+				}
+				done[i] = 1;
+				done_count++;
+				if (merged._width == 0) {
+					merged = std::move(part);
+				}
+				else if (part._width == merged._width && part._height == merged._height) {
+					merged.merge(part);
+				}
+				else {
+					error = "size mismatch " + path + " (" + std::to_string(part._width) + "x" + std::to_string(part._height)
+						+ ", expected " + std::to_string(merged._width) + "x" + std::to_string(merged._height) + ")";
+					merged = AccumlationBuffer();
+					return -1;
+				}
+				merged_count++;
+			}
+			if (done_count == worker_count || deadline <= RenderClock::now()) {
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		return merged_count;
+	}
+}
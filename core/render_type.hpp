@@ -65,6 +65,25 @@ namespace lc {
 		int height = 0;
 		std::vector<Vec3> pixels;
 	};
+
+	/*
+	最初の衝突から取った画素ごとの特徴 (AOV)
+	albedo, normal, depth はサンプルの平均。ID は最初のサンプルのもので、何にも当たらなければ -1
+	*/
+	struct FeatureImages {
+		int width = 0;
+		int height = 0;
+		Image albedo;
+		Image normal; /* ワールド空間のシェーディング法線 */
+		std::vector<double> depth; /* カメラからの距離 */
+		std::vector<int> object_id; /* Scene::objects の番号 */
+		std::vector<int> material_id;
+	};
+
+	// 輝度 (Rec. 709)
+	inline double luminance(const Vec3 &c) {
+		return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+	}
 	
 }
 
@@ -82,6 +101,10 @@ namespace lc {
 #ifdef LC_USE_STD_FILESYSTEM
 #include <filesystem>
 namespace lc {
+#ifdef _MSC_VER
 	namespace fs = std::tr2::sys;
+#else
+	namespace fs = std::filesystem;
+#endif
 }
 #endif
@@ -0,0 +1,240 @@
+﻿#pragma once
+
+#include <inttypes.h>
+#include <vector>
+
+#include "counter_random.hpp"
+
+/*
+次元を意識したサンプラー
+パスの乱数を (画素, サンプル番号, 次元) で決まる値として引く
+  start_path      : 画素の次のサンプルを始める (次元 0, 1 はAAのジッター)
+  start_bounce    : バウンスごとの次元の区切りへ進む
+  start_dimension : バウンス内の用途 (SampleDimension) の次元へ進む
+同じ次元を同じ用途に使い続けるので、低食い違い列の層別がサンプル番号の方向に効く
+RandomEngine<PathSampler> として continuous() や on_circle() から使う
+状態はサンプル番号と次元だけなので、AccumlationBuffer::sampler で画素ごとにその場で作る
+*/
+namespace lc {
+	enum class SamplerType {
+		Independent, /* カウンタベースの乱数による白色雑音 (counter_random.hpp) */
+		Sobol,       /* 2次元ずつ組にしたOwenスクランブルつきSobol列 */
+		Halton,      /* 次元ごとに画素単位で回転したHalton列 */
+		BlueNoise    /* R2列 + 画素ごとの回転 (最初のバウンスまではR2ディザでブルーノイズ風) */
+	};
+
+	// バウンス内の次元の割り当て
+	enum SampleDimension {
+		kDimensionLightSelect = 0,    /* ライトの選択 */
+		kDimensionLightLobe = 1,      /* NEEでのローブの選択 */
+		kDimensionLightPoint = 2,     /* ライト上の点 (2次元) */
+		kDimensionLightTriangle = 4,  /* ポリゴンライトの三角形の選択 */
+		kDimensionBSDFLobe = 5,       /* BSDFのローブ、屈折/反射の選択 */
+		kDimensionBSDFDirection = 6,  /* 次の方向 (2次元) */
+		kDimensionBSDFDiffuse = 8,    /* 拡散側のローブを選んだときの方向 (2次元) */
+		kDimensionsPerBounce = 10
+	};
+	static const int kCameraDimensions = 2;
+
+	// 32bit整数のハッシュ (lowbias32)
+	inline uint32_t mix_bits(uint32_t x) {
+		x ^= x >> 16;
+		x *= 0x7feb352d;
+		x ^= x >> 15;
+		x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	}
+	inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+		return mix_bits(seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+	}
+
+	inline uint32_t reverse_bits(uint32_t v) {
+		v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+		v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+		v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+		v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+		return (v >> 16) | (v << 16);
+	}
+
+	/*
+	Owenスクランブル (Burley 2020, "Practical Hash-based Owen Scrambling")
+	laine_karras_permutation は下位ビットが上位ビットに影響しない置換なので、ビットを反転して挟むと上位から順に入れ替える入れ子の置換になる
+	*/
+	inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+		x += seed;
+		x ^= x * 0x6c50b47c;
+		x ^= x * 0xb82f1e52;
+		x ^= x * 0xc7afe638;
+		x ^= x * 0x8d22f6e6;
+		return x;
+	}
+	inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+		return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+	}
+
+	// Sobol列の1, 2次元目 (1次元目はvan der Corput列)
+	inline uint32_t sobol_0(uint32_t index) {
+		return reverse_bits(index);
+	}
+	inline uint32_t sobol_1(uint32_t index) {
+		uint32_t result = 0;
+		for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+			if (index & 1) {
+				result ^= v;
+			}
+		}
+		return result;
+	}
+
+	/*
+	2次元ずつ組にしたSobol列
+	組ごとにサンプル番号をシャッフルしてから引き、値にOwenスクランブルをかける
+	組どうしは無相関になり、組の中は (0, 2) 列の層別が残る
+	*/
+	inline uint32_t sobol_owen(uint32_t seed, uint32_t sample, uint32_t dimension) {
+		uint32_t pair_seed = hash_combine(seed, dimension >> 1);
+		uint32_t index = nested_uniform_scramble(sample, pair_seed);
+		uint32_t value = (dimension & 1) ? sobol_1(index) : sobol_0(index);
+		return nested_uniform_scramble(value, hash_combine(pair_seed, (dimension & 1) + 1));
+	}
+
+	// 先頭から count 個の素数
+	inline std::vector<uint32_t> make_primes(int count) {
+		std::vector<uint32_t> primes;
+		for (uint32_t n = 2; static_cast<int>(primes.size()) < count; ++n) {
+			bool is_prime = true;
+			for (uint32_t p : primes) {
+				if (n < p * p) {
+					break;
+				}
+				if (n % p == 0) {
+					is_prime = false;
+					break;
+				}
+			}
+			if (is_prime) {
+				primes.push_back(n);
+			}
+		}
+		return primes;
+	}
+	static const int kHaltonDimensions = kCameraDimensions + kDimensionsPerBounce * 24;
+	inline const std::vector<uint32_t> &halton_primes() {
+		static const std::vector<uint32_t> primes = make_primes(kHaltonDimensions);
+		return primes;
+	}
+
+	// 基数 base での radical inverse を 32bit の固定小数で
+	inline uint32_t radical_inverse(uint32_t base, uint32_t index) {
+		double inv_base = 1.0 / base;
+		double f = inv_base;
+		double r = 0.0;
+		while (index) {
+			r += (index % base) * f;
+			index /= base;
+			f *= inv_base;
+		}
+		return static_cast<uint32_t>(r * 4294967296.0);
+	}
+
+	/*
+	R2列 (Roberts 2018) の刻み幅。plastic数 g について 1/g, 1/g^2 を 32bit の固定小数で
+	画素座標に使うとブルーノイズに近いディザになり、サンプル番号に使うと2次元のランク1格子に近い点列になる
+	*/
+	static const uint32_t kR2Alpha0 = 3242174889u; /* 0.7548776662466927 */
+	static const uint32_t kR2Alpha1 = 2447445413u; /* 0.5698402909980532 */
+	static const int kBlueNoiseTileSize = 64;
+
+	// ブルーノイズのマスクで回す次元 (AAのジッターと最初のバウンス)。画面に直接見えるのはここまで
+	static const uint32_t kBlueNoiseDimensions = kCameraDimensions + kDimensionsPerBounce;
+
+	/*
+	R2列を画素ごとに回したもの
+	  kBlueNoiseDimensions より前: 回転はR2のディザのマスク。マスクは mask_seed と次元で(全画素で同じだけ)巡回にずらす
+	  それより先: 回転は画素の種 seed による乱数 (Cranley-Patterson 回転)
+	R2の刻みは組のどの次元でも同じなので、サンプル番号は次元の組ごとにシャッフルしてから使う (しないと組どうしが平行移動の関係になる)
+	*/
+	inline uint32_t blue_noise_r2(uint32_t seed, uint32_t mask_seed, int x, int y, uint32_t sample, uint32_t dimension) {
+		uint32_t alpha = (dimension & 1) ? kR2Alpha1 : kR2Alpha0;
+		if (dimension < kBlueNoiseDimensions) {
+			uint32_t offset = hash_combine(mask_seed, dimension);
+			uint32_t mx = (x + offset) % kBlueNoiseTileSize;
+			uint32_t my = (y + (offset >> 16)) % kBlueNoiseTileSize;
+			uint32_t mask = mx * kR2Alpha0 + my * kR2Alpha1;
+			return mask + nested_uniform_scramble(sample, hash_combine(mask_seed, dimension >> 1)) * alpha;
+		}
+		uint32_t index = nested_uniform_scramble(sample, hash_combine(seed, dimension >> 1));
+		return hash_combine(seed, dimension + 1) + index * alpha;
+	}
+
+	struct PathSampler {
+		PathSampler() {
+		}
+		PathSampler(uint32_t seed) :_seed(seed) {
+		}
+
+		// 次の start_path で始めるサンプル番号
+		void set_next_sample(uint32_t sample) {
+			_next_sample = sample;
+		}
+
+		// ブルーノイズのマスクを引く画素の座標
+		void set_pixel(int x, int y) {
+			_x = x;
+			_y = y;
+		}
+		// ブルーノイズのマスクをずらす種 (全画素で同じ値にする)
+		void set_mask_seed(uint32_t mask_seed) {
+			_mask_seed = mask_seed;
+		}
+		void set_type(SamplerType type) {
+			_type = type;
+		}
+		SamplerType type() const {
+			return _type;
+		}
+
+		void start_path() {
+			_sample = _next_sample++;
+			_bounce_dimension = 0;
+			_dimension = 0;
+		}
+		void start_bounce(int bounce) {
+			_bounce_dimension = kCameraDimensions + bounce * kDimensionsPerBounce;
+			_dimension = _bounce_dimension;
+		}
+		void start_dimension(int dimension /* SampleDimension */) {
+			_dimension = _bounce_dimension + dimension;
+		}
+
+		// 今の次元の値を返し、次の次元へ進む
+		uint32_t generate() {
+			uint32_t dimension = _dimension++;
+			switch (_type) {
+			case SamplerType::Sobol:
+				return sobol_owen(_seed, _sample, dimension);
+			case SamplerType::Halton:
+				if (dimension < kHaltonDimensions) {
+					return radical_inverse(halton_primes()[dimension], _sample) + hash_combine(_seed, dimension);
+				}
+				break;
+			case SamplerType::BlueNoise:
+				return blue_noise_r2(_seed, _mask_seed, _x, _y, _sample, dimension);
+			default:
+				break;
+			}
+			return counter_random(_seed, _sample, dimension);
+		}
+
+		SamplerType _type = SamplerType::Sobol;
+		uint32_t _seed = 0;
+		uint32_t _mask_seed = 0;
+		int _x = 0;
+		int _y = 0;
+		uint32_t _sample = 0;
+		uint32_t _next_sample = 0;
+		uint32_t _bounce_dimension = 0;
+		uint32_t _dimension = 0;
+	};
+}
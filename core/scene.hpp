@@ -30,6 +30,9 @@ namespace lc {
 		virtual ~ISceneIntersectable() {}
 		virtual void intersect(const Ray &ray, LazyMicroSurface &surface, double &tmin) const = 0;
 		virtual bool is_visible(const Ray &ray, double tmin_target) const = 0;
+
+		// 内部で持つマテリアルをテーブルに登録する (Scene::finalizeから呼ばれる)
+		virtual void bind_materials(MaterialTable & /*materials*/) {}
 	};
 	class ILight : public ISceneIntersectable {
 	public:
@@ -73,9 +76,10 @@ namespace lc {
 		void intersect(const Ray &ray, LazyMicroSurface &surface, double &tmin) const override {
 			if (auto intersection = lc::intersect(ray, disc)) {
 				if (intersection->tmin < tmin) {
-					auto emissive_value = this->emissive;
+					auto emissive_id = _emissive_id;
+					auto black_id = _black_id;
 					auto doubleSided_value = doubleSided;
-					surface = [ray, intersection, emissive_value, doubleSided_value]() {
+					surface = [ray, intersection, emissive_id, black_id, doubleSided_value]() {
 						MicroSurface m;
 						m.p = intersection->intersect_position(ray);
 						m.n = intersection->intersect_normal;
@@ -85,9 +89,9 @@ namespace lc {
 							if (intersection->isback) {
 								m.n = -m.n;
 							}
-							m.m = emissive_value;
+							m.material = emissive_id;
 						} else {
-							m.m = intersection->isback ? EmissiveMaterial(Vec3(0.0)) : emissive_value;
+							m.material = intersection->isback ? black_id : emissive_id;
 						}
 
 						m.vn = m.n;
@@ -107,10 +111,17 @@ namespace lc {
 			}
 			return true;
 		}
+		void bind_materials(MaterialTable &materials) override {
+			_emissive_id = materials.add(emissive);
+			_black_id = materials.add(EmissiveMaterial(Vec3(0.0)));
+		}
 
 		Disc disc;
 		EmissiveMaterial emissive;
 		bool doubleSided = false;
+
+		MaterialID _emissive_id = 0;
+		MaterialID _black_id = 0;
 	};
 
 	struct PolygonLight : public ILight {
@@ -139,15 +150,15 @@ namespace lc {
 			if (auto intersection = bvh.intersect(ray, tmin)) {
 				if (intersection->tmin < tmin) {
 					auto triangle = uniform_triangle._triangles[intersection->triangle_index];
-					EmissiveMaterial emissive_front_value = emissive_front;
-					EmissiveMaterial emissive_back_value = emissive_back;
+					auto emissive_front_id = _emissive_front_id;
+					auto emissive_back_id = _emissive_back_id;
 
-					surface = [ray, intersection, triangle, emissive_front_value, emissive_back_value]() {
+					surface = [ray, intersection, triangle, emissive_front_id, emissive_back_id]() {
 						MicroSurface m;
 						m.p = intersection->intersect_position(ray);
 						m.n = intersection->intersect_normal(triangle);
 						m.vn = m.n;
-						m.m = intersection->isback ? emissive_back_value : emissive_front_value;
+						m.material = intersection->isback ? emissive_back_id : emissive_front_id;
 						m.isback = intersection->isback;
 						return m;
 					};
@@ -159,18 +170,25 @@ namespace lc {
 		bool is_visible(const Ray &ray, double tmin_target) const override {
 			return bvh.is_visible(ray, tmin_target);
 		}
+		void bind_materials(MaterialTable &materials) override {
+			_emissive_front_id = materials.add(emissive_front);
+			_emissive_back_id = materials.add(emissive_back);
+		}
 
 		EmissiveMaterial emissive_front;
 		EmissiveMaterial emissive_back;
 
 		UniformOnTriangle uniform_triangle;
 		BVH bvh;
+
+		MaterialID _emissive_front_id = 0;
+		MaterialID _emissive_back_id = 0;
 	};
 
 	struct SphereObject : public ISceneIntersectable {
-		SphereObject(const Sphere &s, const Material &m) :sphere(s), material(m) {}
+		SphereObject(const Sphere &s, MaterialID m) :sphere(s), material(m) {}
 		Sphere sphere;
-		Material material;
+		MaterialID material = 0;
 
 		void intersect(const Ray &ray, LazyMicroSurface &surface, double &tmin) const override {
 			if (auto intersection = lc::intersect(ray, sphere)) {
@@ -182,7 +200,7 @@ namespace lc {
 						m.p = intersection->intersect_position(ray);
 						m.n = intersection->intersect_normal(s.center, m.p);
 						m.vn = m.n;
-						m.m = mat;
+						m.material = mat;
 						m.isback = intersection->isback;
 						return m;
 					};
@@ -202,20 +220,24 @@ namespace lc {
 
 	struct MeshObject : public ISceneIntersectable {
 		BVH bvh;
-		Material material;
+		MaterialID material = 0;
+
+		// 三角形ごとのマテリアル (bvh._trianglesと同じ並び)
+		// 空ならすべての三角形がmaterialを使う
+		std::vector<MaterialID> triangle_materials;
 
 		void intersect(const Ray &ray, LazyMicroSurface &surface, double &tmin) const override {
 			if (auto intersection = bvh.intersect(ray, tmin)) {
 				if (intersection->tmin < tmin) {
 					auto triangle = bvh._triangles[intersection->triangle_index];
-					Material material_value = material;
+					MaterialID material_value = triangle_materials.empty() ? material : triangle_materials[intersection->triangle_index];
 
 					surface = [ray, intersection, triangle, material_value]() {
 						MicroSurface m;
 						m.p = intersection->intersect_position(ray);
 						m.n = intersection->intersect_normal(triangle);
 						m.vn = m.n;
-						m.m = material_value;
+						m.material = material_value;
 						m.isback = intersection->isback;
 						return m;
 					};
@@ -271,6 +293,7 @@ namespace lc {
 			}
 			Triangle triangle;
 			Vec3 color;
+			MaterialID material = 0;
 		};
 		std::vector<ColorTriangle> triangles;
 
@@ -284,7 +307,7 @@ namespace lc {
 							m.p = intersection->intersect_position(ray);
 							m.n = intersection->intersect_normal(triangle.triangle);
 							m.vn = m.n;
-							m.m = LambertMaterial(triangle.color);
+							m.material = triangle.material;
 							m.isback = intersection->isback;
 
 							return m;
@@ -302,6 +325,11 @@ namespace lc {
 			}
 			return true;
 		}
+		void bind_materials(MaterialTable &materials) override {
+			for (size_t i = 0; i < triangles.size(); ++i) {
+				triangles[i].material = materials.add(LambertMaterial(triangles[i].color));
+			}
+		}
 	};
 
 	typedef boost::variant<SphereObject, ConelBoxObject, MeshObject, DiscLight, PolygonLight> SceneObject;
@@ -313,18 +341,34 @@ namespace lc {
 		void add(SceneObject object) {
 			objects.push_back(object);
 		}
+		MaterialID add_material(const Material &m) {
+			return materials.add(m);
+		}
 
+		/*
+		オブジェクト内部のマテリアルをテーブルに追加し、光源の一覧を作り直す
+		何度呼んでもよい。マテリアルを追加するのはまだ追加していないオブジェクト (前回より後に add したもの) だけ
+		*/
 		void finalize() {
 			lights.clear();
 			for (size_t i = 0; i < objects.size(); ++i) {
+				if (auto *intersectable = boost::polymorphic_strict_get<ISceneIntersectable>(&objects[i])) {
+					if (_bound_objects <= i) {
+						intersectable->bind_materials(materials);
+					}
+				}
 				if (auto *light = boost::polymorphic_strict_get<ILight>(&objects[i])) {
 					lights.push_back(light);
 				}
 			}
+			_bound_objects = objects.size();
 		}
 
 		std::vector<SceneObject> objects;
 		std::vector<ILight *> lights;
+		MaterialTable materials;
+	private:
+		size_t _bound_objects = 0; /* bind_materials 済みのオブジェクトの数 */
 	};
 
 	/*
@@ -337,6 +381,7 @@ namespace lc {
 		OnLight onLight;
 	};
 	inline Sample<DirectSampling> direct_light_sample(const Scene &scene, const Vec3 &p, DefaultEngine &engine) {
+		engine.start_dimension(kDimensionLightSelect);
 		const ILight *light = scene.lights.size() == 1 ?
 			scene.lights[0]
 			:
@@ -345,6 +390,7 @@ namespace lc {
 		double selection_pdf = 1.0 / scene.lights.size();
 
 		// 表面積の確率密度を立体角の確率密度に変換する
+		engine.start_dimension(kDimensionLightPoint);
 		Sample<OnLight> s = light->sample(engine, p);
 		double distance_squared = glm::distance2(p, s.value.p);
 		double dist = glm::sqrt(distance_squared);
@@ -369,15 +415,22 @@ namespace lc {
 	inline boost::optional<MicroSurface> intersect(const Ray &ray, const Scene &scene) {
 		double tmin = std::numeric_limits<double>::max();
 		LazyValue<MicroSurface, 256> min_intersection;
+		int object = -1;
 
 		for (int i = 0; i < scene.objects.size(); ++i) {
 			if (auto *intersectable = boost::polymorphic_strict_get<ISceneIntersectable>(&scene.objects[i])) {
+				double tmin_before = tmin;
 				intersectable->intersect(ray, min_intersection, tmin);
+				if (tmin < tmin_before) {
+					object = i;
+				}
 			}
 		}
 
 		if (tmin != std::numeric_limits<double>::max()) {
-			return min_intersection.evaluate();
+			MicroSurface surface = min_intersection.evaluate();
+			surface.object = object;
+			return surface;
 		}
 		return boost::none;
 	}
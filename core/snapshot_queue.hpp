@@ -0,0 +1,185 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "accumlation_buffer.hpp"
+#include "stopwatch.hpp"
+
+/*
+途中経過の画像 (スナップショット) の書き出し
+描画側は submit で積算バッファの色とサンプル数をスロットへ写すだけで戻り、後処理と書き込みは書き出しスレッドで行う
+スロットは決まった数 (既定は2つのダブルバッファ) で、2回目からは確保済みの領域へのコピーになる
+  空きがなければ、まだ書き始めていない古いスナップショットを新しいもので置き換える (coalesced)
+  すべて書き込み中なら捨てる (dropped)
+どちらの場合も描画は待たない
+*/
+namespace lc {
+	// 色とサンプル数だけ写す。dst の領域は使い回す
+	inline void copy_color_planes(AccumlationBuffer &dst, const AccumlationBuffer &src) {
+		dst._width = src._width;
+		dst._height = src._height;
+		for (int i = 0; i < 3; ++i) {
+			dst._color[i].assign(src._color[i].begin(), src._color[i].end());
+		}
+		dst._sample_count.assign(src._sample_count.begin(), src._sample_count.end());
+		dst._uniform_sample_count = src._uniform_sample_count;
+		dst._iteration = src._iteration;
+		dst._ray_count = src._ray_count;
+	}
+
+	struct SnapshotStats {
+		int submitted = 0;
+		int written = 0;
+		int coalesced = 0; /* 書き出す前に新しいスナップショットで置き換えられた */
+		int dropped = 0;   /* スロットが空かず捨てた */
+		int failed = 0;    /* 書き出しに失敗した */
+		double max_write_seconds = 0.0;
+	};
+
+	class SnapshotQueue {
+	public:
+		// スナップショットを path へ書く。書き出しスレッドから呼ばれる。失敗したら false
+		typedef std::function<bool(const AccumlationBuffer & /*snapshot*/, const std::string & /*path*/)> Writer;
+
+		SnapshotQueue(Writer writer, int slot_count = 2, int thread_count = 1) :_writer(writer), _slots(std::max(slot_count, 1)) {
+			for (int i = 0; i < std::max(thread_count, 1); ++i) {
+				_threads.emplace_back([this]() { work(); });
+			}
+		}
+		~SnapshotQueue() {
+			flush();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_condition.notify_all();
+			for (auto &thread : _threads) {
+				thread.join();
+			}
+		}
+		SnapshotQueue(const SnapshotQueue &) = delete;
+		void operator=(const SnapshotQueue &) = delete;
+
+		// 写して書き出しに回したら true。捨てたら false
+		bool submit(const AccumlationBuffer &buffer, const std::string &path) {
+			Slot *slot = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stats.submitted++;
+				for (Slot &s : _slots) {
+					if (s.state == kFree) {
+						slot = &s;
+						break;
+					}
+				}
+				if (slot == nullptr) {
+					// 書き始めていないもののうち、いちばん古いものを置き換える
+					for (Slot &s : _slots) {
+						if (s.state == kPending && (slot == nullptr || s.sequence < slot->sequence)) {
+							slot = &s;
+						}
+					}
+					if (slot == nullptr) {
+						_stats.dropped++;
+						return false;
+					}
+					_stats.coalesced++;
+				}
+				slot->state = kFilling;
+			}
+
+			copy_color_planes(slot->buffer, buffer);
+			slot->path = path;
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				slot->state = kPending;
+				slot->sequence = _next_sequence++;
+			}
+			_condition.notify_one();
+			return true;
+		}
+
+		// 回したスナップショットをすべて書き終えるまで待つ
+		void flush() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_idle_condition.wait(lock, [this]() {
+				for (const Slot &s : _slots) {
+					if (s.state != kFree) {
+						return false;
+					}
+				}
+				return true;
+			});
+		}
+
+		SnapshotStats stats() const {
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _stats;
+		}
+	private:
+		enum State {
+			kFree,
+			kFilling,
+			kPending,
+			kWriting
+		};
+		struct Slot {
+			AccumlationBuffer buffer;
+			std::string path;
+			State state = kFree;
+			uint64_t sequence = 0;
+		};
+
+		void work() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			for (;;) {
+				Slot *slot = nullptr;
+				_condition.wait(lock, [this, &slot]() {
+					slot = nullptr;
+					for (Slot &s : _slots) {
+						if (s.state == kPending && (slot == nullptr || s.sequence < slot->sequence)) {
+							slot = &s;
+						}
+					}
+					return _stop || slot != nullptr;
+				});
+				if (slot == nullptr) {
+					return;
+				}
+				slot->state = kWriting;
+				lock.unlock();
+
+				Stopwatch timer;
+				bool ok = _writer(slot->buffer, slot->path);
+				double seconds = timer.elapsed();
+
+				lock.lock();
+				slot->state = kFree;
+				if (ok) {
+					_stats.written++;
+				}
+				else {
+					_stats.failed++;
+				}
+				_stats.max_write_seconds = std::max(_stats.max_write_seconds, seconds);
+				_idle_condition.notify_all();
+			}
+		}
+
+		Writer _writer;
+		std::vector<Slot> _slots;
+		std::vector<std::thread> _threads;
+		mutable std::mutex _mutex;
+		std::condition_variable _condition;
+		std::condition_variable _idle_condition;
+		SnapshotStats _stats;
+		uint64_t _next_sequence = 0;
+		bool _stop = false;
+	};
+}
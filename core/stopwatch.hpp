@@ -0,0 +1,32 @@
+﻿#pragma once
+
+#include <chrono>
+
+namespace lc {
+	// 描画の締め切りなどに使う実時間の時計
+	typedef std::chrono::steady_clock RenderClock;
+
+	inline double to_seconds(RenderClock::duration d) {
+		return std::chrono::duration<double>(d).count();
+	}
+	inline RenderClock::time_point after_seconds(RenderClock::time_point t, double seconds) {
+		return t + std::chrono::duration_cast<RenderClock::duration>(std::chrono::duration<double>(seconds));
+	}
+
+	/*
+	経過時間[s]
+	boost::timer と同じ使い方だが、POSIXでもCPU時間ではなく実時間を測る
+	*/
+	struct Stopwatch {
+		Stopwatch() :_beg(RenderClock::now()) {}
+
+		void restart() {
+			_beg = RenderClock::now();
+		}
+		double elapsed() const {
+			return to_seconds(RenderClock::now() - _beg);
+		}
+
+		RenderClock::time_point _beg;
+	};
+}
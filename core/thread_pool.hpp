@@ -0,0 +1,272 @@
+﻿#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+namespace lc {
+	/*
+	ワークスティーリング方式のスレッドプール
+	キューはスレッドごとに持ち、0番は外部スレッド(メインスレッドなど)の共有キュー
+	  自分のキュー : 後ろに積んで後ろから取る (分割したばかりの小さい仕事から片付ける)
+	  他人のキュー : 前から盗む (大きい仕事をまとめて持っていく)
+	TaskGroup::wait は待っている間も他のタスクを実行するので、タスクの中からさらにタスクを投げてよい
+	*/
+	class ThreadPool {
+	public:
+		typedef std::function<void()> Task;
+
+		explicit ThreadPool(int thread_count = default_thread_count()) {
+			start(thread_count);
+		}
+		~ThreadPool() {
+			stop();
+		}
+		ThreadPool(const ThreadPool &) = delete;
+		void operator=(const ThreadPool &) = delete;
+
+		// 環境変数 LC_THREAD_COUNT があればそれ、なければ論理コア数
+		static int default_thread_count() {
+			if (const char *env = std::getenv("LC_THREAD_COUNT")) {
+				int n = std::atoi(env);
+				if (0 < n) {
+					return n;
+				}
+			}
+			int n = static_cast<int>(std::thread::hardware_concurrency());
+			return 0 < n ? n : 1;
+		}
+
+		// 呼び出し側のスレッドも計算に参加するので、ワーカーは thread_count - 1 本
+		int thread_count() const {
+			return static_cast<int>(_queues.size());
+		}
+
+		// 実行中のタスクがないときに呼ぶこと
+		void set_thread_count(int thread_count) {
+			stop();
+			start(thread_count);
+		}
+
+		void push(Task task) {
+			Queue &queue = *_queues[current_index()];
+			{
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				queue.tasks.push_back(std::move(task));
+			}
+			_pending++;
+			{
+				// ワーカーが述語を確認してから眠るまでの間に通知が抜けないように
+				std::lock_guard<std::mutex> lock(_sleep_mutex);
+			}
+			_sleep.notify_one();
+		}
+
+		// タスクをひとつ実行できたらtrue
+		bool run_one() {
+			Task task;
+			if (pop(task) == false) {
+				return false;
+			}
+			task();
+			return true;
+		}
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		static int &worker_index() {
+			thread_local int index = 0;
+			return index;
+		}
+		static ThreadPool *&worker_pool() {
+			thread_local ThreadPool *pool = nullptr;
+			return pool;
+		}
+		int current_index() const {
+			return worker_pool() == this ? worker_index() : 0;
+		}
+
+		bool pop(Task &task) {
+			int self = current_index();
+			int n = static_cast<int>(_queues.size());
+			for (int i = 0; i < n; ++i) {
+				int index = (self + i) % n;
+				Queue &queue = *_queues[index];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (queue.tasks.empty()) {
+					continue;
+				}
+				if (i == 0) {
+					task = std::move(queue.tasks.back());
+					queue.tasks.pop_back();
+				}
+				else {
+					task = std::move(queue.tasks.front());
+					queue.tasks.pop_front();
+				}
+				_pending--;
+				return true;
+			}
+			return false;
+		}
+
+		void worker(int index) {
+			worker_index() = index;
+			worker_pool() = this;
+			for (;;) {
+				if (run_one()) {
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(_sleep_mutex);
+				_sleep.wait(lock, [this]() { return _quit || 0 < _pending.load(); });
+				if (_quit && _pending.load() == 0) {
+					return;
+				}
+			}
+		}
+
+		void start(int thread_count) {
+			thread_count = std::max(thread_count, 1);
+			_quit = false;
+			_queues.clear();
+			for (int i = 0; i < thread_count; ++i) {
+				_queues.emplace_back(new Queue());
+			}
+			for (int i = 1; i < thread_count; ++i) {
+				_threads.emplace_back([this, i]() { this->worker(i); });
+			}
+		}
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(_sleep_mutex);
+				_quit = true;
+			}
+			_sleep.notify_all();
+			for (std::thread &thread : _threads) {
+				thread.join();
+			}
+			_threads.clear();
+		}
+
+		std::vector<std::unique_ptr<Queue>> _queues;
+		std::vector<std::thread> _threads;
+		std::atomic<int> _pending = { 0 };
+
+		std::mutex _sleep_mutex;
+		std::condition_variable _sleep;
+		bool _quit = false;
+	};
+
+	// プロセス全体で共有するプール
+	inline ThreadPool &thread_pool() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	// 使うスレッド数(呼び出し側を含む)を変える。並列処理の外から呼ぶこと
+	inline void set_thread_count(int thread_count) {
+		thread_pool().set_thread_count(thread_count);
+	}
+
+	/*
+	まとめて待つタスクの集まり
+	waitは終わるまで自分でもタスクを実行する
+	タスクが投げた例外は捕まえておき、全部終わってから wait が投げ直す (最初のひとつだけ)
+	デストラクタは残りを待つだけで投げない (巻き戻しの途中でも、参照しているタスクが終わるまで待つ)
+	*/
+	class TaskGroup {
+	public:
+		explicit TaskGroup(ThreadPool &pool = thread_pool()) :_pool(pool) {}
+		~TaskGroup() {
+			drain();
+		}
+		TaskGroup(const TaskGroup &) = delete;
+		void operator=(const TaskGroup &) = delete;
+
+		template <class F>
+		void run(const F &f) {
+			_count++;
+			_pool.push([this, f]() {
+				// 例外で抜けても数は必ず減らす
+				struct Done {
+					std::atomic<int> &count;
+					~Done() { count--; }
+				} done = { _count };
+				try {
+					f();
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(_error_mutex);
+					if (!_error) {
+						_error = std::current_exception();
+					}
+				}
+			});
+		}
+		void wait() {
+			drain();
+			std::exception_ptr error;
+			{
+				std::lock_guard<std::mutex> lock(_error_mutex);
+				std::swap(error, _error);
+			}
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+	private:
+		void drain() {
+			while (0 < _count.load()) {
+				if (_pool.run_one() == false) {
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		ThreadPool &_pool;
+		std::atomic<int> _count = { 0 };
+		std::mutex _error_mutex;
+		std::exception_ptr _error;
+	};
+
+	/*
+	[beg, end) を grain 以下になるまで半分に割りながら、後ろ半分をタスクとして積む
+	積まれた大きい塊は暇なスレッドに前から盗まれる
+	*/
+	template <class F>
+	inline void parallel_range(TaskGroup &group, int beg, int end, const F &action, int grain) {
+		while (grain < end - beg) {
+			int mid = beg + (end - beg) / 2;
+			group.run([&group, mid, end, &action, grain]() {
+				parallel_range(group, mid, end, action, grain);
+			});
+			end = mid;
+		}
+		action(beg, end);
+	}
+
+	template <class F>
+	inline void parallel_range(int beg, int end, const F &action, int grain = 1, ThreadPool &pool = thread_pool()) {
+		grain = std::max(grain, 1);
+		if (end - beg <= grain || pool.thread_count() == 1) {
+			if (beg < end) {
+				action(beg, end);
+			}
+			return;
+		}
+		TaskGroup group(pool);
+		parallel_range(group, beg, end, action, grain);
+		group.wait();
+	}
+}
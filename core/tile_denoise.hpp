@@ -0,0 +1,229 @@
+﻿#pragma once
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "accumlation_buffer.hpp"
+#include "tile_scheduler.hpp"
+#include "adaptive_sampling.hpp"
+
+/*
+仕上げのデノイズを描画と重ねる (タイル単位のパイプライン)
+  update : 適応サンプリングで収束したタイルを凍結する (以後サンプリングしない)
+           凍結したタイルは、ハローにかかる周りのタイルもすべて凍結したら別スレッドでデノイズし、出力画像へ書く
+  finish : 締め切りで残りのタイルをすべて凍結し、まだのタイルをまとめてデノイズする
+           ハローのぶん、タイルごとのデノイズは画像全体にかけるより画素が多い (32 画素のタイルに 8 画素のハローで 2.25 倍)
+           残りのハロー込みの面積が画像全体を超えるときは、画像全体に一度かける
+凍結したタイルとそのハローは描画から書かれないので、描画と並行して読んでよい
+ハローがデノイザーの参照範囲 (NLMなら 5x5 のパッチと 13x13 の探索で 8 画素) 以上あれば、画像全体にかけた場合と同じ結果になる
+*/
+namespace lc {
+	class TileDenoisePipeline {
+	public:
+		// src (タイルにハローをつけた範囲) をデノイズして dst へ
+		typedef std::function<void(Image & /*dst*/, const Image & /*src*/)> Denoiser;
+
+		TileDenoisePipeline(const AccumlationBuffer &buffer, const TileScheduler &scheduler, int halo, Denoiser denoiser)
+			:_buffer(buffer), _tiles(scheduler.tiles), _halo(halo), _denoiser(denoiser), _state(scheduler.tiles.size()) {
+			_image.resize(buffer._width, buffer._height);
+			for (auto &state : _state) {
+				state = kSampling;
+			}
+
+			// ハローにかかるタイル (自分を含む)
+			_neighbors.resize(_tiles.size());
+			for (int i = 0; i < (int)_tiles.size(); ++i) {
+				Tile region = halo_region(_tiles[i]);
+				for (int j = 0; j < (int)_tiles.size(); ++j) {
+					const Tile &t = _tiles[j];
+					if (t.x < region.x + region.width && region.x < t.x + t.width && t.y < region.y + region.height && region.y < t.y + t.height) {
+						_neighbors[i].push_back(j);
+					}
+				}
+			}
+			_worker = std::thread([this]() { work(); });
+		}
+		~TileDenoisePipeline() {
+			stop();
+		}
+		TileDenoisePipeline(const TileDenoisePipeline &) = delete;
+		void operator=(const TileDenoisePipeline &) = delete;
+
+		/*
+		収束したタイルを凍結し、ハローまで凍結したタイルをデノイズに回す
+		パスの区切り (step_adaptive の合間) に描画スレッドから呼ぶ
+		凍結したタイルは adaptive.tile_frozen に印をつけるので、目標を厳しくしても描き直されない
+		*/
+		void update(AdaptiveSampling &adaptive) {
+			adaptive.tile_frozen.resize(_tiles.size(), 0);
+			for (int i = 0; i < (int)_tiles.size(); ++i) {
+				if (_state[i] == kSampling && i < (int)adaptive.tile_converged.size() && adaptive.tile_converged[i]) {
+					_state[i] = kFrozen;
+					adaptive.tile_frozen[i] = 1;
+					_frozen_count++;
+				}
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (int i = 0; i < (int)_tiles.size(); ++i) {
+				if (_state[i] == kFrozen && neighbors_frozen(i)) {
+					_state[i] = kQueued;
+					_queue.push_back(i);
+				}
+			}
+			_condition.notify_one();
+		}
+
+		// 残りを凍結し、まだデノイズしていないタイルを並列に処理して、すべて終わるまで待つ
+		void finish() {
+			stop();
+			_frozen_count = (int)_tiles.size();
+			if (1.0 <= remaining_cost()) {
+				denoise_full();
+				return;
+			}
+			parallel_for((int)_tiles.size(), [this](int beg, int end) {
+				for (int i = beg; i < end; ++i) {
+					if (_state[i] != kDone) {
+						denoise_tile(i);
+					}
+				}
+			});
+		}
+
+		// 組み立てた出力 (デノイズ済みのタイルだけ埋まっている)
+		const Image &image() const {
+			return _image;
+		}
+		int frozen_count() const {
+			return _frozen_count;
+		}
+		int denoised_count() const {
+			return _denoised_count;
+		}
+		int tile_count() const {
+			return (int)_tiles.size();
+		}
+
+		/*
+		残りのデノイズの手間を、画像全体に一度かけたときとの比で返す (締め切りの見積もり用)
+		まだのタイルのハロー込みの面積の和だが、画像全体にかけたほうが安いので 1 で頭打ち
+		*/
+		double remaining_cost() const {
+			int64_t area = 0;
+			for (int i = 0; i < (int)_tiles.size(); ++i) {
+				if (_state[i] != kDone) {
+					Tile region = halo_region(_tiles[i]);
+					area += (int64_t)region.width * region.height;
+				}
+			}
+			return std::min((double)area / ((int64_t)_buffer._width * _buffer._height), 1.0);
+		}
+	private:
+		enum State {
+			kSampling,
+			kFrozen,
+			kQueued,
+			kDone
+		};
+
+		Tile halo_region(const Tile &tile) const {
+			Tile region;
+			region.x = std::max(tile.x - _halo, 0);
+			region.y = std::max(tile.y - _halo, 0);
+			region.width = std::min(tile.x + tile.width + _halo, _buffer._width) - region.x;
+			region.height = std::min(tile.y + tile.height + _halo, _buffer._height) - region.y;
+			return region;
+		}
+
+		bool neighbors_frozen(int tile_index) const {
+			for (int j : _neighbors[tile_index]) {
+				if (_state[j] == kSampling) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void denoise_tile(int tile_index) {
+			const Tile &tile = _tiles[tile_index];
+			Tile region = halo_region(tile);
+			Image src(region.width, region.height);
+			for (int y = 0; y < region.height; ++y) {
+				for (int x = 0; x < region.width; ++x) {
+					src.pixels[y * region.width + x] = _buffer.normalized((region.y + y) * _buffer._width + region.x + x);
+				}
+			}
+			Image dst;
+			_denoiser(dst, src);
+			for (int y = 0; y < tile.height; ++y) {
+				for (int x = 0; x < tile.width; ++x) {
+					_image.pixels[(tile.y + y) * _image.width + tile.x + x] = dst.pixels[(tile.y - region.y + y) * region.width + tile.x - region.x + x];
+				}
+			}
+			_state[tile_index] = kDone;
+			_denoised_count++;
+		}
+
+		// 画像全体を一度にデノイズする。結果はタイルごとにかけた場合と同じ
+		void denoise_full() {
+			Image src(_buffer._width, _buffer._height);
+			for (int i = 0; i < (int)src.pixels.size(); ++i) {
+				src.pixels[i] = _buffer.normalized(i);
+			}
+			_denoiser(_image, src);
+			for (auto &state : _state) {
+				state = kDone;
+			}
+			_denoised_count = (int)_tiles.size();
+		}
+
+		void work() {
+			for (;;) {
+				int tile_index = -1;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_condition.wait(lock, [this]() { return _stop || _queue.empty() == false; });
+					if (_stop) {
+						return;
+					}
+					tile_index = _queue.front();
+					_queue.pop_front();
+				}
+				denoise_tile(tile_index);
+			}
+		}
+
+		// 背景のスレッドを止める。処理中のタイルは終えてから戻る (キューの残りは finish が拾う)
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_condition.notify_one();
+			if (_worker.joinable()) {
+				_worker.join();
+			}
+		}
+
+		const AccumlationBuffer &_buffer;
+		std::vector<Tile> _tiles;
+		int _halo = 0;
+		Denoiser _denoiser;
+		Image _image;
+		std::vector<std::atomic<int>> _state;
+		std::vector<std::vector<int>> _neighbors;
+		std::atomic<int> _frozen_count = { 0 };
+		std::atomic<int> _denoised_count = { 0 };
+
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::deque<int> _queue;
+		bool _stop = false;
+		std::thread _worker;
+	};
+}
@@ -0,0 +1,251 @@
+﻿#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#include "parallel_for.hpp"
+#include "stopwatch.hpp"
+
+/*
+タイル単位の描画スケジューラ
+画像をタイルに分け、タイルの中も外も空間充填曲線の順に回して、隣り合う画素を続けて追う
+タイルは共有のカーソルから空いたスレッドが順に取っていく
+前回までのタイルごとの所要時間を覚えておき、重いタイルから先に配る
+締め切りつきで回した場合は、途中で止めたパスの残りのタイルから次回を再開する
+*/
+namespace lc {
+	enum class CurveOrder {
+		Scanline,
+		Morton,
+		Hilbert
+	};
+
+	// 偶数ビットだけを詰める
+	inline uint32_t compact_bits_2(uint32_t v) {
+		v &= 0x55555555;
+		v = (v | (v >> 1)) & 0x33333333;
+		v = (v | (v >> 2)) & 0x0f0f0f0f;
+		v = (v | (v >> 4)) & 0x00ff00ff;
+		v = (v | (v >> 8)) & 0x0000ffff;
+		return v;
+	}
+
+	// 一辺 n (2のべき乗) のヒルベルト曲線上の d 番目の点
+	inline void hilbert_d2xy(int n, int d, int &x, int &y) {
+		x = y = 0;
+		for (int s = 1; s < n; s *= 2) {
+			int rx = 1 & (d / 2);
+			int ry = 1 & (d ^ rx);
+			if (ry == 0) {
+				if (rx == 1) {
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			d /= 4;
+		}
+	}
+
+	/*
+	width x height の格子を order の順に並べたもの (y * width + x)
+	2のべき乗の正方形で曲線を作り、はみ出した点を飛ばす
+	*/
+	inline std::vector<int> curve_order(int width, int height, CurveOrder order) {
+		std::vector<int> indices;
+		indices.reserve(width * height);
+		if (order == CurveOrder::Scanline) {
+			for (int i = 0; i < width * height; ++i) {
+				indices.push_back(i);
+			}
+			return indices;
+		}
+
+		int n = 1;
+		while (n < width || n < height) {
+			n *= 2;
+		}
+		for (int d = 0; d < n * n; ++d) {
+			int x, y;
+			if (order == CurveOrder::Morton) {
+				x = compact_bits_2(d);
+				y = compact_bits_2(d >> 1);
+			}
+			else {
+				hilbert_d2xy(n, d, x, y);
+			}
+			if (x < width && y < height) {
+				indices.push_back(y * width + x);
+			}
+		}
+		return indices;
+	}
+
+	struct Tile {
+		int x = 0;
+		int y = 0;
+		int width = 0;
+		int height = 0;
+	};
+
+	struct TileScheduler {
+		TileScheduler() {}
+		TileScheduler(int width, int height, int tile_size = 32, CurveOrder order = CurveOrder::Hilbert)
+			:_width(width), _height(height), _tile_size(tile_size) {
+			int tiles_x = (width + tile_size - 1) / tile_size;
+			int tiles_y = (height + tile_size - 1) / tile_size;
+			for (int index : curve_order(tiles_x, tiles_y, order)) {
+				Tile tile;
+				tile.x = (index % tiles_x) * tile_size;
+				tile.y = (index / tiles_x) * tile_size;
+				tile.width = std::min(tile_size, width - tile.x);
+				tile.height = std::min(tile_size, height - tile.y);
+				tiles.push_back(tile);
+			}
+			_pixel_order = curve_order(tile_size, tile_size, order);
+			reset_schedule();
+		}
+
+		// タイルの並びを変えたら、計測した時間と途中のパスを捨てる
+		void reset_schedule() {
+			tile_seconds.assign(tiles.size(), 0.0);
+			tile_cost.assign(tiles.size(), 0.0);
+			_schedule.resize(tiles.size());
+			for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+				_schedule[i] = i;
+			}
+			_measured = false;
+			_done.clear();
+			_remaining = 0;
+		}
+
+		/*
+		曲線の順に worker_count 個おきに選んだタイルだけを残す (worker_index 番目から)
+		複数のプロセスでタイルを分けて描くときに使う。隣り合うタイルは別のプロセスに行くので、重さが偏りにくい
+		*/
+		void keep_tiles(int worker_index, int worker_count) {
+			std::vector<Tile> kept;
+			for (int i = worker_index; i < static_cast<int>(tiles.size()); i += worker_count) {
+				kept.push_back(tiles[i]);
+			}
+			tiles = kept;
+			reset_schedule();
+		}
+
+		// タイル内の画素を曲線の順に f(x, y) で回す
+		template <class F>
+		void for_each_pixel(const Tile &tile, const F &f) const {
+			for (int offset : _pixel_order) {
+				int x = offset % _tile_size;
+				int y = offset / _tile_size;
+				if (x < tile.width && y < tile.height) {
+					f(tile.x + x, tile.y + y);
+				}
+			}
+		}
+
+		// 締め切りを過ぎたら画素の区切りで止める。最後まで回せたらtrue
+		template <class F>
+		bool for_each_pixel_until(const Tile &tile, RenderClock::time_point deadline, const F &f) const {
+			for (int offset : _pixel_order) {
+				int x = offset % _tile_size;
+				int y = offset / _tile_size;
+				if (x < tile.width && y < tile.height) {
+					if (deadline <= RenderClock::now()) {
+						return false;
+					}
+					f(tile.x + x, tile.y + y);
+				}
+			}
+			return true;
+		}
+
+		// すべてのタイルを render_tile(tile) で処理する
+		template <class F>
+		void run(const F &render_tile) {
+			run_until([&render_tile](const Tile &tile) {
+				render_tile(tile);
+				return true;
+			}, RenderClock::time_point::max());
+		}
+
+		/*
+		パスの残りのタイルを render_tile(tile) で処理する
+		スレッドはカーソルから次のタイルを取り続けるので、重いタイルに当たったスレッドの分は他が引き受ける
+		締め切りを過ぎたら新しいタイルには手をつけない
+		render_tile が false を返したタイル(途中で止めたもの)は次回もう一度配る
+		パスのタイルがすべて終わったらtrueを返し、次回は新しいパスになる
+		*/
+		template <class F>
+		bool run_until(const F &render_tile /* bool(const Tile &) */, RenderClock::time_point deadline) {
+			int tile_count = static_cast<int>(tiles.size());
+			if (_remaining == 0) {
+				// 予測コストの大きい順 (同じなら前回の順)
+				if (cost_feedback && _measured) {
+					std::stable_sort(_schedule.begin(), _schedule.end(), [this](int a, int b) {
+						return tile_cost[a] > tile_cost[b];
+					});
+				}
+				_done.assign(tile_count, 0);
+				_remaining = tile_count;
+			}
+
+			std::atomic<int> cursor(0);
+			std::atomic<int> finished(0);
+			int workers = std::max(std::min(parallel_concurrency(), _remaining), 1);
+			parallel_for(workers, [this, &cursor, &finished, tile_count, deadline, &render_tile](int /*beg*/, int /*end*/) {
+				for (int i = cursor++; i < tile_count; i = cursor++) {
+					int tile_index = _schedule[i];
+					if (_done[tile_index]) {
+						continue;
+					}
+					auto beg_time = RenderClock::now();
+					if (deadline <= beg_time) {
+						break;
+					}
+					if (render_tile(tiles[tile_index])) {
+						tile_seconds[tile_index] = to_seconds(RenderClock::now() - beg_time);
+						_done[tile_index] = 1;
+						finished++;
+					}
+				}
+			});
+
+			_remaining -= finished;
+			if (0 < _remaining) {
+				return false;
+			}
+
+			for (int i = 0; i < tile_count; ++i) {
+				tile_cost[i] = _measured ? tile_cost[i] + (tile_seconds[i] - tile_cost[i]) * cost_smoothing : tile_seconds[i];
+			}
+			_measured = true;
+			return true;
+		}
+
+		std::vector<Tile> tiles;
+
+		// 直前の run でかかった時間と、その移動平均 [s]
+		std::vector<double> tile_seconds;
+		std::vector<double> tile_cost;
+
+		// false ならいつも曲線の順に配る
+		bool cost_feedback = true;
+		double cost_smoothing = 0.5;
+
+		int _width = 0;
+		int _height = 0;
+		int _tile_size = 0;
+		std::vector<int> _pixel_order;
+		std::vector<int> _schedule;
+		bool _measured = false;
+
+		// 途中のパスで終わったタイルと、残りの数
+		std::vector<char> _done;
+		int _remaining = 0;
+	};
+}
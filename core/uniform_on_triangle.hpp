@@ -7,11 +7,7 @@
 #include "triangle_area.hpp"
 
 namespace lc {
-	template <class Generator>
-	inline Vec3 uniform_on_triangle(RandomEngine<Generator> &e, const Triangle &tri) {
-		double eps1 = e.continuous();
-		double eps2 = e.continuous();
-
+	inline Vec3 uniform_on_triangle(double eps1, double eps2, const Triangle &tri) {
 		double sqrt_r1 = glm::sqrt(eps1);
 		lc::Vec3 p =
 			(1.0 - sqrt_r1) * tri[0]
@@ -19,6 +15,12 @@ namespace lc {
 			+ sqrt_r1 * eps2 * tri[2];
 		return p;
 	}
+	template <class Generator>
+	inline Vec3 uniform_on_triangle(RandomEngine<Generator> &e, const Triangle &tri) {
+		double eps1 = e.continuous();
+		double eps2 = e.continuous();
+		return uniform_on_triangle(eps1, eps2, tri);
+	}
 	class UniformOnTriangle {
 	public:
 		void build() {
@@ -42,15 +44,18 @@ namespace lc {
 			Vec3 p;
 			int index = -1;
 		};
+		// 三角形上の点の2次元を先に引き、三角形の選択は後にする (ライト上の点が連続した2次元になるように)
 		template <class Generator>
 		Uniform uniform(RandomEngine<Generator> &e) const {
+			double eps1 = e.continuous();
+			double eps2 = e.continuous();
 			double p = e.continuous(0.0, _area);
 			auto it = std::upper_bound(_cumulative_areas.begin(), _cumulative_areas.end(), p);
 			std::size_t index = std::distance(_cumulative_areas.begin(), it);
 			index = std::min(index, _cumulative_areas.size() - 1);
 
 			Uniform u;
-			u.p = uniform_on_triangle(e, _triangles[index]);
+			u.p = uniform_on_triangle(eps1, eps2, _triangles[index]);
 			u.index = (int)index;
 			return u;
 		}
@@ -0,0 +1,131 @@
+﻿// ParallelScaling.cpp : parallel_for とスレッドプールのスケーリング計測
+//
+// ParallelScaling [最大スレッド数]
+// スレッド数を 1, 2, 4, ... と変えながら
+//   - 粒度ごとの parallel_for (細かいタスクを大量に投げたときのオーバーヘッド)
+//   - BVH の構築 (入れ子のタスク)
+//   - 描画の step
+// の時間と1スレッドに対する速度向上率を表示する
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+#include "render.hpp"
+
+#include <boost/format.hpp>
+
+namespace {
+	template <class F>
+	double measure(int repeat, F f) {
+		auto beg = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeat; ++i) {
+			f();
+		}
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double>(end - beg).count() / repeat;
+	}
+
+	// 細かく分割した球面
+	std::vector<lc::Triangle> sphere_triangles(lc::Vec3 center, double radius, int division) {
+		auto p = [=](int i, int j) {
+			double theta = glm::pi<double>() * i / division;
+			double phi = glm::two_pi<double>() * j / (division * 2);
+			return center + radius * lc::Vec3(glm::sin(theta) * glm::cos(phi), glm::cos(theta), glm::sin(theta) * glm::sin(phi));
+		};
+		std::vector<lc::Triangle> triangles;
+		for (int i = 0; i < division; ++i) {
+			for (int j = 0; j < division * 2; ++j) {
+				triangles.emplace_back(p(i, j), p(i + 1, j), p(i + 1, j + 1));
+				triangles.emplace_back(p(i, j), p(i + 1, j + 1), p(i, j + 1));
+			}
+		}
+		return triangles;
+	}
+
+	void setup_scene(lc::Scene &scene, const std::vector<lc::Triangle> &triangles) {
+		lc::Camera::Settings camera_settings;
+		camera_settings.fovy = glm::radians(45.0);
+		scene.camera = lc::Camera(camera_settings);
+		scene.viewTransform = lc::Transform(glm::lookAt(lc::Vec3(0.0, 0.0, 60.0), lc::Vec3(), lc::Vec3(0.0, 1.0, 0.0)));
+
+		scene.add(lc::ConelBoxObject(50.0));
+
+		auto light = lc::DiscLight();
+		light.disc = lc::make_disc(lc::Vec3(0.0, 24.0, 0.0), lc::Vec3(0.0, -1.0, 0.0), 7.0);
+		light.emissive = lc::EmissiveMaterial(lc::Vec3(5.0));
+		scene.add(light);
+
+		auto mesh = lc::MeshObject();
+		mesh.material = scene.add_material(lc::CookTorranceMaterial(lc::Vec3(0.8), 0.3, 0.9));
+		mesh.bvh.set_triangle(triangles);
+		mesh.bvh.build();
+		scene.add(mesh);
+
+		scene.finalize();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 1 < argc ? std::atoi(argv[1]) : lc::ThreadPool::default_thread_count();
+
+	std::vector<lc::Triangle> triangles = sphere_triangles(lc::Vec3(0.0, -10.0, 0.0), 12.0, 128);
+	lc::Scene scene;
+	setup_scene(scene, triangles);
+
+	std::vector<int> thread_counts;
+	for (int n = 1; n < max_threads; n *= 2) {
+		thread_counts.push_back(n);
+	}
+	thread_counts.push_back(max_threads);
+
+	std::cout << boost::format("triangles: %d, max threads: %d") % triangles.size() % max_threads << std::endl;
+
+	const int kSIZE = 256;
+	const int kCOUNT = 1 << 20;
+	std::vector<double> values(kCOUNT);
+	std::array<int, 4> grains = { 1, 64, 1024, 16384 };
+
+	std::array<double, 4> base_for;
+	double base_build = 0.0;
+	double base_step = 0.0;
+	for (int threads : thread_counts) {
+		lc::set_thread_count(threads);
+		std::cout << boost::format("threads %2d") % threads << std::endl;
+
+		for (int g = 0; g < grains.size(); ++g) {
+			double t = measure(5, [&values, &grains, g, kCOUNT]() {
+				parallel_for(kCOUNT, [&values](int beg, int end) {
+					for (int i = beg; i < end; ++i) {
+						values[i] = glm::sqrt(glm::sin(i * 0.001) + 2.0);
+					}
+				}, grains[g]);
+			});
+			if (threads == 1) {
+				base_for[g] = t;
+			}
+			std::cout << boost::format("  parallel_for grain %5d : %8.4f s (x%.2f)") % grains[g] % t % (base_for[g] / t) << std::endl;
+		}
+
+		double t_build = measure(1, [&triangles]() {
+			lc::BVH bvh;
+			bvh.set_triangle(triangles);
+			bvh.build();
+		});
+		if (threads == 1) {
+			base_build = t_build;
+		}
+		std::cout << boost::format("  bvh build               : %8.4f s (x%.2f)") % t_build % (base_build / t_build) << std::endl;
+
+		double t_step = measure(2, [&scene, kSIZE]() {
+			lc::AccumlationBuffer buffer(kSIZE, kSIZE);
+			lc::step(buffer, scene, 1);
+		});
+		if (threads == 1) {
+			base_step = t_step;
+		}
+		std::cout << boost::format("  step %dx%d             : %8.4f s (x%.2f)") % kSIZE % kSIZE % t_step % (base_step / t_step) << std::endl;
+	}
+	return 0;
+}
@@ -23,6 +23,7 @@
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
+#include "obj_mesh.hpp"
 
 static const int wide = 256;
 
@@ -174,45 +175,14 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		transform = glm::rotate(transform, glm::radians(15.0), lc::Vec3(0.0, 1.0, 0.0));
 		transform = glm::scale(transform, lc::Vec3(scale_value));
 
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "hato.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
-
-		for (int k = 0; k < shapes.size(); ++k) {
-			const tinyobj::shape_t &shape = shapes[k];
-			auto mesh = lc::MeshObject();
-			if (shape.name == "hato.002_hato.003") {
-				mesh.material = lc::LambertMaterial(lc::Vec3(0.4, 0.9, 0.95));
-			}
-			else {
-				mesh.material = lc::LambertMaterial(lc::Vec3(0.85, 0.63, 0.85));
-			}
-
-			std::vector<lc::Triangle> triangles;
-			for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-				lc::Triangle tri;
-				for (int j = 0; j < 3; ++j) {
-					int idx = shape.mesh.indices[i + j];
-					for (int k = 0; k < 3; ++k) {
-						tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-					}
-				}
-				triangles.push_back(tri);
-			}
-			std::vector<lc::Triangle> tris = triangles;
+		// シェイプごとにマテリアルを割り当て、はと全体をひとつのBVHにする
+		std::map<std::string, lc::MaterialID> shape_materials;
+		shape_materials["hato.002_hato.003"] = scene.add_material(lc::LambertMaterial(lc::Vec3(0.4, 0.9, 0.95)));
+		lc::MaterialID body = scene.add_material(lc::LambertMaterial(lc::Vec3(0.85, 0.63, 0.85)));
 
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			mesh.bvh.set_triangle(tris);
-			mesh.bvh.build();
-
-			scene.add(mesh);
-		}
+		auto mesh = lc::MeshObject();
+		lc::load_obj_mesh(mesh, scene, asset_path / "hato.obj", transform, body, shape_materials);
+		scene.add(mesh);
 
 		std::array<lc::Vec3, 2> eyes = {
 			lc::Vec3(1.405, 4.02, 0.594),
@@ -221,7 +191,7 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		for (int i = 0; i < eyes.size(); ++i) {
 			auto eye = lc::SphereObject(
 				lc::Sphere(lc::mul3x4(transform, eyes[i]), 0.15 * scale_value),
-				lc::CookTorranceMaterial(lc::Vec3(0.0), lc::Vec3(1.0), 0.01, 0.05 /*フレネル*/)
+				scene.add_material(lc::CookTorranceMaterial(lc::Vec3(0.0), lc::Vec3(1.0), 0.01, 0.05 /*フレネル*/))
 			);
 			scene.add(eye);
 		}
@@ -272,7 +242,7 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 			}
 
 			auto mesh = lc::MeshObject();
-			mesh.material = lc::LambertMaterial(colors[ri]);
+			mesh.material = scene.add_material(lc::LambertMaterial(colors[ri]));
 			mesh.bvh.set_triangle(tris);
 			mesh.bvh.build();
 
@@ -285,42 +255,12 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		transform = glm::translate(transform, lc::Vec3(0.0, -25.0, 30.0));
 		transform = glm::scale(transform, lc::Vec3(120.0));
 
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "floor.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
-
-		for (int k = 0; k < shapes.size(); ++k) {
-			const tinyobj::shape_t &shape = shapes[k];
-			auto mesh = lc::MeshObject();
-			// mesh.material = lc::CookTorranceMaterial(lc::Vec3(1.0), 0.4, 0.99);
-			// mesh.material = lc::PerfectSpecularMaterial();
-			mesh.material = lc::LambertMaterial(lc::Vec3(1.0));
-
-			std::vector<lc::Triangle> triangles;
-			for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-				lc::Triangle tri;
-				for (int j = 0; j < 3; ++j) {
-					int idx = shape.mesh.indices[i + j];
-					for (int k = 0; k < 3; ++k) {
-						tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-					}
-				}
-				triangles.push_back(tri);
-			}
-			std::vector<lc::Triangle> tris = triangles;
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			mesh.bvh.set_triangle(tris);
-			mesh.bvh.build();
-
-			scene.add(mesh);
-		}
+		auto mesh = lc::MeshObject();
+		// lc::MaterialID floor_material = scene.add_material(lc::CookTorranceMaterial(lc::Vec3(1.0), 0.4, 0.99));
+		// lc::MaterialID floor_material = scene.add_material(lc::PerfectSpecularMaterial());
+		lc::MaterialID floor_material = scene.add_material(lc::LambertMaterial(lc::Vec3(1.0)));
+		lc::load_obj_mesh(mesh, scene, asset_path / "floor.obj", transform, floor_material);
+		scene.add(mesh);
 	}
 
 	{
@@ -332,7 +272,7 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 
 		std::vector<lc::Triangle> triangles;
 		auto mesh = lc::MeshObject();
-		mesh.material = lc::CookTorranceMaterial(lc::Vec3(0.3, 0.7, 0.2), 0.4, 0.99);
+		mesh.material = scene.add_material(lc::CookTorranceMaterial(lc::Vec3(0.3, 0.7, 0.2), 0.4, 0.99));
 
 		for (int k = 0; k < shapes.size(); ++k) {
 			const tinyobj::shape_t &shape = shapes[k];
@@ -521,6 +461,7 @@ public:
 	gl::BatchRef _plane;
 
 	lc::AccumlationBuffer *_buffer = nullptr;
+	lc::TileScheduler _scheduler;
 	lc::Scene _scene;
 	cinder::Surface32fRef _surface;
 	gl::Texture2dRef _texture;
@@ -534,6 +475,7 @@ public:
 	float _previewGamma = 2.2f;
 	// float _previewGamma = 1.0f;
 	bool _median = false;
+	bool _denoise = false;
 };
 
 
@@ -570,7 +512,8 @@ void RayTracerApp::setup()
 		.vertex(loadAsset("preview_shader/shader.vert"))
 		.fragment(loadAsset("preview_shader/shader.frag")));
 
-	_buffer = new lc::AccumlationBuffer(wide, wide);
+	_buffer = new lc::AccumlationBuffer(wide, wide, 50, lc::AccumlationBuffer::kAllPlanes | lc::AccumlationBuffer::kFeaturePlane);
+	_scheduler = lc::TileScheduler(wide, wide);
 
 	setup_scene(_scene, getAssetPath(""));
 }
@@ -627,10 +570,11 @@ void RayTracerApp::draw()
 	ui::Text("rays per miliseconds: %.2f", aa * _buffer->_width * _buffer->_height * _buffer->_iteration * 0.001 / (_renderTime + 0.0001));
 	
 	ui::Checkbox("render", &_render);
+	ui::Checkbox("denoise (a-trous)", &_denoise);
 
 	if (_render) {
 		double beg = getElapsedSeconds();
-		lc::step(*_buffer, _scene, aa);
+		lc::step(*_buffer, _scene, aa, _scheduler);
 		double duration = getElapsedSeconds() - beg;
 
 		_renderTime += duration;
@@ -639,6 +583,14 @@ void RayTracerApp::draw()
 		static lc::Image nlm_image;
 		_buffer->to_image(image);
 		// lc::non_local_means(nlm_image, image, 1.0);
+		if (_denoise) {
+			static lc::FeatureImages features;
+			static std::vector<double> variance;
+			_buffer->to_feature_images(features);
+			_buffer->to_variance(variance);
+			lc::atrous_filter(nlm_image, image, features, variance);
+			std::swap(image, nlm_image);
+		}
 		lc::tone_mapping(image);
 		// lc::color_correction(image);
 		_surface = lc::to_surface(image);
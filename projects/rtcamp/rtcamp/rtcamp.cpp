@@ -8,32 +8,170 @@
 #include <future>
 
 #include "render.hpp"
+#include "adaptive_sampling.hpp"
 #include "image_processing.hpp"
-
+#include "stopwatch.hpp"
+#include "checkpoint.hpp"
+#include "render_split.hpp"
+#include "render_server.hpp"
+#include "render_batch.hpp"
+#include "tile_denoise.hpp"
+#include "post_process.hpp"
+#include "snapshot_queue.hpp"
+#include "png_writer.hpp"
+#include "exr_writer.hpp"
+#include "preview_channel.hpp"
+
+#include <thread>
+#include <chrono>
+
+#ifdef _WIN32
 #include <windows.h>
-#include <ppl.h>
+#endif
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
+#include "obj_mesh.hpp"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
-
-#include <boost/timer.hpp>
 #include <boost/format.hpp>
 
 static const double kRENDER_TIME = 60.0 * 5.0;
 // static const double kRENDER_TIME = 30.0;
 static const double kWRITE_INTERVAL = 20.0;
+
+// 積算バッファのチェックポイントを書く間隔。--resume で最後のチェックポイントから続ける
+static const double kCHECKPOINT_INTERVAL = 60.0;
+
+/*
+複数プロセスでの分割 (render_split.hpp)
+  rtcamp --worker <番号> <数> [--split samples|tiles] [--dir <共有ディレクトリ>] [--run <名前>]
+    分担を描いて <dir>/part_###.bin (--run があれば part_<名前>_###.bin) を書く
+  rtcamp --merge <数> [--dir <共有ディレクトリ>] [--timeout <秒>] [--run <名前>]
+    部分がそろうのを待って足し、NLMをかけて render_merged_final.png (と render_merged_final.exr) を書く
+    同じ --run を渡せば、前の実行の部分を拾わない。大きさの違う部分があれば失敗する
+
+常駐サーバー (render_server.hpp)
+  rtcamp --serve <ソケットのパス | ->
+    シーンを一度だけ作り、ジョブを受けて描く。- なら標準入出力で受ける
+    出力が .bin なら積算バッファ(チェックポイントの形式)、.exr なら放射輝度、それ以外はトーンマップしたPNG
+
+まとめ描き (render_batch.hpp)
+  rtcamp --batch <キーフレームのファイル>
+  rtcamp --turntable <フレーム数>
+    シーンを一度だけ作り、フレームごとにカメラを差し替えて frame_###.png を書く
+    フレームの予算は既定で kRENDER_TIME をフレーム数で割った時間。NLMと書き出しは次のフレームの描画と重ねる
+
+途中経過のプレビュー (preview_channel.hpp)
+  rtcamp --preview <名前> [--preview-float]
+    ふつうに描きながら、パスごとに縮小した画像を共有メモリ <名前> へ流す。見る側は待たない
+    --preview-float ならトーンマッピング前の放射輝度を流す
+  rtcamp --watch <名前> [--frames <数>] [--timeout <秒>]
+    見る側の見本。届いたフレームを preview_#####.png (float なら .exr) に書く
+    描画側が閉じるか <数> 枚書いたら終わる。共有メモリができるのは <秒> まで待つ
+*/
 // static const int kSIZE = 1024;
 // static const int kSIZE = 256;
 static const int kSIZE = 1200;
 
-static const double kNLM_TIME_ESTIMATE = 2.5; // 1200 x 1200
 static const double kNLM_COEF = 0.35;
 
+// 後処理(NLMと書き出し)の時間は実測から見積もり、安全率を掛けて描画の締め切りから差し引く
+static const double kPOST_SAFETY = 1.3;
+static const double kPOST_MARGIN = 0.5;
+static const int kNLM_CALIBRATION_SIZE = 128;
+// 最終フレームの書き出し (PNG High と EXR) の見積もりに書く画像の大きさ。ファイルを開く手間が面積比で膨らまないよう大きめ
+static const int kWRITE_CALIBRATION_SIZE = 256;
+
+// NLMの見積もりが残り時間のこの割合を超えたら、最終フレームは特徴で止めるà-trousで済ませる (締め切りが厳しいとき)
+static const double kNLM_MAX_FRACTION = 0.1;
+
+// 締め切りの前 (NLMの見積もりの時間ぶん) に収束したタイルから凍結してNLMをかけ、最終フレームの待ちを減らす
+static const bool kPIPELINED_DENOISE = true;
+
+// 最終フレームの放射輝度 (トーンマッピング前) を合成用に render_###_final.exr へも書く
+static const bool kWRITE_HDR = true;
+
+// 最終フレームの特徴 (AOV) を aov_*.png へも書く。デバッグ用で、締め切りの見積もりに入っていないので既定では書かない
+static const bool kWRITE_AOV = false;
+
+// プレビューの長辺の上限。画像は整数分の1に縮める
+static const int kPREVIEW_SIZE = 256;
+
 namespace {
-	void write_as_png(std::string filename, const lc::Image &image) {
+	// 実行ファイルの場所 (アセットとログの置き場)
+	lc::fs::path executable_path(const char *argv0) {
+#ifdef _WIN32
+		char name[1024];
+		GetModuleFileNameA(nullptr, name, sizeof(name));
+		return lc::fs::path(name);
+#else
+		std::error_code ec;
+		lc::fs::path path = lc::fs::read_symlink("/proc/self/exe", ec);
+		return ec ? lc::fs::absolute(argv0) : path;
+#endif
+	}
+
+	// 小さい画像でデノイザーを回し、width x height にかかる時間を面積比で見積もる (どちらも時間は画素数に比例する)
+	double estimate_denoise_seconds(int width, int height, bool atrous) {
+		// NLMはタイルごとのタスクなので、タイルがスレッド数より少ないと全部のスレッドを使えず、面積で伸ばすと多く見積もる
+		int tiles = (int)std::ceil(std::sqrt((double)parallel_concurrency()));
+		int size = std::max(kNLM_CALIBRATION_SIZE, tiles * lc::kNonLocalMeansTileSize);
+		int w = std::min(width, size);
+		int h = std::min(height, size);
+		lc::Image image(w, h);
+		lc::Image denoised;
+		lc::Stopwatch timer;
+		if (atrous) {
+			lc::atrous_filter(denoised, image, lc::FeatureImages(), std::vector<double>());
+		}
+		else {
+			lc::non_local_means(denoised, image, kNLM_COEF);
+		}
+		return timer.elapsed() * ((double)width * height / ((double)w * h));
+	}
+
+	/*
+	最終フレームの書き出しを小さい画像で dir へ試しに書いて消し、width x height にかかる時間を面積比で見積もる
+	png_seconds は PNG (High)、exr_seconds は EXR (write_hdr のときだけ)
+	画像はノイズにしておく。圧縮が効かないぶん、実際の (デノイズした) 画像より遅めに出る
+	*/
+	void estimate_final_write_seconds(const lc::fs::path &dir, int width, int height, bool write_hdr, double &png_seconds, double &exr_seconds) {
+		int tiles = (int)std::ceil(std::sqrt((double)parallel_concurrency()));
+		int size = std::max(kWRITE_CALIBRATION_SIZE, tiles * 64);
+		int w = std::min(width, size);
+		int h = std::min(height, size);
+		double scale = (double)width * height / ((double)w * h);
+
+		std::vector<uint8_t> pixels(w * h * 3);
+		uint32_t state = 2463534242u;
+		for (uint8_t &p : pixels) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			p = (uint8_t)(state >> 24);
+		}
+
+		std::string png_path = (dir / "calibration.png").string();
+		lc::Stopwatch timer_png;
+		lc::write_png(png_path, pixels.data(), w, h, 3, lc::PngCompression::High);
+		png_seconds = timer_png.elapsed() * scale;
+		std::remove(png_path.c_str());
+
+		exr_seconds = 0.0;
+		if (write_hdr) {
+			std::string exr_path = (dir / "calibration.exr").string();
+			lc::Stopwatch timer_exr;
+			lc::write_exr(exr_path, w, h, [&pixels, w](int x, int y) {
+				const uint8_t *p = pixels.data() + (y * w + x) * 3;
+				return lc::Vec3(p[0], p[1], p[2]) / 255.0 * 4.0;
+			});
+			exr_seconds = timer_exr.elapsed() * scale;
+			std::remove(exr_path.c_str());
+		}
+	}
+
+	// 途中経過は Fast、最終フレームは High で圧縮する (png_writer.hpp)。書けなければ false
+	bool write_as_png(std::string filename, const lc::Image &image, lc::PngCompression compression = lc::PngCompression::Fast) {
 		std::vector<uint8_t> pixels(image.width * image.height * 3);
 		parallel_for(image.height, [&pixels, &image](int beg_y, int end_y) {
 			for (int y = beg_y; y < end_y; ++y) {
@@ -49,7 +187,55 @@ namespace {
 			}
 		});
 
-		stbi_write_png(filename.c_str(), image.width, image.height, 3, pixels.data(), image.width * 3);
+		return lc::write_png(filename, pixels.data(), image.width, image.height, 3, compression);
+	}
+
+	// 後処理を済ませた 8bit の RGB
+	bool write_as_png(std::string filename, const std::vector<uint8_t> &pixels, int width, int height, lc::PngCompression compression = lc::PngCompression::Fast) {
+		return lc::write_png(filename, pixels.data(), width, height, 3, compression);
+	}
+
+	// 最終フレーム: NLM (atrous なら特徴で止めるà-trous) をかけて書き出す。elapsed_nlm はデノイズにかかった時間。書けなければ false
+	bool write_final_image(const std::string &dst, const lc::AccumlationBuffer &buffer, double &elapsed_nlm, bool atrous = false) {
+		lc::Image image;
+		buffer.to_image(image);
+
+		lc::Image nlm_image;
+		lc::Stopwatch timer_nlm;
+		if (atrous) {
+			lc::FeatureImages features;
+			buffer.to_feature_images(features);
+			std::vector<double> variance;
+			buffer.to_variance(variance);
+			lc::atrous_filter(nlm_image, image, features, variance);
+		}
+		else {
+			lc::non_local_means(nlm_image, image, kNLM_COEF);
+		}
+		elapsed_nlm = timer_nlm.elapsed();
+
+		std::vector<uint8_t> pixels;
+		lc::post_process(pixels, nlm_image);
+		return write_as_png(dst, pixels, nlm_image.width, nlm_image.height, lc::PngCompression::High);
+	}
+
+	// 特徴 (AOV) を dir へ aov_albedo.png, aov_normal.png, aov_depth.png, aov_object.png として書く。ひとつでも書けなければ false
+	bool write_feature_images(const lc::fs::path &dir, const lc::AccumlationBuffer &buffer) {
+		if (buffer.has_features() == false) {
+			return true;
+		}
+		lc::FeatureImages features;
+		buffer.to_feature_images(features);
+
+		lc::Image image;
+		bool ok = write_as_png((dir / "aov_albedo.png").string(), features.albedo);
+		lc::visualize_normal(image, features);
+		ok = write_as_png((dir / "aov_normal.png").string(), image) && ok;
+		lc::visualize_depth(image, features);
+		ok = write_as_png((dir / "aov_depth.png").string(), image) && ok;
+		lc::visualize_id(image, features.object_id, features.width, features.height);
+		ok = write_as_png((dir / "aov_object.png").string(), image) && ok;
+		return ok;
 	}
 
 	//void write_as_png(std::string filename, const lc::AccumlationBuffer &buffer) {
@@ -202,45 +388,14 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		transform = glm::rotate(transform, glm::radians(15.0), lc::Vec3(0.0, 1.0, 0.0));
 		transform = glm::scale(transform, lc::Vec3(scale_value));
 
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "hato.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
+		// シェイプごとにマテリアルを割り当て、はと全体をひとつのBVHにする
+		std::map<std::string, lc::MaterialID> shape_materials;
+		shape_materials["hato.002_hato.003"] = scene.add_material(lc::LambertMaterial(lc::Vec3(0.4, 0.9, 0.95)));
+		lc::MaterialID body = scene.add_material(lc::LambertMaterial(lc::Vec3(0.85, 0.63, 0.85)));
 
-		for (int k = 0; k < shapes.size(); ++k) {
-			const tinyobj::shape_t &shape = shapes[k];
-			auto mesh = lc::MeshObject();
-			if (shape.name == "hato.002_hato.003") {
-				mesh.material = lc::LambertMaterial(lc::Vec3(0.4, 0.9, 0.95));
-			}
-			else {
-				mesh.material = lc::LambertMaterial(lc::Vec3(0.85, 0.63, 0.85));
-			}
-
-			std::vector<lc::Triangle> triangles;
-			for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-				lc::Triangle tri;
-				for (int j = 0; j < 3; ++j) {
-					int idx = shape.mesh.indices[i + j];
-					for (int k = 0; k < 3; ++k) {
-						tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-					}
-				}
-				triangles.push_back(tri);
-			}
-			std::vector<lc::Triangle> tris = triangles;
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			mesh.bvh.set_triangle(tris);
-			mesh.bvh.build();
-
-			scene.add(mesh);
-		}
+		auto mesh = lc::MeshObject();
+		lc::load_obj_mesh(mesh, scene, asset_path / "hato.obj", transform, body, shape_materials);
+		scene.add(mesh);
 
 		std::array<lc::Vec3, 2> eyes = {
 			lc::Vec3(1.405, 4.02, 0.594),
@@ -249,33 +404,14 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		for (int i = 0; i < eyes.size(); ++i) {
 			auto eye = lc::SphereObject(
 				lc::Sphere(lc::mul3x4(transform, eyes[i]), 0.15 * scale_value),
-				lc::CookTorranceMaterial(lc::Vec3(0.0), lc::Vec3(1.0), 0.01, 0.05 /*フレネル*/)
+				scene.add_material(lc::CookTorranceMaterial(lc::Vec3(0.0), lc::Vec3(1.0), 0.01, 0.05 /*フレネル*/))
 			);
 			scene.add(eye);
 		}
 	}
 
+	// ばら3本をひとつのBVHにする
 	{
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "rose.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
-
-
-		std::vector<lc::Triangle> triangles;
-		const tinyobj::shape_t &shape = shapes[0];
-		for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-			lc::Triangle tri;
-			for (int j = 0; j < 3; ++j) {
-				int idx = shape.mesh.indices[i + j];
-				for (int k = 0; k < 3; ++k) {
-					tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-				}
-			}
-			triangles.push_back(tri);
-		}
-
 		std::array<lc::Vec3, 3> positions = {
 			lc::Vec3(0.0,  -25.0, 10.0),
 			lc::Vec3(-25.0, -25.0, -15.0),
@@ -286,26 +422,18 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 			lc::Vec3(0.98, 0.9, 0.35),
 			lc::Vec3(0.35, 0.13, 0.98),
 		};
+		std::vector<lc::ObjInstance> instances(3);
 		for (int ri = 0; ri < 3; ++ri) {
-			std::vector<lc::Triangle> tris = triangles;
-
 			lc::Mat4 transform;
 			transform = glm::translate(transform, positions[ri]);
 			transform = glm::scale(transform, lc::Vec3(9.0));
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-
-			auto mesh = lc::MeshObject();
-			mesh.material = lc::LambertMaterial(colors[ri]);
-			mesh.bvh.set_triangle(tris);
-			mesh.bvh.build();
-
-			scene.add(mesh);
+			instances[ri].transform = transform;
+			instances[ri].material = scene.add_material(lc::LambertMaterial(colors[ri]));
 		}
+
+		auto mesh = lc::MeshObject();
+		lc::load_obj_mesh(mesh, scene, asset_path / "rose.obj", instances);
+		scene.add(mesh);
 	}
 
 	{
@@ -313,118 +441,41 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 		transform = glm::translate(transform, lc::Vec3(0.0, -25.0, 30.0));
 		transform = glm::scale(transform, lc::Vec3(120.0));
 
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "floor.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
-
-		for (int k = 0; k < shapes.size(); ++k) {
-			const tinyobj::shape_t &shape = shapes[k];
-			auto mesh = lc::MeshObject();
-			// mesh.material = lc::CookTorranceMaterial(lc::Vec3(1.0), 0.4, 0.99);
-			// mesh.material = lc::PerfectSpecularMaterial();
-			mesh.material = lc::LambertMaterial(lc::Vec3(1.0));
-
-			std::vector<lc::Triangle> triangles;
-			for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-				lc::Triangle tri;
-				for (int j = 0; j < 3; ++j) {
-					int idx = shape.mesh.indices[i + j];
-					for (int k = 0; k < 3; ++k) {
-						tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-					}
-				}
-				triangles.push_back(tri);
-			}
-			std::vector<lc::Triangle> tris = triangles;
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			mesh.bvh.set_triangle(tris);
-			mesh.bvh.build();
-
-			scene.add(mesh);
-		}
+		auto mesh = lc::MeshObject();
+		// lc::MaterialID floor_material = scene.add_material(lc::CookTorranceMaterial(lc::Vec3(1.0), 0.4, 0.99));
+		// lc::MaterialID floor_material = scene.add_material(lc::PerfectSpecularMaterial());
+		lc::MaterialID floor_material = scene.add_material(lc::LambertMaterial(lc::Vec3(1.0)));
+		lc::load_obj_mesh(mesh, scene, asset_path / "floor.obj", transform, floor_material);
+		scene.add(mesh);
 	}
 
+	// いばら3本をひとつのBVHにする
 	{
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
-		std::string path = (asset_path / "thorn_c.obj").string();
-		bool ret = tinyobj::LoadObj(shapes, materials, err, path.c_str());
-
-		std::vector<lc::Triangle> triangles;
-		auto mesh = lc::MeshObject();
-		mesh.material = lc::CookTorranceMaterial(lc::Vec3(0.3, 0.7, 0.2), 0.4, 0.99);
+		lc::MaterialID thorn_material = scene.add_material(lc::CookTorranceMaterial(lc::Vec3(0.3, 0.7, 0.2), 0.4, 0.99));
 
-		for (int k = 0; k < shapes.size(); ++k) {
-			const tinyobj::shape_t &shape = shapes[k];
-
-			for (size_t i = 0; i < shape.mesh.indices.size(); i += 3) {
-				lc::Triangle tri;
-				for (int j = 0; j < 3; ++j) {
-					int idx = shape.mesh.indices[i + j];
-					for (int k = 0; k < 3; ++k) {
-						tri.v[j][k] = shape.mesh.positions[idx * 3 + k];
-					}
-				}
-				triangles.push_back(tri);
-			}
-		}
-
-		std::vector<lc::Triangle> triangles_thorn;
-
-		{
-			auto tris = triangles;
-			lc::Mat4 transform;
-			transform = glm::rotate(transform, glm::radians(40.0), lc::Vec3(0.0, -1.0, 1.0));
-			transform = glm::translate(transform, lc::Vec3(0.0, -20.0, -10.0));
-			transform = glm::scale(transform, lc::Vec3(200.0));
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			triangles_thorn.insert(triangles_thorn.end(), tris.begin(), tris.end());
-		}
-
-		{
-			auto tris = triangles;
-			lc::Mat4 transform;
-			transform = glm::rotate(transform, glm::radians(20.0), lc::Vec3(0.0, 1.0, 1.0));
-			transform = glm::translate(transform, lc::Vec3(20.0, -40.0, -10.0));
-			transform = glm::scale(transform, lc::Vec3(200.0));
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			triangles_thorn.insert(triangles_thorn.end(), tris.begin(), tris.end());
-		}
-		{
-			auto tris = triangles;
+		std::array<lc::Vec3, 3> axes = {
+			lc::Vec3(0.0, -1.0, 1.0),
+			lc::Vec3(0.0, 1.0, 1.0),
+			lc::Vec3(0.0, 1.0, -1.0),
+		};
+		std::array<double, 3> angles = { 40.0, 20.0, 20.0 };
+		std::array<lc::Vec3, 3> positions = {
+			lc::Vec3(0.0, -20.0, -10.0),
+			lc::Vec3(20.0, -40.0, -10.0),
+			lc::Vec3(-20.0, -40.0, -10.0),
+		};
+		std::vector<lc::ObjInstance> instances(3);
+		for (int ti = 0; ti < 3; ++ti) {
 			lc::Mat4 transform;
-			transform = glm::rotate(transform, glm::radians(20.0), lc::Vec3(0.0, 1.0, -1.0));
-			transform = glm::translate(transform, lc::Vec3(-20.0, -40.0, -10.0));
+			transform = glm::rotate(transform, glm::radians(angles[ti]), axes[ti]);
+			transform = glm::translate(transform, positions[ti]);
 			transform = glm::scale(transform, lc::Vec3(200.0));
-
-			for (int i = 0; i < tris.size(); ++i) {
-				for (int j = 0; j < 3; ++j) {
-					tris[i][j] = lc::mul3x4(transform, tris[i][j]);
-				}
-			}
-			triangles_thorn.insert(triangles_thorn.end(), tris.begin(), tris.end());
+			instances[ti].transform = transform;
+			instances[ti].material = thorn_material;
 		}
 
-		mesh.bvh.set_triangle(triangles_thorn);
-		mesh.bvh.build();
+		auto mesh = lc::MeshObject();
+		lc::load_obj_mesh(mesh, scene, asset_path / "thorn_c.obj", instances);
 		scene.add(mesh);
 	}
 	// ポリゴンライト
@@ -532,13 +583,107 @@ inline void setup_scene(lc::Scene &scene, lc::fs::path asset_path) {
 }
 int main(int argc, char *argv[])
 {
-	char name[1024];
-	GetModuleFileNameA(nullptr, name, sizeof(name));
+	auto exe_dir = executable_path(argv[0]).parent_path();
+
+	bool resume = false;
+	bool worker = false;
+	int merge_count = 0;
+	double merge_timeout = kRENDER_TIME * 2.0;
+	std::string serve_path;
+	std::string keyframe_path;
+	int turntable_count = 0;
+	std::string preview_name;
+	bool preview_float = false;
+	std::string watch_name;
+	int watch_frames = 0;
+	lc::RenderSplit split;
+	std::string split_dir = exe_dir.string();
+	std::string split_run;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--resume") {
+			resume = true;
+		}
+		else if (arg == "--worker" && i + 2 < argc) {
+			worker = true;
+			split.worker_index = std::atoi(argv[++i]);
+			split.worker_count = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (arg == "--split" && i + 1 < argc) {
+			split.mode = std::string(argv[++i]) == "tiles" ? lc::SplitMode::Tiles : lc::SplitMode::Samples;
+		}
+		else if (arg == "--merge" && i + 1 < argc) {
+			merge_count = std::atoi(argv[++i]);
+		}
+		else if (arg == "--timeout" && i + 1 < argc) {
+			merge_timeout = std::atof(argv[++i]);
+		}
+		else if (arg == "--dir" && i + 1 < argc) {
+			split_dir = argv[++i];
+		}
+		else if (arg == "--run" && i + 1 < argc) {
+			split_run = argv[++i];
+		}
+		else if (arg == "--serve" && i + 1 < argc) {
+			serve_path = argv[++i];
+		}
+		else if (arg == "--batch" && i + 1 < argc) {
+			keyframe_path = argv[++i];
+		}
+		else if (arg == "--turntable" && i + 1 < argc) {
+			turntable_count = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (arg == "--preview" && i + 1 < argc) {
+			preview_name = argv[++i];
+		}
+		else if (arg == "--preview-float") {
+			preview_float = true;
+		}
+		else if (arg == "--watch" && i + 1 < argc) {
+			watch_name = argv[++i];
+		}
+		else if (arg == "--frames" && i + 1 < argc) {
+			watch_frames = std::atoi(argv[++i]);
+		}
+	}
+	// 範囲外の番号では受け持ちが空になったりサンプルの並びがずれたりして、まとめ役と食い違う
+	if (worker && (split.worker_index < 0 || split.worker_count <= split.worker_index)) {
+		std::cerr << boost::format("invalid worker index - %d / %d") % split.worker_index % split.worker_count << std::endl;
+		return 1;
+	}
+	std::string checkpoint_path = (exe_dir / "checkpoint.bin").string();
+	std::string part_path = lc::split_part_path(split_dir, split.worker_index, split_run);
+	std::string log_name = "log.txt";
+	if (worker) {
+		char name[64];
+		std::snprintf(name, sizeof(name), "checkpoint_%03d.bin", split.worker_index);
+		checkpoint_path = (lc::fs::path(split_dir) / name).string();
+		std::snprintf(name, sizeof(name), "log_%03d.txt", split.worker_index);
+		log_name = name;
+
+		// 前回の部分が残っているとまとめ役が拾ってしまうので、シーンを作る前 (起動してすぐ) に消す
+		std::remove(part_path.c_str());
+	}
+	else if (0 < merge_count) {
+		log_name = "log_merge.txt";
+	}
+	else if (serve_path.empty() == false) {
+		log_name = "log_serve.txt";
+	}
+	else if (keyframe_path.empty() == false || 0 < turntable_count) {
+		log_name = "log_batch.txt";
+	}
+	else if (watch_name.empty() == false) {
+		log_name = "log_watch.txt";
+	}
+
+	// 再開したときは前回のログに続ける
+	std::ofstream logstream(exe_dir / log_name, resume ? std::ios::app : std::ios::out);
 
-	auto exe_dir = lc::fs::path(name).parent_path();
-	std::ofstream logstream(exe_dir / "log.txt");
+	// 標準入出力で受けるサーバーでは標準出力が応答の行だけになるように、ログは標準エラーへ出す
+	std::ostream &console = serve_path == "-" ? std::cerr : std::cout;
 
-#define LOG_LN(stream) logstream << stream << std::endl; std::cout << stream << std::endl;
+#define LOG_LN(stream) logstream << stream << std::endl; console << stream << std::endl;
 
 	// http://patorjk.com/software/taag/#p=testall&f=Zodi&t=Lost%20Child%20Render
 	LOG_LN(boost::format("_              _      ____ _     _ _     _   ____                _           "));
@@ -552,93 +697,374 @@ int main(int argc, char *argv[])
 
 	LOG_LN(boost::format("auther       : ushiostarfish"));
 	LOG_LN(boost::format("mail         : ushiostarfish@gmail.com"));
-	LOG_LN(boost::format("log          : log.txt"));
+	LOG_LN(boost::format("log          : %s") % log_name);
 	LOG_LN(boost::format("render time  : %.2f") % kRENDER_TIME);
 	LOG_LN(boost::format("save interval: %.2f") % kWRITE_INTERVAL);
 	LOG_LN(boost::format("images       : render_###.png"));
+	LOG_LN(boost::format("checkpoint   : checkpoint.bin (%.2f s)%s") % kCHECKPOINT_INTERVAL % (resume ? ", resume" : ""));
 	LOG_LN(boost::format("image size   : %d x %d") % kSIZE % kSIZE);
+	LOG_LN(boost::format("threads      : %d") % parallel_concurrency());
+	if (worker) {
+		LOG_LN(boost::format("worker       : %d / %d (%s) -> %s") % split.worker_index % split.worker_count % (split.mode == lc::SplitMode::Tiles ? "tiles" : "samples") % part_path);
+	}
 
 	LOG_LN(boost::format(" "));
-	LOG_LN(boost::format("setup..."));
 
-	boost::timer timer;
-	boost::timer write_timer;
+	lc::Stopwatch timer;
+
+	if (0 < merge_count) {
+		LOG_LN(boost::format("merge %d parts in %s...") % merge_count % split_dir);
+		lc::AccumlationBuffer merged;
+		std::string error;
+		int merged_count = lc::merge_split_parts(merged, split_dir, merge_count, merge_timeout, error, split_run);
+		if (merged_count < 0) {
+			LOG_LN(boost::format("merge failed - %s") % error);
+			return 1;
+		}
+		LOG_LN(boost::format("merged - %d / %d parts - %.2f s") % merged_count % merge_count % timer.elapsed());
+		if (merged_count == 0) {
+			return 1;
+		}
+		lc::write_checkpoint(merged, (lc::fs::path(split_dir) / "merged.bin").string());
+
+		double elapsed_nlm = 0.0;
+		bool written = write_final_image((exe_dir / "render_merged_final.png").string(), merged, elapsed_nlm);
+		LOG_LN(boost::format("nlm - %.2f s%s") % elapsed_nlm % (written ? "" : ", write failed"));
+		if (kWRITE_HDR) {
+			lc::write_exr((exe_dir / "render_merged_final.exr").string(), merged);
+		}
+		if (kWRITE_AOV && write_feature_images(exe_dir, merged) == false) {
+			LOG_LN(boost::format("aov - write failed"));
+		}
+		LOG_LN(boost::format("done - %.2f s") % timer.elapsed());
+		return 0;
+	}
+
+	if (watch_name.empty() == false) {
+		LOG_LN(boost::format("watch %s...") % watch_name);
+		lc::PreviewReader reader;
+		while (reader.open(watch_name) == false) {
+			if (merge_timeout < timer.elapsed()) {
+				LOG_LN(boost::format("watch failed - %s") % watch_name);
+				return 1;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+
+		lc::PreviewFrame frame;
+		int written = 0;
+		for (;;) {
+			// 閉じたかを先に見ておけば、閉じる前の最後のフレームを取りこぼさない
+			bool closed = reader.closed();
+			if (reader.read(frame)) {
+				std::string name = boost::str(boost::format("preview_%05d.%s") % frame.frame % (frame.format == lc::PreviewFormat::Rgb8 ? "png" : "exr"));
+				std::string dst = (exe_dir / name).string();
+				bool ok = false;
+				if (frame.format == lc::PreviewFormat::Rgb8) {
+					ok = write_as_png(dst, frame.pixels, frame.width, frame.height);
+				}
+				else {
+					const float *radiance = reinterpret_cast<const float *>(frame.pixels.data());
+					int width = frame.width;
+					ok = lc::write_exr(dst, frame.width, frame.height, [radiance, width](int x, int y) {
+						const float *rgb = radiance + (y * width + x) * 3;
+						return lc::Vec3(rgb[0], rgb[1], rgb[2]);
+					});
+				}
+				LOG_LN(boost::format("frame[%d] - pass %d, %d spp, %.2f s -> %s%s") % frame.frame % frame.pass % frame.spp % frame.elapsed % name % (ok ? "" : " failed"));
+				if (++written == watch_frames) {
+					break;
+				}
+				continue;
+			}
+			if (closed) {
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		LOG_LN(boost::format("done - %d frames, skipped %d - %.2f s") % written % reader.skipped() % timer.elapsed());
+		return 0;
+	}
+
+	LOG_LN(boost::format("setup..."));
+	lc::Stopwatch write_timer;
+	lc::Stopwatch checkpoint_timer;
+	lc::CheckpointWriter checkpoint;
 
 	lc::AccumlationBuffer *_buffer = nullptr;
 	lc::Scene scene;
 
-	_buffer = new lc::AccumlationBuffer(kSIZE, kSIZE);
+	// ワーカーはNLMをかけない (まとめ役がかける)
+	double nlm_seconds = worker ? 0.0 : estimate_denoise_seconds(kSIZE, kSIZE, false);
+	bool use_atrous = (kRENDER_TIME - timer.elapsed()) * kNLM_MAX_FRACTION < nlm_seconds;
+	if (use_atrous) {
+		nlm_seconds = estimate_denoise_seconds(kSIZE, kSIZE, true);
+	}
+
+	// 特徴の平面は画素ごとに7つ増え、タイルの積算やチェックポイントにも乗るので、読むときだけ持つ
+	int planes = lc::AccumlationBuffer::kAllPlanes;
+	if (use_atrous || kWRITE_AOV) {
+		planes |= lc::AccumlationBuffer::kFeaturePlane;
+	}
+	_buffer = new lc::AccumlationBuffer(kSIZE, kSIZE, 50, planes);
+	lc::TileScheduler scheduler(kSIZE, kSIZE);
+	lc::AdaptiveSampling adaptive;
 	setup_scene(scene, exe_dir);
+
+	if (worker) {
+		split.apply(*_buffer, scheduler);
+	}
+
+	if (resume) {
+		if (lc::read_checkpoint(*_buffer, checkpoint_path)) {
+			LOG_LN(boost::format("resumed - %d passes, %d rays per pixel") % _buffer->_iteration % _buffer->samples_per_pixel());
+		}
+		else {
+			LOG_LN(boost::format("resume failed - start from scratch"));
+		}
+	}
 	
 	LOG_LN(boost::format("initialized - %.2f s") % timer.elapsed());
 
-	double step_time_sum = 0.0;
+	if (serve_path.empty() == false) {
+		lc::RenderServer server(scene, [](const std::string &path, const lc::AccumlationBuffer &buffer) {
+			if (lc::fs::path(path).extension() == ".bin") {
+				return lc::write_checkpoint(buffer, path);
+			}
+			if (lc::fs::path(path).extension() == ".exr") {
+				return lc::write_exr(path, buffer);
+			}
+			std::vector<uint8_t> pixels;
+			lc::post_process(pixels, buffer);
+			return write_as_png(path, pixels, buffer._width, buffer._height, lc::PngCompression::High);
+		});
+		if (serve_path == "-") {
+			server.serve_stream(std::cin, std::cout);
+		}
+		else {
+			LOG_LN(boost::format("serve - %s") % serve_path);
+			if (server.serve_unix_socket(serve_path) == false) {
+				LOG_LN(boost::format("serve failed - %s") % serve_path);
+				return 1;
+			}
+		}
+		return 0;
+	}
 
-	lc::Image image;
-	std::future<int> save_task = std::async(std::launch::async, []() { return 0; });
+	if (keyframe_path.empty() == false || 0 < turntable_count) {
+		lc::Keyframe base;
+		base.view_transform = scene.viewTransform;
+		base.camera = scene.camera.settings();
+
+		std::vector<lc::Keyframe> keyframes;
+		if (0 < turntable_count) {
+			// setup_scene の視点から原点のまわりを一周
+			base.seconds = kRENDER_TIME / turntable_count;
+			lc::Vec3 eye = scene.viewTransform.to_local_position(lc::Vec3());
+			keyframes = lc::make_turntable(base, eye, lc::Vec3(), lc::Vec3(0.0, 1.0, 0.0), turntable_count);
+		}
+		else {
+			// 時間を書いていないフレームは kRENDER_TIME を等分するので、フレーム数を数えてから読み直す
+			std::string error;
+			bool ok = lc::read_keyframes(keyframe_path, base, keyframes, error);
+			if (ok && keyframes.empty() == false) {
+				base.seconds = kRENDER_TIME / keyframes.size();
+				ok = lc::read_keyframes(keyframe_path, base, keyframes, error);
+			}
+			if (ok == false) {
+				LOG_LN(boost::format("batch failed - %s") % error);
+				return 1;
+			}
+		}
+		LOG_LN(boost::format("batch - %d frames") % keyframes.size());
+
+		// 書き出しは後処理のスレッドで走るので、失敗は数えておいて最後に出す
+		std::atomic<int> failed_frames(0);
+		lc::render_batch(scene, keyframes, kSIZE, kSIZE, 2, [&exe_dir, &failed_frames](int frame, const lc::AccumlationBuffer &buffer) {
+			std::string name = boost::str(boost::format("frame_%03d.png") % frame);
+			double elapsed_nlm = 0.0;
+			if (write_final_image((exe_dir / name).string(), buffer, elapsed_nlm) == false) {
+				failed_frames++;
+			}
+		}, [&](const lc::BatchFrameStats &stats) {
+			LOG_LN(boost::format("frame[%d] - %.2f s, %d passes, %d spp, wait %.2f s") % stats.frame % stats.render_seconds % stats.passes % stats.spp % stats.wait_seconds);
+		});
+		LOG_LN(boost::format("done - %.2f s%s") % timer.elapsed() % (failed_frames == 0 ? "" : boost::str(boost::format(", %d frames failed to write") % failed_frames)));
+		return 0;
+	}
+
+	double save_seconds = 0.0;
+	double post_seconds = 0.0;
+	LOG_LN(boost::format("%s estimate - %.2f s") % (use_atrous ? "atrous" : "nlm") % nlm_seconds);
+
+	// 最終フレームの PNG (High) と EXR は見積もって差し引く。ワーカーは書かない
+	double final_png_seconds = 0.0;
+	double exr_seconds = 0.0;
+	if (worker == false) {
+		estimate_final_write_seconds(exe_dir, kSIZE, kSIZE, kWRITE_HDR, final_png_seconds, exr_seconds);
+		LOG_LN(boost::format("write estimate - png %.2f s, exr %.2f s") % final_png_seconds % exr_seconds);
+	}
+
+	// チェックポイントは実際に書いた時間を差し引く。まだ一度も書いていなければ最後のチェックポイントは書かない (ワーカーの部分は必ず書く)
+	double checkpoint_seconds = 0.0;
+
+	// 凍結したタイルは描き足さないので、凍結を受けつけるのは締め切りの前の nlm_seconds だけ
+	std::unique_ptr<lc::TileDenoisePipeline> pipeline;
+	if (kPIPELINED_DENOISE && worker == false && use_atrous == false) {
+		pipeline.reset(new lc::TileDenoisePipeline(*_buffer, scheduler, lc::kNonLocalMeansRadius, [](lc::Image &dst, const lc::Image &src) {
+			lc::non_local_means(dst, src, kNLM_COEF);
+		}));
+	}
+	double full_nlm_seconds = nlm_seconds;
+
+	// 後処理とPNGの書き込みは書き出しスレッドで行う。描画側は色を写すだけで待たない
+	lc::SnapshotQueue snapshots([](const lc::AccumlationBuffer &snapshot, const std::string &path) {
+		std::vector<uint8_t> pixels;
+		lc::post_process(pixels, snapshot);
+		return write_as_png(path, pixels, snapshot._width, snapshot._height);
+	});
+
+	// 途中経過を共有メモリへ流す。見る側がいなくても、遅くても描画は待たない
+	lc::PreviewPublisher preview;
+	if (preview_name.empty() == false) {
+		if (preview.open(preview_name, kSIZE, kSIZE, kPREVIEW_SIZE, preview_float ? lc::PreviewFormat::RgbFloat : lc::PreviewFormat::Rgb8)) {
+			LOG_LN(boost::format("preview - %s (%d x %d)") % preview_name % preview.width() % preview.height());
+		}
+		else {
+			LOG_LN(boost::format("preview failed - %s") % preview_name);
+		}
+	}
 
 	int i = 0;
 	for (i = 0; ; ++i) {
-		boost::timer timer_step;
+		lc::Stopwatch timer_step;
+
+		// 書き出し中のスナップショットの待ち、最終フレームの PNG と EXR、最後のチェックポイント
+		// EXR とチェックポイントはNLMと並行して書くが、CPUとディスクを取り合うので足しておく
+		post_seconds = (nlm_seconds + save_seconds + final_png_seconds + exr_seconds + checkpoint_seconds) * kPOST_SAFETY + kPOST_MARGIN;
+		auto deadline = lc::after_seconds(timer._beg, kRENDER_TIME - post_seconds);
+
+		// 締め切りに達したらタイルの途中でも止まる
+		bool completed = lc::step_adaptive(*_buffer, scene, 2, scheduler, adaptive, deadline);
+
+		if (completed) {
+			preview.publish(*_buffer, i, timer.elapsed());
+		}
+
+		if (pipeline && kRENDER_TIME - post_seconds - full_nlm_seconds < timer.elapsed()) {
+			pipeline->update(adaptive);
+
+			// 残りのNLMはまだデノイズしていないタイルのハロー込みの分だけ (画像全体にかけるより高くはならない)
+			nlm_seconds = full_nlm_seconds * pipeline->remaining_cost();
+		}
 
-		lc::step(*_buffer, scene, 2);
+		// すべて凍結したら描くものがない
+		if (pipeline && pipeline->frozen_count() == pipeline->tile_count()) {
+			LOG_LN(boost::format("step[%d] - %.2f s, all tiles frozen") % i % timer.elapsed());
+			break;
+		}
+
+		// 時間が余っているので、全部収束したら目標を厳しくして続ける
+		if (adaptive.converged()) {
+			adaptive.target_error *= 0.5;
+			LOG_LN(boost::format("converged - target error %.4f") % adaptive.target_error);
+		}
 
 		// あんまり書きすぎないように
 		bool wrote = false;
 		std::string name = boost::str(boost::format("render_%03d.png") % i);
 		std::string dst = (exe_dir / name).string();
-		if (i == 0 || kWRITE_INTERVAL < write_timer.elapsed()) {
-			save_task.get();
-
-			_buffer->to_image(image);
-
-			save_task = std::async(std::launch::async, [&image, dst]() {
-				lc::tone_mapping(image);
-				lc::contrast(image, 1.15);
-				lc::gamma(image);
-				
-				write_as_png(dst, image);
-				return 0; 
-			});
+		if (worker == false && completed && (i == 0 || kWRITE_INTERVAL < write_timer.elapsed())) {
+			snapshots.submit(*_buffer, dst);
+			save_seconds = snapshots.stats().max_write_seconds;
 
 			write_timer.restart();
 
 			wrote = true;
 		}
+
+		// 書き込み中なら次の機会に回す
+		if (completed && kCHECKPOINT_INTERVAL < checkpoint_timer.elapsed()) {
+			if (checkpoint.write_async(*_buffer, checkpoint_path)) {
+				checkpoint_timer.restart();
+			}
+		}
+		if (checkpoint.busy() == false) {
+			checkpoint_seconds = std::max(checkpoint_seconds, checkpoint.wait());
+		}
 		
 		double elapsed = timer.elapsed();
 		double step_elapsed = timer_step.elapsed();
-		LOG_LN(boost::format("step[%d] - %.2f s (%.2f s)") % i % elapsed % step_elapsed);
+		LOG_LN(boost::format("step[%d] - %.2f s (%.2f s)%s, %d spp, converged tiles %d / %d") % i % elapsed % step_elapsed % (completed ? "" : " partial") % _buffer->samples_per_pixel() % adaptive.converged_count % scheduler.tiles.size());
 
-		step_time_sum += step_elapsed;
-		double avg = step_time_sum / (i + 1);
-
-		// 次のステップを回したら、間に合わなそうならここで終了
-		if (kRENDER_TIME - kNLM_TIME_ESTIMATE < elapsed + avg * 1.3) {
+		if (completed == false) {
 			break;
 		}
 	}
 
 	// 最終フレーム処理
-	save_task.get();
-
-	_buffer->to_image(image);
-
+	preview.close();
+	snapshots.flush();
 	{
-		lc::Image nlm_image;
-		boost::timer timer_nlm;
-		lc::non_local_means(nlm_image, image, kNLM_COEF);
-		double elapsed_nlm = timer_nlm.elapsed();
+		lc::SnapshotStats stats = snapshots.stats();
+		LOG_LN(boost::format("snapshots - written %d / %d, coalesced %d, dropped %d, failed %d, max %.2f s") % stats.written % stats.submitted % stats.coalesced % stats.dropped % stats.failed % stats.max_write_seconds);
+	}
 
-		lc::tone_mapping(nlm_image);
-		lc::contrast(nlm_image, 1.15);
-		lc::gamma(nlm_image);
+	if (worker) {
+		checkpoint.wait();
+		lc::Stopwatch timer_part;
+		bool ok = lc::write_checkpoint(*_buffer, part_path);
+		LOG_LN(boost::format("part - %.2f s%s") % timer_part.elapsed() % (ok ? "" : " failed"));
+		LOG_LN(boost::format("done - %.2f s") % timer.elapsed());
+		return ok ? 0 : 1;
+	}
+
+	// 最後の状態をNLMと並行して書いておく (締め切りの見積もりに入っているときだけ)
+	checkpoint.wait();
+	bool final_checkpoint = 0.0 < checkpoint_seconds && checkpoint.write_async(*_buffer, checkpoint_path);
+
+	// 放射輝度のEXRもNLMと並行して書く (描画はもう止まっているので積算バッファは読むだけ)
+	std::future<bool> exr_task;
+	double exr_write_seconds = 0.0;
+	if (kWRITE_HDR) {
+		std::string exr_path = (exe_dir / boost::str(boost::format("render_%03d_final.exr") % i)).string();
+		exr_task = std::async(std::launch::async, [_buffer, &exr_write_seconds, exr_path]() {
+			lc::Stopwatch timer_exr;
+			bool ok = lc::write_exr(exr_path, *_buffer);
+			exr_write_seconds = timer_exr.elapsed();
+			return ok;
+		});
+	}
+	LOG_LN(boost::format("post reserve - %.2f s (nlm %.2f s, save %.2f s, png %.2f s, exr %.2f s, checkpoint %.2f s)") % post_seconds % nlm_seconds % save_seconds % final_png_seconds % exr_seconds % checkpoint_seconds);
 
+	{
 		std::string name = boost::str(boost::format("render_%03d_final.png") % i);
 		std::string dst = (exe_dir / name).string();
-		write_as_png(dst, nlm_image);
+		if (pipeline) {
+			int denoised = pipeline->denoised_count();
+			lc::Stopwatch timer_nlm;
+			pipeline->finish();
+			double elapsed_nlm = timer_nlm.elapsed();
 
-		LOG_LN(boost::format("nlm - %.2f s") % elapsed_nlm);
+			std::vector<uint8_t> pixels;
+			lc::post_process(pixels, pipeline->image());
+			bool written = write_as_png(dst, pixels, kSIZE, kSIZE, lc::PngCompression::High);
+
+			LOG_LN(boost::format("nlm - %.2f s (pipelined %d / %d tiles)%s") % elapsed_nlm % denoised % pipeline->tile_count() % (written ? "" : ", write failed"));
+		}
+		else {
+			double elapsed_nlm = 0.0;
+			bool written = write_final_image(dst, *_buffer, elapsed_nlm, use_atrous);
+
+			LOG_LN(boost::format("%s - %.2f s%s") % (use_atrous ? "atrous" : "nlm") % elapsed_nlm % (written ? "" : ", write failed"));
+		}
+	}
+	if (kWRITE_AOV && write_feature_images(exe_dir, *_buffer) == false) {
+		LOG_LN(boost::format("aov - write failed"));
+	}
+	if (exr_task.valid()) {
+		bool ok = exr_task.get();
+		LOG_LN(boost::format("exr - %.2f s%s") % exr_write_seconds % (ok ? "" : " failed"));
 	}
 	/*
 	lc::Image nlm_image;
@@ -657,11 +1083,19 @@ int main(int argc, char *argv[])
 		LOG_LN(boost::format("nlm - %.2f s") % elapsed_nlm);
 	}
 	*/
+	if (final_checkpoint) {
+		double seconds = checkpoint.wait();
+		LOG_LN(boost::format("checkpoint - %.2f s%s") % seconds % (checkpoint.succeeded() ? "" : " failed"));
+	}
+	else {
+		LOG_LN(boost::format("checkpoint - skipped (not measured yet)"));
+	}
+
 	double elapsed = timer.elapsed();
 	LOG_LN(boost::format("done - %.2f s") % elapsed);
 
 	while (timer.elapsed() < kRENDER_TIME) {
-		Sleep(0);
+		std::this_thread::yield();
 	}
 
     return 0;